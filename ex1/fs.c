@@ -5,15 +5,53 @@
 #include <pthread.h>
 #include <assert.h>
 
-#define MUTEX_COMMAND_UNLOCK(commandLock) pthread_mutex_unlock(&commandLock)
-
-void mutexCommandUnlock();
-pthread_mutex_t commandLock;
+/* Each thread allocates inumbers from its own cache of freed ones and
+ * its own range of fresh ones, so the shared state is only touched once
+ * every INUMBER_RANGE allocations or releases. Inumbers left in the
+ * cache of a thread that exits are not reused. */
+static __thread int freedInumbers[2 * INUMBER_RANGE];
+static __thread int numberFreed;
+static __thread int rangeNext, rangeEnd; // Fresh inumbers [rangeNext, rangeEnd)
 
 int obtainNewInumber(tecnicofs* fs) {
-	int newInumber = ++(fs->nextINumber);
-	MUTEX_COMMAND_UNLOCK(commandLock); // Unlocking the iNumber obtainment function
-	return newInumber;
+	if (numberFreed == 0 && __atomic_load_n(&fs->freeInumbers, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&fs->inumberLock);
+		inumber_batch* batch = fs->freeInumbers;
+		if (batch)
+			fs->freeInumbers = batch->next;
+		pthread_mutex_unlock(&fs->inumberLock);
+		if (batch) {
+			memcpy(freedInumbers, batch->inumbers, sizeof(batch->inumbers));
+			numberFreed = INUMBER_RANGE;
+			free(batch);
+		}
+	}
+	if (numberFreed > 0)
+		return freedInumbers[--numberFreed];
+	if (rangeNext == rangeEnd) {
+		rangeNext = __atomic_fetch_add(&fs->nextINumber, INUMBER_RANGE, __ATOMIC_RELAXED) + 1;
+		rangeEnd = rangeNext + INUMBER_RANGE;
+	}
+	return rangeNext++;
+}
+
+/* Makes inumber available again, handing half of the cache to the other
+ * threads once it is full */
+void releaseInumber(tecnicofs* fs, int inumber) {
+	if (numberFreed == 2 * INUMBER_RANGE) {
+		inumber_batch* batch = malloc(sizeof(inumber_batch));
+		if (!batch) {
+			perror("failed to allocate inumber batch");
+			exit(EXIT_FAILURE);
+		}
+		numberFreed -= INUMBER_RANGE;
+		memcpy(batch->inumbers, freedInumbers + numberFreed, sizeof(batch->inumbers));
+		pthread_mutex_lock(&fs->inumberLock);
+		batch->next = fs->freeInumbers;
+		__atomic_store_n(&fs->freeInumbers, batch, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&fs->inumberLock);
+	}
+	freedInumbers[numberFreed++] = inumber;
 }
 
 tecnicofs* new_tecnicofs(){
@@ -23,12 +61,26 @@ tecnicofs* new_tecnicofs(){
 		exit(EXIT_FAILURE);
 	}
 	fs->nextINumber = 0;
+	fs->freeInumbers = NULL;
+	if (pthread_mutex_init(&fs->inumberLock, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't initialize mutex\n");
+		exit(EXIT_FAILURE);
+	}
 	fs->bstRoot = NULL;
 	return fs;
 }
 
 void free_tecnicofs(tecnicofs* fs){
 	free_tree(fs->bstRoot);
+	while (fs->freeInumbers) {
+		inumber_batch* batch = fs->freeInumbers;
+		fs->freeInumbers = batch->next;
+		free(batch);
+	}
+	if (pthread_mutex_destroy(&fs->inumberLock) != 0) {
+		fprintf(stderr, "Error: Couldn't destroy mutex\n");
+		exit(EXIT_FAILURE);
+	}
 	free(fs);
 }
 
@@ -37,7 +89,12 @@ void create(tecnicofs* fs, char *name, int inumber){
 }
 
 void delete(tecnicofs* fs, char *name){
+	node* searchNode = search(fs->bstRoot, name);
+	if (!searchNode)
+		return;
+	int inumber = searchNode->inumber;
 	fs->bstRoot = remove_item(fs->bstRoot, name);
+	releaseInumber(fs, inumber);
 }
 
 int lookup(tecnicofs* fs, char *name){
@@ -1,13 +1,25 @@
 #ifndef FS_H
 #define FS_H
 #include "lib/bst.h"
+#include <pthread.h>
+
+#define INUMBER_RANGE 64 // Inumbers a thread reserves or hands back at a time
+
+/* Freed inumbers travel between threads INUMBER_RANGE at a time */
+typedef struct inumber_batch {
+    int inumbers[INUMBER_RANGE];
+    struct inumber_batch* next;
+} inumber_batch;
 
 typedef struct tecnicofs {
     node* bstRoot;
-    int nextINumber;
+    int nextINumber; // Every inumber up to it was handed to a thread, read and written atomically
+    inumber_batch* freeInumbers;
+    pthread_mutex_t inumberLock; // Only for freeInumbers
 } tecnicofs;
 
 int obtainNewInumber(tecnicofs* fs);
+void releaseInumber(tecnicofs* fs, int inumber);
 tecnicofs* new_tecnicofs();
 void free_tecnicofs(tecnicofs* fs);
 void create(tecnicofs* fs, char *name, int inumber);
@@ -1,11 +1,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include "bst.h"
 
+/* An AVL tree is at most 1.44*log2(n) high, so 96 levels
+ * covers any tree that fits in memory */
+#define MAX_TREE_HEIGHT 96
+
 void insertDelay(int cycles){
-    for(int i=0; i < cycles; i++){}
+    for(volatile int i=0; i < cycles; i++){}
+}
+
+/* Latency injection, to reproduce contention on the trees: every level
+ * an operation walks spins for treeDelays[op] iterations. All are 0
+ * unless configured, and then only cost one load per operation. */
+static int treeDelays[DELAY_OPS];
+static const char* delayNames[DELAY_OPS] = { "search", "insert", "remove" };
+
+static int tree_delay(delay_op op) {
+    return __atomic_load_n(&treeDelays[op], __ATOMIC_RELAXED);
+}
+
+/*
+ * Sets the delay of every operation from a spec such as
+ * "search=5000,insert" (an operation without a value gets DELAY, "all"
+ * names every one). Operations not named are not delayed, so a NULL or
+ * empty spec turns injection off.
+ * Returns:
+ *    0: if successful
+ *   -1: if the spec is invalid, leaving the delays as they were
+ */
+int delay_configure(const char* spec) {
+    int delays[DELAY_OPS] = { 0 };
+
+    while (spec && *spec) {
+        size_t nameLength = strcspn(spec, "=,");
+        int cycles = DELAY, op;
+        for (op = 0; op < DELAY_OPS; op++) {
+            if (strlen(delayNames[op]) == nameLength && !strncmp(spec, delayNames[op], nameLength))
+                break;
+        }
+        if (op == DELAY_OPS && !(nameLength == 3 && !strncmp(spec, "all", 3)))
+            return -1;
+        spec += nameLength;
+        if (*spec == '=') {
+            char* end;
+            long value = strtol(spec + 1, &end, 10);
+            if (end == spec + 1 || value < 0 || value > INT_MAX)
+                return -1;
+            cycles = value;
+            spec = end;
+        }
+        if (*spec == ',')
+            spec++;
+        else if (*spec)
+            return -1;
+        for (int i = 0; i < DELAY_OPS; i++) {
+            if (op == DELAY_OPS || op == i)
+                delays[i] = cycles;
+        }
+    }
+    for (int i = 0; i < DELAY_OPS; i++) {
+        __atomic_store_n(&treeDelays[i], delays[i], __ATOMIC_RELAXED);
+    }
+    return 0;
 }
 
 node* new_node(char* key, int inumber)
@@ -20,6 +80,7 @@ node* new_node(char* key, int inumber)
 
     strncpy(p->key, key, size);
     p->inumber = inumber;
+    p->height = 1;
     p->left  = NULL;
     p->right = NULL;
     return p;
@@ -30,106 +91,205 @@ int max(int a, int b)
     return a > b ? a : b;
 }
 
-node* search(node* p, char* key)
+static int height(node* p)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
+    return p ? p->height : 0;
+}
 
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        return search(p->left, key);
-    else if (comp > 0)
-        return search(p->right, key);
-    else
-        return p;
+static void update_height(node* p)
+{
+    p->height = max(height(p->left), height(p->right)) + 1;
 }
 
-node* insert(node* p, char* key, int inumber)
+static node* rotate_right(node* p)
 {
-    insertDelay(DELAY);
-    if (!p){
-        return new_node(key, inumber);
+    node* l = p->left;
+    p->left = l->right;
+    l->right = p;
+    update_height(p);
+    update_height(l);
+    return l;
+}
+
+static node* rotate_left(node* p)
+{
+    node* r = p->right;
+    p->right = r->left;
+    r->left = p;
+    update_height(p);
+    update_height(r);
+    return r;
+}
+
+/* Restores the AVL invariant at p, assuming both subtrees
+ * are balanced, and returns the new subtree root */
+static node* rebalance(node* p)
+{
+    update_height(p);
+    int balance = height(p->left) - height(p->right);
+    if (balance > 1) {
+        if (height(p->left->left) < height(p->left->right))
+            p->left = rotate_left(p->left);
+        return rotate_right(p);
+    }
+    if (balance < -1) {
+        if (height(p->right->right) < height(p->right->left))
+            p->right = rotate_right(p->right);
+        return rotate_left(p);
+    }
+    return p;
+}
+
+/* Rebalances the subtrees referenced by the links in path, from
+ * the deepest up, stopping once a subtree keeps its height */
+static void rebalance_path(node** path[], int depth)
+{
+    while (depth > 0) {
+        node** link = path[--depth];
+        int oldHeight = (*link)->height;
+        *link = rebalance(*link);
+        if ((*link)->height == oldHeight)
+            break;
     }
+}
+
+node* search(node* p, char* key)
+{
+    int delay = tree_delay(DELAY_SEARCH);
 
-    int comp = strcmp(key, p->key);
-    if (comp < 0){
-        p->left = insert(p->left, key, inumber);
+    while (p) {
+        if (delay)
+            insertDelay(delay);
+        int comp = strcmp(key, p->key);
+        if (comp < 0)
+            p = p->left;
+        else if (comp > 0)
+            p = p->right;
+        else
+            return p;
     }
-    else if (comp > 0){
-        p->right = insert(p->right, key, inumber);
+    return NULL;
+}
+
+node* insert(node* p, char* key, int inumber)
+{
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
+    int delay = tree_delay(DELAY_INSERT);
+
+    while (*link) {
+        if (delay)
+            insertDelay(delay);
+        int comp = strcmp(key, (*link)->key);
+        if (comp == 0) {
+            (*link)->inumber = inumber;
+            return p;
+        }
+        path[depth++] = link;
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
     }
-    else 
-        p->inumber = inumber;
+    *link = new_node(key, inumber);
+    rebalance_path(path, depth);
     return p;
 }
 
 node* find_min(node* p)
 {
-    if ( p->left != NULL )
-        return find_min(p->left);
-    else
-        return p;
+    while (p->left != NULL)
+        p = p->left;
+    return p;
 }
 
+/* Unlinks the minimum of p without freeing it */
 node* remove_min(node* p)
 {
-    if ( p->left == NULL )
-        return p->right;
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
 
-    p->left = remove_min(p->left);
+    while ((*link)->left != NULL) {
+        path[depth++] = link;
+        link = &(*link)->left;
+    }
+    *link = (*link)->right;
+    rebalance_path(path, depth);
     return p;
 }
 
 node* remove_item(node* p, char* key)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
-    
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        p->left = remove_item(p->left, key);
-    else if (comp > 0)
-        p->right = remove_item(p->right, key);
-    else
-    {
-        node* l = p->left;
-        node* r = p->right;
-        node* m;
-        free(p->key);
-        free(p);
-
-        if (r == NULL)
-            return l;
-
-        m = find_min(r);
-        m->right = remove_min(r);        
-        m->left = l;
-
-        return m;
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
+    int delay = tree_delay(DELAY_REMOVE);
+
+    while (*link) {
+        if (delay)
+            insertDelay(delay);
+        int comp = strcmp(key, (*link)->key);
+        if (comp == 0)
+            break;
+        path[depth++] = link;
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
     }
+    if (!*link)
+        return p;
 
+    node* m = *link;
+    if (m->left == NULL || m->right == NULL) {
+        *link = m->left ? m->left : m->right;
+    } else {
+        node* successor = find_min(m->right);
+        successor->right = remove_min(m->right);
+        successor->left = m->left;
+        successor->height = m->height;
+        *link = successor;
+        path[depth++] = link;
+    }
+    free(m->key);
+    free(m);
+
+    rebalance_path(path, depth);
     return p;
 }
 
+/* Rotates every left child up into the right spine and frees the
+ * spine as it goes, so no stack is needed whatever the tree shape */
 void free_tree(node* p)
 {
-    if (!p)
-        return;
-
-    free_tree(p->left);
-    free_tree(p->right);
-    free(p->key);
-    free(p);
+    while (p) {
+        if (p->left) {
+            node* l = p->left;
+            p->left = l->right;
+            l->right = p;
+            p = l;
+        } else {
+            node* r = p->right;
+            free(p->key);
+            free(p);
+            p = r;
+        }
+    }
 }
 
 void print_tree_2(FILE * fp, node* p, int l)
 {
-    if (p) {
-        print_tree_2(fp, p->left, l+1);
+    node* stack[MAX_TREE_HEIGHT];
+    int levels[MAX_TREE_HEIGHT];
+    int top = 0;
+
+    while (p || top > 0) {
+        while (p) {
+            stack[top] = p;
+            levels[top++] = l++;
+            p = p->left;
+        }
+        p = stack[--top];
+        l = levels[top];
         fprintf(fp, "%*s%s\n", 2*(l+1), "" , p->key);
-        print_tree_2(fp, p->right, l+1);
+        p = p->right;
+        l++;
     }
 }
 
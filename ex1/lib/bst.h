@@ -3,17 +3,23 @@
 #define BST_H
 #include <stdio.h>
 
-#define DELAY 5000
+#define DELAY 5000 // Iterations per tree level for an operation enabled without a value
+#define DELAY_ENV "TECNICOFS_DELAY"
+
+/* Tree operations that can be slowed down on purpose */
+typedef enum delay_op { DELAY_SEARCH, DELAY_INSERT, DELAY_REMOVE, DELAY_OPS } delay_op;
 
 typedef struct node {
     char* key;
     int inumber;
+    int height;
 
     struct node* left;
     struct node* right;
 } node;
 
 void insertDelay(int cycles);
+int delay_configure(const char* spec);
 node *search(node *p, char* key);
 node *insert(node *p, char* key, int inumber);
 node *find_min(node *p);
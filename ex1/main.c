@@ -6,15 +6,21 @@
 #include <pthread.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "fs.h"   
 
-#define MAX_COMMANDS 150000
 #define MAX_INPUT_SIZE 100
+#define CHUNK_SIZE (256 << 10) // Input bytes parsed at a time, a multiple of the page size
+#define CHUNK_WINDOW 8 // Chunks parsed ahead of or being applied at any time
 
 // Thread variables
-pthread_mutex_t commandLock; // For the command vector access and iNumber obtainment
+pthread_mutex_t commandLock; // For the command vector access
 pthread_mutex_t treeLock; // For the create, lookup and delete operations (using mutex)
 pthread_rwlock_t treeRWLock; // For the create, lookup and delete operations (using rwlock)
+pthread_cond_t chunkParsed; // Signaled under commandLock whenever a chunk is parsed
 
 int operationStatus; // Global variable intended for assert operations
 
@@ -49,14 +55,36 @@ int operationStatus; // Global variable intended for assert operations
 
 // Struct and file variables
 tecnicofs* fs;
-FILE *input,*output; 
+FILE *output; 
+
+/* The input is mapped and split in chunks of CHUNK_SIZE bytes, each
+ * holding the lines that start in it. Threads claim chunks in order and
+ * parse them while others apply the commands of earlier chunks, and at
+ * most CHUNK_WINDOW chunks are parsed and not yet applied, so memory
+ * does not grow with the input. */
+typedef struct command {
+    const char* name; // Points into the mapped input
+    int nameLength;
+    char token;
+} command;
+
+typedef struct chunk {
+    command* commands;
+    int numberCommands;
+    int capacity;
+    int parsed;
+} chunk;
 
 //Command variables
-char inputCommands[MAX_COMMANDS][MAX_INPUT_SIZE];
 char inputFile[MAX_INPUT_SIZE];
 char outputFile[MAX_INPUT_SIZE];
-int numberCommands = 0;
-int headQueue = 0;
+const char* inputData;
+size_t inputSize;
+long numberChunks;
+long headChunk = 0; // Chunk whose commands are being applied
+long nextChunk = 0; // First chunk not claimed by a parser yet
+int headCommand = 0; // Next command of the head chunk
+chunk window[CHUNK_WINDOW]; // Chunk i lives in window[i % CHUNK_WINDOW]
 
 static void displayUsage (const char* appName){
     printf("Usage: %s\n", appName);
@@ -76,79 +104,149 @@ static void parseArgs (long argc, char* const argv[]){
     }
 }
 
-int insertCommand(char* data) {
-    if(numberCommands != MAX_COMMANDS) {
-        strcpy(inputCommands[numberCommands++], data);
-        return 1;
-    }
-    return 0;
+void errorParse(){
+    fprintf(stderr, "Error: command invalid\n");
+    //exit(EXIT_FAILURE);
 }
 
-char* removeCommand() {
-    MUTEX_COMMAND_LOCK(commandLock); // Limiting the command vector usage to one thread at a time
-    if(numberCommands > 0){
-        numberCommands--;
-        return inputCommands[headQueue++];  
+static void openInput(const char* path){
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        perror(path);
+        exit(1);
     }
-    MUTEX_COMMAND_UNLOCK(commandLock); // Unlocking immediately when there are no more commands left
-    return NULL;
+    inputSize = info.st_size;
+    numberChunks = (inputSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (inputSize > 0) {
+        inputData = mmap(NULL, inputSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (inputData == MAP_FAILED) {
+            perror(path);
+            exit(1);
+        }
+        madvise((void*) inputData, inputSize, MADV_SEQUENTIAL);
+    }
+    close(fd);
 }
 
-void errorParse(){
-    fprintf(stderr, "Error: command invalid\n");
-    //exit(EXIT_FAILURE);
+static void closeInput(){
+    for (int i = 0; i < CHUNK_WINDOW; i++)
+        free(window[i].commands);
+    if (inputSize > 0)
+        munmap((void*) inputData, inputSize);
 }
 
-void processInput(){
-    char line[MAX_INPUT_SIZE];
-
-    while (fgets(line, sizeof(line)/sizeof(char), input)) { 
-        char token;
-        char name[MAX_INPUT_SIZE];
-        int numTokens = sscanf(line, "%c %s", &token, name);
+/* Reads a line the way sscanf(line, "%c %s", ...) would */
+static void parseLine(chunk* c, const char* line, const char* end){
+    char token = *line;
+    const char* name = line + 1;
+    while (name < end && isspace((unsigned char) *name))
+        name++;
+    const char* nameEnd = name;
+    while (nameEnd < end && !isspace((unsigned char) *nameEnd))
+        nameEnd++;
+    int numTokens = nameEnd > name ? 2 : 1;
 
-        /* perform minimal validation */
-        if (numTokens < 1) {
-            continue;
-        }
-        switch (token) {
-            case 'c':
-            case 'l':
-            case 'd':
-                if(numTokens != 2)
-                    errorParse();
-                if(insertCommand(line)) {
-                    break;
-                }                    
-                return;
-            case '#':
-                break;
-            default: { /* error */
+    switch (token) {
+        case 'c':
+        case 'l':
+        case 'd':
+            if (numTokens != 2 || nameEnd - name >= MAX_INPUT_SIZE) {
                 errorParse();
+                return;
+            }
+            if (c->numberCommands == c->capacity) {
+                c->capacity = c->capacity ? 2 * c->capacity : 1024;
+                c->commands = realloc(c->commands, c->capacity * sizeof(command));
+                if (!c->commands) {
+                    perror("Failed to allocate commands");
+                    exit(EXIT_FAILURE);
+                }
             }
+            c->commands[c->numberCommands++] = (command) { name, nameEnd - name, token };
+            break;
+        case '#':
+            break;
+        default: { /* error */
+            errorParse();
         }
     }
 }
 
+static void parseChunk(long index, chunk* c){
+    const char* end = inputData + inputSize;
+    const char* line = inputData + index * CHUNK_SIZE;
+    const char* last = index == numberChunks - 1 ? end : line + CHUNK_SIZE;
 
-void* applyCommands(){
-    while(numberCommands > 0){
-        const char* command = removeCommand(); 
-        if (command == NULL) {
+    if (index > 0 && line[-1] != '\n') { // The line crossing into this chunk belongs to the previous one
+        const char* newline = memchr(line, '\n', end - line);
+        line = newline ? newline + 1 : end;
+    }
+    c->numberCommands = 0;
+    while (line < last) {
+        const char* newline = memchr(line, '\n', end - line);
+        parseLine(c, line, newline ? newline : end);
+        line = newline ? newline + 1 : end;
+    }
+}
+
+/* Takes the next command in input order into token and name, parsing
+ * chunks ahead while the window has room. Returns 1 holding commandLock,
+ * which the caller releases once it has copied the command, or 0 once
+ * every command was taken. */
+int removeCommand(char* token, char* name) {
+    MUTEX_COMMAND_LOCK(commandLock); // Limiting the command vector usage to one thread at a time
+    while (1) {
+        if (nextChunk < numberChunks && nextChunk < headChunk + CHUNK_WINDOW) {
+            long index = nextChunk++;
+            MUTEX_COMMAND_UNLOCK(commandLock);
+            parseChunk(index, &window[index % CHUNK_WINDOW]);
+            MUTEX_COMMAND_LOCK(commandLock);
+            window[index % CHUNK_WINDOW].parsed = 1;
+            pthread_cond_broadcast(&chunkParsed);
             continue;
-        } 
-        char token;
-        char name[MAX_INPUT_SIZE];
-        int numTokens = sscanf(command, "%c %s", &token, name);
-        if (numTokens != 2) {
-            fprintf(stderr, "Error: invalid command in Queue\n");
-            exit(EXIT_FAILURE);
         }
+        if (headChunk == numberChunks) {
+            MUTEX_COMMAND_UNLOCK(commandLock); // Unlocking immediately when there are no more commands left
+            return 0;
+        }
+        chunk* head = &window[headChunk % CHUNK_WINDOW];
+        if (!head->parsed) {
+            pthread_cond_wait(&chunkParsed, &commandLock);
+            continue;
+        }
+        int taken = headCommand < head->numberCommands;
+        if (taken) {
+            command* next = &head->commands[headCommand++];
+            *token = next->token;
+            memcpy(name, next->name, next->nameLength);
+            name[next->nameLength] = '\0';
+        }
+        if (headCommand == head->numberCommands) { // Every command copied, its input can go
+            size_t offset = headChunk * CHUNK_SIZE;
+            madvise((void*) (inputData + offset), inputSize - offset < CHUNK_SIZE ? inputSize - offset : CHUNK_SIZE, MADV_DONTNEED);
+            head->parsed = 0;
+            headChunk++;
+            headCommand = 0;
+        }
+        if (taken)
+            return 1;
+    }
+}
+
+void* applyCommands(){
+    char token;
+    char name[MAX_INPUT_SIZE];
+
+    while(removeCommand(&token, name)){
         int searchResult;
         int iNumber;
         switch (token) {
             // These locks/unlocks will only work if the correct compilation option is defined
             case 'c':
+                MUTEX_COMMAND_UNLOCK(commandLock);
+                ASSERT_CHECK;
                 iNumber = obtainNewInumber(fs);
                 MUTEX_TREE_LOCK(treeLock); 
                 RWLOCK_WRLOCK(treeRWLock);
@@ -201,17 +299,15 @@ int main(int argc, char* argv[]) {
     struct timeval start, end; // gettimeofday struct variables
     
     parseArgs(argc, argv); // Reads the 3 arguments (Input,Output,Threads) from file
+    if (delay_configure(getenv(DELAY_ENV)) != 0) {
+        fprintf(stderr, "Error: Invalid %s, expected e.g. search=5000,insert,remove.\n", DELAY_ENV);
+        exit(EXIT_FAILURE);
+    }
     fs = new_tecnicofs();
     
     // File opening 
-    input = fopen(argv[1],"r");
+    openInput(argv[1]);
     output = fopen(argv[2],"w");
-    if (input == NULL) {
-        perror(argv[1]);    
-        exit(1);
-    }
-    processInput(); 
-    fclose(input);
 
     // Thread handling
     if (compileOption == -1) {
@@ -228,6 +324,10 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "Error: Couldn't initialize mutex");
             exit(EXIT_FAILURE);
         }
+        if (pthread_cond_init(&chunkParsed, NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't initialize condition variable");
+            exit(EXIT_FAILURE);
+        }
         if (compileOption == 0) {
             if (pthread_mutex_init(&treeLock, NULL) != 0) {
                 fprintf(stderr, "Error: Couldn't initialize mutex");
@@ -259,7 +359,11 @@ int main(int argc, char* argv[]) {
         if (pthread_mutex_destroy(&commandLock) != 0) {
             fprintf(stderr, "Error: Couldn't destroy mutex");
             exit(EXIT_FAILURE);
-        } // Destroying the lock that takes care of the command vector and the iNumber obtainment
+        } // Destroying the lock that takes care of the command vector
+        if (pthread_cond_destroy(&chunkParsed) != 0) {
+            fprintf(stderr, "Error: Couldn't destroy condition variable");
+            exit(EXIT_FAILURE);
+        }
         (compileOption == 0) ? (err = pthread_mutex_destroy(&treeLock)) : (err = pthread_rwlock_destroy(&treeRWLock)); // Destroying the correct lock according to the compiling option
         if (err != 0) {
             fprintf(stderr, "Error: Couldn't destroy chosen compiling option");
@@ -267,6 +371,8 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    closeInput();
+
     // Output handling
     print_tecnicofs_tree(output, fs);
     fclose(output);
@@ -0,0 +1,185 @@
+/* queueBench.c
+ * Measures how many commands per second one producer can hand to a
+ * number of consumers, through the semaphore ring main.c used to have
+ * (10 slots, consumers parsing under commandLock) and through
+ * lib/queue with commands parsed by the producer into the records
+ * main.c uses, names interned, and batched dequeues. Consumers only
+ * hash each name, so the queues are all that is measured.
+ * Usage: queueBench maxThreads numberCommands [capacity [batch]] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include "../lib/hash.h"
+#include "../lib/queue.h"
+#include "../lib/intern.h"
+
+#define MAX_INPUT_SIZE 100
+#define RING_SIZE 10
+#define MAX_BATCH 256
+
+typedef struct command {
+    char* name;
+    char* rename;
+    int bucketIndex;
+    int renameBucketIndex;
+    char token;
+} command;
+
+int numberThreads, numberCommands, capacity = 1024, batch = 16;
+uint64_t checksum; // Sum of the hashes of every name consumed
+
+char ring[RING_SIZE][MAX_INPUT_SIZE];
+int producerPtr, consumerPtr;
+sem_t produce, consume;
+pthread_mutex_t commandLock;
+queue commands;
+name_table names;
+
+static double elapsed(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void makeLine(char* line, int i) {
+    snprintf(line, MAX_INPUT_SIZE, "%c f%d\n", "cldc"[i % 4], i);
+}
+
+static void* ringConsumer(void* arg) {
+    uint64_t sum = 0;
+    while (1) {
+        sem_wait(&consume);
+        pthread_mutex_lock(&commandLock);
+        const char* line = ring[consumerPtr++ % RING_SIZE];
+        if (strcmp(line, "f") == 0) {
+            pthread_mutex_unlock(&commandLock);
+            sem_post(&produce);
+            break;
+        }
+        char token, name[MAX_INPUT_SIZE], rename[MAX_INPUT_SIZE];
+        sscanf(line, "%c %s %s", &token, name, rename);
+        pthread_mutex_unlock(&commandLock);
+        sem_post(&produce);
+        sum += hash_key(name);
+    }
+    __atomic_add_fetch(&checksum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void ringProducer() {
+    char line[MAX_INPUT_SIZE];
+    for (int i = 0; i < numberCommands + numberThreads; i++) {
+        if (i < numberCommands)
+            makeLine(line, i);
+        else
+            strcpy(line, "f");
+        sem_wait(&produce);
+        strcpy(ring[producerPtr++ % RING_SIZE], line);
+        sem_post(&consume);
+    }
+}
+
+static void* queueConsumer(void* arg) {
+    command taken[MAX_BATCH];
+    uint64_t sum = 0;
+    size_t count;
+    while ((count = queue_dequeue(&commands, taken, batch)) > 0) {
+        for (size_t i = 0; i < count; i++)
+            sum += hash_key(taken[i].name);
+    }
+    __atomic_add_fetch(&checksum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void queueProducer() {
+    char line[MAX_INPUT_SIZE], name[MAX_INPUT_SIZE], rename[MAX_INPUT_SIZE];
+    command next;
+    for (int i = 0; i < numberCommands; i++) {
+        makeLine(line, i);
+        sscanf(line, "%c %s %s", &next.token, name, rename);
+        uint64_t hash = hash_key(name);
+        next.name = intern(&names, name, hash);
+        next.bucketIndex = hash % 64;
+        queue_enqueue(&commands, &next);
+    }
+    queue_close(&commands);
+}
+
+static double run(void* (*consumer)(void*), void (*producer)()) {
+    pthread_t tid[numberThreads];
+    struct timespec start, end;
+
+    checksum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < numberThreads; i++) {
+        if (pthread_create(&tid[i], NULL, consumer, NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    producer();
+    for (int i = 0; i < numberThreads; i++)
+        pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return numberCommands / elapsed(&start, &end);
+}
+
+int main(int argc, char* argv[]) {
+    char line[MAX_INPUT_SIZE], name[MAX_INPUT_SIZE];
+    uint64_t expected = 0;
+    int maxThreads;
+
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "Usage: %s maxThreads numberCommands [capacity [batch]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    maxThreads = atoi(argv[1]);
+    numberCommands = atoi(argv[2]);
+    if (argc > 3)
+        capacity = atoi(argv[3]);
+    if (argc > 4)
+        batch = atoi(argv[4]);
+    if (maxThreads <= 0 || numberCommands <= 0 || capacity <= 0 || batch <= 0 || batch > MAX_BATCH) {
+        fprintf(stderr, "Error: Expected positive counts and a batch of at most %d.\n", MAX_BATCH);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numberCommands; i++) {
+        makeLine(line, i);
+        sscanf(line, "%*c %s", name);
+        expected += hash_key(name);
+    }
+
+    for (numberThreads = 1; numberThreads <= maxThreads; numberThreads *= 2) {
+        producerPtr = consumerPtr = 0;
+        if (sem_init(&produce, 0, RING_SIZE) != 0 || sem_init(&consume, 0, 0) != 0 ||
+            pthread_mutex_init(&commandLock, NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't initialize the ring\n");
+            exit(EXIT_FAILURE);
+        }
+        double ringRate = run(ringConsumer, ringProducer);
+        if (checksum != expected) {
+            fprintf(stderr, "Error: the ring lost commands\n");
+            exit(EXIT_FAILURE);
+        }
+        sem_destroy(&produce);
+        sem_destroy(&consume);
+        pthread_mutex_destroy(&commandLock);
+
+        queue_init(&commands, capacity, sizeof(command));
+        intern_init(&names);
+        double queueRate = run(queueConsumer, queueProducer);
+        if (checksum != expected) {
+            fprintf(stderr, "Error: the queue lost commands\n");
+            exit(EXIT_FAILURE);
+        }
+        queue_destroy(&commands);
+        intern_destroy(&names);
+
+        printf("threads=%d commands=%d ring_per_sec=%.0f queue_per_sec=%.0f capacity=%d batch=%d speedup=%.2f\n",
+               numberThreads, numberCommands, ringRate, queueRate, capacity, batch, queueRate / ringRate);
+        if (numberThreads < maxThreads && numberThreads * 2 > maxThreads)
+            numberThreads = maxThreads / 2; // Always end with maxThreads
+    }
+    return 0;
+}
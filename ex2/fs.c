@@ -4,8 +4,6 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
-#include <errno.h>
-#include <unistd.h>
 #include "lib/hash.h"
 
 #define ASSERT_CHECK assert(operationStatus == 0) // Verifies that a specific operation executes succesfully 
@@ -16,9 +14,7 @@ extern int operationStatus; // Global variable intended for assert operations
     #define MUTEX_TREE_UNLOCK(treeLock) operationStatus = pthread_mutex_unlock(treeLock)
     #define MUTEX_TREE_INIT(treeLock) pthread_mutex_init(treeLock, NULL)
 	#define MUTEX_TREE_DESTROY(treeLock) pthread_mutex_destroy(treeLock)
-	#define MUTEX_TREE_TRYLOCK(treeLock) pthread_mutex_trylock(treeLock)
 	
-	#define RWLOCK_WRTRYLOCK(treeLock)
 	#define RWLOCK_TREE_INIT(treeLock)
 	#define RWLOCK_RDLOCK(treeLock)
     #define RWLOCK_WRLOCK(treeLock)
@@ -30,30 +26,70 @@ extern int operationStatus; // Global variable intended for assert operations
     #define RWLOCK_UNLOCK(treeLock) operationStatus = pthread_rwlock_unlock(treeLock)
 	#define RWLOCK_TREE_INIT(treeLock) pthread_rwlock_init(treeLock, NULL)
 	#define RWLOCK_TREE_DESTROY(treeLock) pthread_rwlock_destroy(treeLock)
-	#define RWLOCK_WRTRYLOCK(treeLock) pthread_rwlock_trywrlock(treeLock)
 	
-	#define MUTEX_TREE_TRYLOCK(treeLock)
 	#define MUTEX_TREE_INIT(treeLock)
     #define MUTEX_TREE_LOCK(treeLock)
     #define MUTEX_TREE_UNLOCK(treeLock)
 	#define MUTEX_TREE_DESTROY(treeLock)
 #else 
-    #define RWLOCK_WRTRYLOCK(treeLock)
 	#define RWLOCK_TREE_INIT(treeLock)
 	#define RWLOCK_RDLOCK(treeLock)
     #define RWLOCK_WRLOCK(treeLock)
     #define RWLOCK_UNLOCK(treeLock)
 	#define RWLOCK_TREE_DESTROY(treeLock)
-	#define MUTEX_TREE_TRYLOCK(treeLock)
 	#define MUTEX_TREE_INIT(treeLock)
     #define MUTEX_TREE_LOCK(treeLock)
     #define MUTEX_TREE_UNLOCK(treeLock)
 	#define MUTEX_TREE_DESTROY(treeLock)
 #endif
 
+/* Each thread allocates inumbers from its own cache of freed ones and
+ * its own range of fresh ones, so the shared state is only touched once
+ * every INUMBER_RANGE allocations or releases. Inumbers left in the
+ * cache of a thread that exits are not reused. */
+static __thread int freedInumbers[2 * INUMBER_RANGE];
+static __thread int numberFreed;
+static __thread int rangeNext, rangeEnd; // Fresh inumbers [rangeNext, rangeEnd)
+
 int obtainNewInumber(tecnicofs* fs) {
-	int newInumber = ++(fs->nextINumber); 
-	return newInumber;
+	if (numberFreed == 0 && __atomic_load_n(&fs->freeInumbers, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&fs->inumberLock);
+		inumber_batch* batch = fs->freeInumbers;
+		if (batch)
+			fs->freeInumbers = batch->next;
+		pthread_mutex_unlock(&fs->inumberLock);
+		if (batch) {
+			memcpy(freedInumbers, batch->inumbers, sizeof(batch->inumbers));
+			numberFreed = INUMBER_RANGE;
+			free(batch);
+		}
+	}
+	if (numberFreed > 0)
+		return freedInumbers[--numberFreed];
+	if (rangeNext == rangeEnd) {
+		rangeNext = __atomic_fetch_add(&fs->nextINumber, INUMBER_RANGE, __ATOMIC_RELAXED) + 1;
+		rangeEnd = rangeNext + INUMBER_RANGE;
+	}
+	return rangeNext++;
+}
+
+/* Makes inumber available again, handing half of the cache to the other
+ * threads once it is full */
+void releaseInumber(tecnicofs* fs, int inumber) {
+	if (numberFreed == 2 * INUMBER_RANGE) {
+		inumber_batch* batch = malloc(sizeof(inumber_batch));
+		if (!batch) {
+			perror("Failed to allocate inumber batch");
+			exit(EXIT_FAILURE);
+		}
+		numberFreed -= INUMBER_RANGE;
+		memcpy(batch->inumbers, freedInumbers + numberFreed, sizeof(batch->inumbers));
+		pthread_mutex_lock(&fs->inumberLock);
+		batch->next = fs->freeInumbers;
+		__atomic_store_n(&fs->freeInumbers, batch, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&fs->inumberLock);
+	}
+	freedInumbers[numberFreed++] = inumber;
 }
 
 tecnicofs* new_tecnicofs(){
@@ -63,6 +99,11 @@ tecnicofs* new_tecnicofs(){
 		exit(EXIT_FAILURE);
 	}
 	fs->nextINumber = 0;
+	fs->freeInumbers = NULL;
+	if (pthread_mutex_init(&fs->inumberLock, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't initialize mutex\n");
+		exit(EXIT_FAILURE);
+	}
 	fs->bstRoot = malloc(numberBuckets * sizeof(node*));
 	if (!(fs->bstRoot)) {
 		perror("Failed to allocate btRoot");
@@ -108,6 +149,15 @@ void free_tecnicofs(tecnicofs* fs){
 	#if defined MUTEX || defined RWLOCK 
 		free(fs->treeLock);
 	#endif
+	while (fs->freeInumbers) {
+		inumber_batch* batch = fs->freeInumbers;
+		fs->freeInumbers = batch->next;
+		free(batch);
+	}
+	if (pthread_mutex_destroy(&fs->inumberLock) != 0) {
+		fprintf(stderr, "Error: Couldn't destroy mutex\n");
+		exit(EXIT_FAILURE);
+	}
 	free(fs->bstRoot);
 	free(fs);
 }
@@ -126,10 +176,15 @@ void delete(tecnicofs* fs, char *name, int bucketIndex){
 	MUTEX_TREE_LOCK(fs->treeLock + bucketIndex);
     RWLOCK_WRLOCK(fs->treeLock + bucketIndex);
 	ASSERT_CHECK;
-	*(fs->bstRoot + bucketIndex) = remove_item(*(fs->bstRoot + bucketIndex), name);
+	node* searchNode = search(*(fs->bstRoot + bucketIndex), name);
+	int inumber = searchNode ? searchNode->inumber : 0;
+	if (searchNode)
+		*(fs->bstRoot + bucketIndex) = remove_item(*(fs->bstRoot + bucketIndex), name);
 	MUTEX_TREE_UNLOCK(fs->treeLock + bucketIndex);
     RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
 	ASSERT_CHECK;
+	if (inumber)
+		releaseInumber(fs, inumber);
 }
 
 int lookup(tecnicofs* fs, char *name, int bucketIndex){
@@ -144,87 +199,34 @@ int lookup(tecnicofs* fs, char *name, int bucketIndex){
 	return 0;
 }
 
-void renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex) { 
-	int searchResult = lookup(fs, name, bucketIndex);
-	int iNumberSaver = searchResult;
-	if (!searchResult)
-		return;
-	else {
-		int newBucketIndex = hash(rename, numberBuckets); 
-		searchResult = lookup(fs, rename, newBucketIndex);
-		if (searchResult) {
-			return;
-		}
-		#ifdef MUTEX
-			int sleepTime, retVal, tryNumber = 0, renameConditions = 0;
-			sleepTime = ((rand() % 1000)) + 1; 
-			while (renameConditions != 1) {
-				tryNumber++;
-				retVal = MUTEX_TREE_TRYLOCK(fs->treeLock + bucketIndex);
-				if (retVal == 0) {
-					retVal = MUTEX_TREE_TRYLOCK(fs->treeLock + newBucketIndex);
-					if ((retVal == 0) || bucketIndex == newBucketIndex) {
-						renameConditions = 1;
-					} else if (retVal != EBUSY) {
-						fprintf(stderr,"Error: Trylock error not related to busy lock");
-						exit(EXIT_FAILURE);
-					} else {
-						MUTEX_TREE_UNLOCK(fs->treeLock + bucketIndex);
-						ASSERT_CHECK;
-					}
-				} else if (retVal != EBUSY) { // Exit if the error is not associated with the thread being already busy
-					fprintf(stderr,"Error: Trylock error not related to busy lock");
-					exit(EXIT_FAILURE);
-				} 
-				if (renameConditions == 0) {
-					if (usleep((sleepTime * tryNumber) * 1000) != 0) { // Sleep a random time between 0 and 1 sec times the number of tries
-						fprintf(stderr,"Error: Failure on usleep function.");
-						exit(EXIT_FAILURE);
-					}	
-				}
-			}
-		#elif RWLOCK 
-			int sleepTime, retVal, tryNumber = 0, renameConditions = 0;
-			srand(time(NULL));
-			sleepTime = ((rand() % 1000)) + 1;
-			while (renameConditions != 1) {
-				tryNumber++;
-				retVal = RWLOCK_WRTRYLOCK(fs->treeLock + bucketIndex);
-				if (retVal == 0) {
-					retVal = RWLOCK_WRTRYLOCK(fs->treeLock + newBucketIndex);
-					if ((retVal == 0) || bucketIndex == newBucketIndex) {
-						renameConditions = 1;
-					} else if (retVal != EBUSY) {
-						fprintf(stderr,"Error: Trylock error not related to busy lock");
-						exit(EXIT_FAILURE);
-					} else {
-						RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-						ASSERT_CHECK;
-					}
-				} else if (retVal != EBUSY) { // Exit if the error is not associated with the thread being already busy
-					fprintf(stderr,"Error: Trylock error not related to busy lock");
-					exit(EXIT_FAILURE);
-				} 
-				if (renameConditions == 0) {
-					if (usleep((sleepTime * tryNumber) * 1000) != 0) { // Sleep a random time between 0 and 1 sec times the number of tries
-						fprintf(stderr,"Error: Failure on usleep function.");
-						exit(EXIT_FAILURE);
-					}	
-				}
-			}
-		#endif
+/* Locks both buckets in increasing index order, so two renames
+ * between the same buckets never wait on each other in a cycle, and
+ * checks both names under the locks so the rename is atomic. */
+void renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex, int newBucketIndex) { 
+	int firstIndex = bucketIndex < newBucketIndex ? bucketIndex : newBucketIndex;
+	int secondIndex = bucketIndex < newBucketIndex ? newBucketIndex : bucketIndex;
+	MUTEX_TREE_LOCK(fs->treeLock + firstIndex);
+	RWLOCK_WRLOCK(fs->treeLock + firstIndex);
+	ASSERT_CHECK;
+	if (secondIndex != firstIndex) {
+		MUTEX_TREE_LOCK(fs->treeLock + secondIndex);
+		RWLOCK_WRLOCK(fs->treeLock + secondIndex);
+		ASSERT_CHECK;
+	}
+	node* searchNode = search(*(fs->bstRoot + bucketIndex), name);
+	if (searchNode && !search(*(fs->bstRoot + newBucketIndex), rename)) {
+		int iNumberSaver = searchNode->inumber;
 		*(fs->bstRoot + bucketIndex) = remove_item(*(fs->bstRoot + bucketIndex), name);
 		*(fs->bstRoot + newBucketIndex) = insert(*(fs->bstRoot + newBucketIndex), rename, iNumberSaver);
-		MUTEX_TREE_UNLOCK(fs->treeLock + bucketIndex);
-		RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
+	}
+	if (secondIndex != firstIndex) {
+		MUTEX_TREE_UNLOCK(fs->treeLock + secondIndex);
+		RWLOCK_UNLOCK(fs->treeLock + secondIndex);
 		ASSERT_CHECK;
-		if (bucketIndex != newBucketIndex) {
-			MUTEX_TREE_UNLOCK(fs->treeLock + newBucketIndex);
-			RWLOCK_UNLOCK(fs->treeLock + newBucketIndex);
-			ASSERT_CHECK;
-		}
-		return;
 	}
+	MUTEX_TREE_UNLOCK(fs->treeLock + firstIndex);
+	RWLOCK_UNLOCK(fs->treeLock + firstIndex);
+	ASSERT_CHECK;
 }
 
 void print_tecnicofs_tree(FILE * fp, tecnicofs *fs){
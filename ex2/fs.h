@@ -21,20 +21,31 @@ int operationStatus; // Global variable intended for assert operations
     #endif
 #endif
 
+#define INUMBER_RANGE 64 // Inumbers a thread reserves or hands back at a time
+
+/* Freed inumbers travel between threads INUMBER_RANGE at a time */
+typedef struct inumber_batch {
+    int inumbers[INUMBER_RANGE];
+    struct inumber_batch* next;
+} inumber_batch;
+
 typedef struct tecnicofs {
     node** bstRoot;
-    int nextINumber;
+    int nextINumber; // Every inumber up to it was handed to a thread, read and written atomically
+    inumber_batch* freeInumbers;
+    pthread_mutex_t inumberLock; // Only for freeInumbers
     #if defined MUTEX || defined RWLOCK
         tree_lock_t *treeLock;
     #endif
 } tecnicofs;
 
 int obtainNewInumber(tecnicofs* fs);
+void releaseInumber(tecnicofs* fs, int inumber);
 tecnicofs* new_tecnicofs();
 void free_tecnicofs(tecnicofs* fs);
 void create(tecnicofs* fs, char *name, int inumber, int bucketIndex);
 void delete(tecnicofs* fs, char *name, int bucketIndex);
-void renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex);
+void renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex, int newBucketIndex);
 int lookup(tecnicofs* fs, char *name, int bucketIndex);
 void print_tecnicofs_tree(FILE * fp, tecnicofs *fs);
 
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "executor.h"
+
+static void* allocate(size_t size){
+    void* p = malloc(size);
+    if(!p){
+        perror("executor: no memory");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/* Only the producer submits, so it is the only thread waiting for room */
+void executor_init(executor* e, int numberWorkers, int numberKeys, int stealing, long capacity, size_t elementSize, void (*apply)(void* element)){
+    e->numberWorkers = numberWorkers;
+    e->numberKeys = numberKeys;
+    e->stealing = stealing;
+    e->capacity = capacity;
+    e->elementSize = elementSize;
+    e->apply = apply;
+    e->mailboxes = allocate(numberKeys * sizeof(mailbox));
+    for(int i = 0; i < numberKeys; i++){
+        e->mailboxes[i] = (mailbox) { .elements = NULL, .joins = NULL, .head = 0, .count = 0, .capacity = 0, .scheduled = 0 };
+        if(pthread_mutex_init(&e->mailboxes[i].lock, NULL) != 0){
+            fprintf(stderr, "Error: Couldn't initialize mutex\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    e->ready = allocate(numberWorkers * sizeof(queue));
+    for(int i = 0; i < numberWorkers; i++)
+        queue_init(&e->ready[i], numberKeys, sizeof(int)); // A key is in one queue at most, so they never fill
+    e->pending = 0;
+    e->closed = 0;
+    e->idleWorkers = e->producerWaiting = 0;
+    e->sleeping = calloc(numberWorkers, sizeof(int));
+    e->workAvailable = allocate(numberWorkers * sizeof(pthread_cond_t));
+    if(!e->sleeping){
+        perror("executor: no memory");
+        exit(EXIT_FAILURE);
+    }
+    if(pthread_mutex_init(&e->idleLock, NULL) != 0 || pthread_cond_init(&e->spaceAvailable, NULL) != 0){
+        fprintf(stderr, "Error: Couldn't initialize the executor locks\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < numberWorkers; i++){
+        if(pthread_cond_init(&e->workAvailable[i], NULL) != 0){
+            fprintf(stderr, "Error: Couldn't initialize the executor locks\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void executor_destroy(executor* e){
+    for(int i = 0; i < e->numberKeys; i++){
+        free(e->mailboxes[i].elements);
+        free(e->mailboxes[i].joins);
+        pthread_mutex_destroy(&e->mailboxes[i].lock);
+    }
+    for(int i = 0; i < e->numberWorkers; i++)
+        queue_destroy(&e->ready[i]);
+    for(int i = 0; i < e->numberWorkers; i++){
+        if(pthread_cond_destroy(&e->workAvailable[i]) != 0){
+            fprintf(stderr, "Error: Couldn't destroy the executor locks\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(e->mailboxes);
+    free(e->ready);
+    free(e->sleeping);
+    free(e->workAvailable);
+    if(pthread_mutex_destroy(&e->idleLock) != 0 || pthread_cond_destroy(&e->spaceAvailable) != 0){
+        fprintf(stderr, "Error: Couldn't destroy the executor locks\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void lock_mailbox(mailbox* m){
+    if(pthread_mutex_lock(&m->lock) != 0){
+        fprintf(stderr, "Error: Couldn't lock mutex\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Sleepers count themselves before looking for what they wait for one
+ * last time, so after a change either they see it or this sees them */
+static void wake_producer(executor* e){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&e->producerWaiting, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&e->idleLock);
+    pthread_cond_signal(&e->spaceAvailable);
+    pthread_mutex_unlock(&e->idleLock);
+}
+
+/* Wakes the worker a key was queued for, or when stealing any worker
+ * that sleeps, since it will find the key in the other's queue */
+static void wake_worker(executor* e, int worker){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&e->idleWorkers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&e->idleLock);
+    for(int i = 0; i < (e->stealing ? e->numberWorkers : 1); i++){
+        int candidate = (worker + i) % e->numberWorkers;
+        if(e->sleeping[candidate]){
+            pthread_cond_signal(&e->workAvailable[candidate]);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&e->idleLock);
+}
+
+static void wake_all(executor* e){
+    pthread_mutex_lock(&e->idleLock);
+    for(int i = 0; i < e->numberWorkers; i++)
+        pthread_cond_signal(&e->workAvailable[i]);
+    pthread_mutex_unlock(&e->idleLock);
+}
+
+/* Queues key for worker, or for the worker owning it when not stealing */
+static void make_ready(executor* e, int key, int worker){
+    if(!e->stealing)
+        worker = key % e->numberWorkers;
+    queue_enqueue(&e->ready[worker], &key);
+    wake_worker(e, worker);
+}
+
+/* Waits until the producer may submit one more element, and counts it */
+static void reserve(executor* e){
+    if(__atomic_load_n(&e->pending, __ATOMIC_SEQ_CST) >= e->capacity){
+        pthread_mutex_lock(&e->idleLock);
+        __atomic_store_n(&e->producerWaiting, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&e->pending, __ATOMIC_SEQ_CST) >= e->capacity)
+            pthread_cond_wait(&e->spaceAvailable, &e->idleLock);
+        __atomic_store_n(&e->producerWaiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&e->idleLock);
+    }
+    __atomic_add_fetch(&e->pending, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Appends an element, or a join when j is not NULL, to the mailbox of key */
+static void post(executor* e, int key, const void* element, join* j){
+    mailbox* m = &e->mailboxes[key];
+
+    lock_mailbox(m);
+    if(m->count == m->capacity){
+        size_t capacity = m->capacity ? 2 * m->capacity : EXECUTOR_BATCH;
+        char* elements = allocate(capacity * e->elementSize);
+        join** joins = allocate(capacity * sizeof(join*));
+        for(size_t i = 0; i < m->count; i++){
+            size_t from = (m->head + i) % m->capacity;
+            memcpy(elements + i * e->elementSize, m->elements + from * e->elementSize, e->elementSize);
+            joins[i] = m->joins[from];
+        }
+        free(m->elements);
+        free(m->joins);
+        m->elements = elements;
+        m->joins = joins;
+        m->head = 0;
+        m->capacity = capacity;
+    }
+    size_t tail = (m->head + m->count) % m->capacity;
+    if(!j)
+        memcpy(m->elements + tail * e->elementSize, element, e->elementSize);
+    m->joins[tail] = j;
+    m->count++;
+    int schedule = !m->scheduled;
+    m->scheduled = 1;
+    pthread_mutex_unlock(&m->lock);
+    if(schedule)
+        make_ready(e, key, key % e->numberWorkers);
+}
+
+void executor_submit(executor* e, int key, const void* element){
+    reserve(e);
+    post(e, key, element, NULL);
+}
+
+/* Applies element after everything submitted before it for key and for
+ * otherKey, and before anything submitted after it for either */
+void executor_submit_joined(executor* e, int key, int otherKey, const void* element){
+    if(key == otherKey){
+        executor_submit(e, key, element);
+        return;
+    }
+    reserve(e);
+    join* j = allocate(sizeof(join) + e->elementSize);
+    j->arrived = 0;
+    j->keys[0] = key;
+    j->keys[1] = otherKey;
+    memcpy(j->element, element, e->elementSize);
+    post(e, key, NULL, j);
+    post(e, otherKey, NULL, j);
+}
+
+/* Tells the workers to return once every element submitted is applied */
+void executor_close(executor* e){
+    __atomic_store_n(&e->closed, 1, __ATOMIC_SEQ_CST);
+    wake_all(e);
+}
+
+/* Takes a key from the worker's own queue, or else steals one from the
+ * queues of the others, starting with its neighbour */
+static int find_key(executor* e, int worker, int* key){
+    for(int i = 0; i < (e->stealing ? e->numberWorkers : 1); i++){
+        if(queue_try_dequeue(&e->ready[(worker + i) % e->numberWorkers], key, 1) > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int wait_for_key(executor* e, int worker, int* key){
+    int found;
+    pthread_mutex_lock(&e->idleLock);
+    e->sleeping[worker] = 1;
+    __atomic_add_fetch(&e->idleWorkers, 1, __ATOMIC_SEQ_CST);
+    while(!(found = find_key(e, worker, key))){
+        if(__atomic_load_n(&e->closed, __ATOMIC_SEQ_CST) && __atomic_load_n(&e->pending, __ATOMIC_SEQ_CST) == 0)
+            break;
+        pthread_cond_wait(&e->workAvailable[worker], &e->idleLock);
+    }
+    __atomic_sub_fetch(&e->idleWorkers, 1, __ATOMIC_SEQ_CST);
+    e->sleeping[worker] = 0;
+    pthread_mutex_unlock(&e->idleLock);
+    return found;
+}
+
+/* Counts count elements as applied, waking the producer if it waits for
+ * room and every worker once the last element is applied */
+static void applied(executor* e, size_t count){
+    long pending = __atomic_sub_fetch(&e->pending, count, __ATOMIC_SEQ_CST);
+    if(pending < e->capacity)
+        wake_producer(e);
+    if(pending == 0 && __atomic_load_n(&e->closed, __ATOMIC_SEQ_CST))
+        wake_all(e);
+}
+
+/* Applies up to EXECUTOR_BATCH elements of key in order, stopping at a
+ * join, then puts the key back in the worker's own queue if more
+ * arrived meanwhile. A key whose worker reached a join first stays
+ * scheduled, without being in any queue, until the join is applied. */
+static void apply_key(executor* e, int key, int worker, char* batch){
+    mailbox* m = &e->mailboxes[key];
+    size_t count = 0;
+    join* j = NULL;
+
+    lock_mailbox(m);
+    while(count < EXECUTOR_BATCH && m->count > 0 && !j){
+        j = m->joins[m->head];
+        if(!j)
+            memcpy(batch + count++ * e->elementSize, m->elements + m->head * e->elementSize, e->elementSize);
+        m->head = (m->head + 1) % m->capacity;
+        m->count--;
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    for(size_t i = 0; i < count; i++)
+        e->apply(batch + i * e->elementSize);
+
+    if(j){
+        if(__atomic_add_fetch(&j->arrived, 1, __ATOMIC_ACQ_REL) == 1){
+            applied(e, count);
+            return;
+        }
+        e->apply(j->element);
+        make_ready(e, j->keys[0] == key ? j->keys[1] : j->keys[0], worker);
+        free(j);
+        count++;
+    }
+
+    lock_mailbox(m);
+    int more = m->count > 0;
+    if(!more)
+        m->scheduled = 0;
+    pthread_mutex_unlock(&m->lock);
+    if(more)
+        make_ready(e, key, worker);
+    applied(e, count);
+}
+
+/* Runs on each worker thread, worker being its index, and returns once
+ * the executor is closed and every element was applied */
+void executor_work(executor* e, int worker){
+    char* batch = allocate(EXECUTOR_BATCH * e->elementSize);
+    int key;
+    while(find_key(e, worker, &key) || wait_for_key(e, worker, &key))
+        apply_key(e, key, worker, batch);
+    free(batch);
+}
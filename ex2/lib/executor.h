@@ -0,0 +1,62 @@
+/* executor.h */
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+#include <stddef.h>
+#include <pthread.h>
+#include "queue.h"
+
+#define EXECUTOR_BATCH 16 // Elements of a key applied before the key goes back to a queue
+
+/* Applies elements on a pool of workers, in the order they were
+ * submitted for each key. Every key has a mailbox of pending elements,
+ * and a key with a non-empty mailbox sits in the ready queue of exactly
+ * one worker, or is being applied by it. Keys start in the queue of
+ * the worker they map to; workers that run out of keys steal them from
+ * the queues of the others, so work spreads without two workers ever
+ * applying elements of the same key. Without stealing, every key is
+ * only ever applied by the worker it maps to, so workers own disjoint
+ * sets of keys and need no locks on what the keys stand for.
+ * An element submitted for two keys leaves a join in both mailboxes.
+ * The first worker to reach it parks its key, and the second applies
+ * the element and hands the parked key back, so the element is ordered
+ * with everything submitted for either key. */
+typedef struct join {
+    int arrived; // Workers that reached the join
+    int keys[2];
+    char element[]; // elementSize bytes
+} join;
+
+typedef struct mailbox {
+    pthread_mutex_t lock; // Only shared by the producer and the worker holding the key
+    char* elements; // Ring of capacity elements
+    join** joins; // Same ring, NULL for elements of this key only
+    size_t head, count, capacity;
+    int scheduled; // The key is in a ready queue or being applied
+} mailbox;
+
+typedef struct executor {
+    int numberWorkers;
+    int numberKeys;
+    int stealing; // Whether idle workers take keys from the others
+    size_t elementSize;
+    long capacity; // Elements submitted and not yet applied before the producer waits
+    void (*apply)(void* element);
+    mailbox* mailboxes;
+    queue* ready; // One per worker, of keys
+    long pending; // Elements submitted and not yet applied
+    int closed;
+    int idleWorkers, producerWaiting;
+    int* sleeping; // One per worker, set while it waits for work
+    pthread_mutex_t idleLock; // Only taken to sleep and to wake sleepers
+    pthread_cond_t* workAvailable; // One per worker
+    pthread_cond_t spaceAvailable;
+} executor;
+
+void executor_init(executor* e, int numberWorkers, int numberKeys, int stealing, long capacity, size_t elementSize, void (*apply)(void* element));
+void executor_destroy(executor* e);
+void executor_submit(executor* e, int key, const void* element);
+void executor_submit_joined(executor* e, int key, int otherKey, const void* element);
+void executor_close(executor* e);
+void executor_work(executor* e, int worker);
+
+#endif /* EXECUTOR_H */
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+
+#define INITIAL_SLOTS 1024
+
+static void* allocate(size_t size){
+    void* p = malloc(size);
+    if(!p){
+        perror("intern: no memory for names");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void intern_init(name_table* table){
+    table->mask = INITIAL_SLOTS - 1;
+    table->slots = calloc(INITIAL_SLOTS, sizeof(char*));
+    table->hashes = allocate(INITIAL_SLOTS * sizeof(uint64_t));
+    if(!table->slots){
+        perror("intern: no memory for names");
+        exit(EXIT_FAILURE);
+    }
+    table->count = 0;
+    table->block = NULL;
+    table->blockUsed = INTERN_BLOCK_SIZE;
+    table->blocks = NULL;
+    table->numberBlocks = 0;
+}
+
+void intern_destroy(name_table* table){
+    for(size_t i = 0; i < table->numberBlocks; i++)
+        free(table->blocks[i]);
+    free(table->blocks);
+    free(table->slots);
+    free(table->hashes);
+}
+
+/* Doubles the slots once they are half full */
+static void grow(name_table* table){
+    size_t size = 2 * (table->mask + 1);
+    char** slots = calloc(size, sizeof(char*));
+    uint64_t* hashes = allocate(size * sizeof(uint64_t));
+    if(!slots){
+        perror("intern: no memory for names");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i <= table->mask; i++){
+        if(!table->slots[i])
+            continue;
+        size_t j = table->hashes[i] & (size - 1);
+        while(slots[j])
+            j = (j + 1) & (size - 1);
+        slots[j] = table->slots[i];
+        hashes[j] = table->hashes[i];
+    }
+    free(table->slots);
+    free(table->hashes);
+    table->slots = slots;
+    table->hashes = hashes;
+    table->mask = size - 1;
+}
+
+static char* copy_name(name_table* table, const char* name){
+    size_t size = strlen(name) + 1;
+    if(table->blockUsed + size > INTERN_BLOCK_SIZE){
+        table->blocks = realloc(table->blocks, (table->numberBlocks + 1) * sizeof(char*));
+        if(!table->blocks){
+            perror("intern: no memory for names");
+            exit(EXIT_FAILURE);
+        }
+        table->block = table->blocks[table->numberBlocks++] = allocate(INTERN_BLOCK_SIZE);
+        table->blockUsed = 0;
+    }
+    char* copy = memcpy(table->block + table->blockUsed, name, size);
+    table->blockUsed += size;
+    return copy;
+}
+
+/* Returns the table's copy of name, hash being hash_key(name). Names
+ * must be shorter than INTERN_BLOCK_SIZE. */
+char* intern(name_table* table, const char* name, uint64_t hash){
+    size_t i = hash & table->mask;
+    for(; table->slots[i]; i = (i + 1) & table->mask){
+        if(table->hashes[i] == hash && strcmp(table->slots[i], name) == 0)
+            return table->slots[i];
+    }
+    table->slots[i] = copy_name(table, name);
+    table->hashes[i] = hash;
+    char* copy = table->slots[i];
+    if(++table->count > (table->mask + 1) / 2)
+        grow(table);
+    return copy;
+}
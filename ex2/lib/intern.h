@@ -0,0 +1,27 @@
+/* intern.h */
+#ifndef INTERN_H
+#define INTERN_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define INTERN_BLOCK_SIZE (64 << 10) // Bytes of names allocated at a time
+
+/* Keeps one copy of every distinct name, so commands can refer to names
+ * by pointer. Names are never freed before the table, and the table is
+ * not thread safe: only the thread parsing the input interns names. */
+typedef struct name_table {
+    char** slots; // Open addressing, NULL when empty
+    uint64_t* hashes; // hash_key of the name in the same slot
+    size_t mask; // Number of slots - 1
+    size_t count;
+    char* block; // Block the next names are copied to
+    size_t blockUsed;
+    char** blocks; // Every block, to free them
+    size_t numberBlocks;
+} name_table;
+
+void intern_init(name_table* table);
+void intern_destroy(name_table* table);
+char* intern(name_table* table, const char* name, uint64_t hash);
+
+#endif /* INTERN_H */
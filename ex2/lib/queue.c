@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+#include "queue.h"
+
+static size_t* cell_sequence(queue* q, size_t pos){
+    return (size_t*) (q->cells + (pos & q->mask) * q->cellSize);
+}
+
+static void* cell_data(queue* q, size_t pos){
+    return q->cells + (pos & q->mask) * q->cellSize + sizeof(size_t);
+}
+
+/* Rounds capacity up to a power of two, so positions wrap with a mask */
+void queue_init(queue* q, size_t capacity, size_t elementSize){
+    size_t size = 2;
+    while(size < capacity)
+        size *= 2;
+    q->mask = size - 1;
+    q->elementSize = elementSize;
+    q->cellSize = (sizeof(size_t) + elementSize + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    if(posix_memalign((void**) &q->cells, 64, size * q->cellSize) != 0){
+        perror("queue_init: no memory for the queue");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < size; i++)
+        *cell_sequence(q, i) = i;
+    q->enqueuePos = q->dequeuePos = 0;
+    q->closed = 0;
+    q->waitingProducers = q->waitingConsumers = 0;
+    if(pthread_mutex_init(&q->waitLock, NULL) != 0 || pthread_cond_init(&q->notFull, NULL) != 0 ||
+       pthread_cond_init(&q->notEmpty, NULL) != 0){
+        fprintf(stderr, "Error: Couldn't initialize the queue locks\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void queue_destroy(queue* q){
+    free(q->cells);
+    if(pthread_mutex_destroy(&q->waitLock) != 0 || pthread_cond_destroy(&q->notFull) != 0 ||
+       pthread_cond_destroy(&q->notEmpty) != 0){
+        fprintf(stderr, "Error: Couldn't destroy the queue locks\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* A cell is free to write at position pos when its sequence is pos, and
+ * holds an element to read when it is pos + 1. */
+static int push(queue* q, const void* element){
+    size_t pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+    while(1){
+        size_t sequence = __atomic_load_n(cell_sequence(q, pos), __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) pos;
+        if(difference == 0){
+            if(__atomic_compare_exchange_n(&q->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(difference < 0){
+            return 0; // The cell still holds the element of the previous lap
+        } else {
+            pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(cell_data(q, pos), element, q->elementSize);
+    __atomic_store_n(cell_sequence(q, pos), pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Claims every ready cell from the head on, up to max, with a single
+ * compare and swap */
+static size_t pop(queue* q, void* elements, size_t max){
+    size_t pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED), count;
+    if(max > q->mask + 1)
+        max = q->mask + 1;
+    while(1){
+        size_t sequence = __atomic_load_n(cell_sequence(q, pos), __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (pos + 1);
+        if(difference == 0){
+            for(count = 1; count < max; count++){
+                if(__atomic_load_n(cell_sequence(q, pos + count), __ATOMIC_ACQUIRE) != pos + count + 1)
+                    break;
+            }
+            if(__atomic_compare_exchange_n(&q->dequeuePos, &pos, pos + count, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(difference < 0){
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+    for(size_t i = 0; i < count; i++){
+        memcpy((char*) elements + i * q->elementSize, cell_data(q, pos + i), q->elementSize);
+        __atomic_store_n(cell_sequence(q, pos + i), pos + i + q->mask + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+/* Wakes a thread sleeping on cond after the queue changed. A sleeper
+ * counts itself in waiting before its last attempt, so either it sees
+ * the change or this sees it waiting. */
+static void wake(queue* q, int* waiting, pthread_cond_t* cond){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&q->waitLock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&q->waitLock);
+}
+
+static int is_closed(queue* q){
+    return __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST);
+}
+
+/* Returns 0 without waiting if the queue is full */
+int queue_try_enqueue(queue* q, const void* element){
+    if(!push(q, element))
+        return 0;
+    wake(q, &q->waitingConsumers, &q->notEmpty);
+    return 1;
+}
+
+/* Takes up to max elements into elements, returning how many, or 0
+ * without waiting if the queue is empty */
+size_t queue_try_dequeue(queue* q, void* elements, size_t max){
+    size_t count = pop(q, elements, max);
+    if(count > 0)
+        wake(q, &q->waitingProducers, &q->notFull);
+    return count;
+}
+
+void queue_enqueue(queue* q, const void* element){
+    for(int i = 0; i < QUEUE_SPINS; i++){
+        if(queue_try_enqueue(q, element))
+            return;
+        sched_yield();
+    }
+    pthread_mutex_lock(&q->waitLock);
+    __atomic_add_fetch(&q->waitingProducers, 1, __ATOMIC_SEQ_CST);
+    while(!push(q, element))
+        pthread_cond_wait(&q->notFull, &q->waitLock);
+    __atomic_sub_fetch(&q->waitingProducers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->waitLock);
+    wake(q, &q->waitingConsumers, &q->notEmpty);
+}
+
+/* Waits for at least one element and takes up to max. Returns 0 once
+ * the queue is closed and every element was taken. */
+size_t queue_dequeue(queue* q, void* elements, size_t max){
+    size_t count;
+    for(int i = 0; i < QUEUE_SPINS; i++){
+        if((count = queue_try_dequeue(q, elements, max)) > 0)
+            return count;
+        if(is_closed(q))
+            return queue_try_dequeue(q, elements, max); // Whatever was enqueued before closing is visible now
+        sched_yield();
+    }
+    pthread_mutex_lock(&q->waitLock);
+    __atomic_add_fetch(&q->waitingConsumers, 1, __ATOMIC_SEQ_CST);
+    while((count = pop(q, elements, max)) == 0){
+        if(is_closed(q)){
+            count = pop(q, elements, max);
+            break;
+        }
+        pthread_cond_wait(&q->notEmpty, &q->waitLock);
+    }
+    __atomic_sub_fetch(&q->waitingConsumers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->waitLock);
+    if(count > 0)
+        wake(q, &q->waitingProducers, &q->notFull);
+    return count;
+}
+
+/* Tells consumers no more elements will be enqueued */
+void queue_close(queue* q){
+    __atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&q->waitLock);
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_mutex_unlock(&q->waitLock);
+}
@@ -0,0 +1,39 @@
+/* queue.h */
+#ifndef QUEUE_H
+#define QUEUE_H
+#include <stddef.h>
+#include <pthread.h>
+
+#define QUEUE_SPINS 64 // Failed attempts before a thread sleeps on a full or empty queue
+
+/* Bounded multi-producer multi-consumer queue of fixed size elements
+ * (D. Vyukov's array queue). Each cell carries a sequence number that
+ * tells whether it is ready to be written or read at the current lap,
+ * so producers and consumers only compete for their own position with
+ * a compare and swap, and never for a lock. Threads that find the queue
+ * full or empty spin for a while and then sleep until woken. */
+typedef struct queue {
+    char* cells;
+    size_t mask; // Capacity - 1, the capacity being a power of two
+    size_t cellSize;
+    size_t elementSize;
+    char pad0[64];
+    size_t enqueuePos;
+    char pad1[64];
+    size_t dequeuePos;
+    char pad2[64];
+    int closed;
+    int waitingProducers, waitingConsumers;
+    pthread_mutex_t waitLock; // Only taken by threads going to sleep and those waking them
+    pthread_cond_t notFull, notEmpty;
+} queue;
+
+void queue_init(queue* q, size_t capacity, size_t elementSize);
+void queue_destroy(queue* q);
+int queue_try_enqueue(queue* q, const void* element);
+size_t queue_try_dequeue(queue* q, void* elements, size_t max);
+void queue_enqueue(queue* q, const void* element);
+size_t queue_dequeue(queue* q, void* elements, size_t max);
+void queue_close(queue* q);
+
+#endif /* QUEUE_H */
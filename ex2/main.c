@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -6,12 +7,14 @@
 #include <pthread.h>
 #include <assert.h>
 #include <sys/time.h>
-#include <semaphore.h>
+#include <sched.h>
 #include "fs.h"  
 #include "lib/hash.h" 
+#include "lib/executor.h"
+#include "lib/intern.h"
 
-#define MAX_COMMANDS 10
 #define MAX_INPUT_SIZE 100
+#define MAX_PENDING_COMMANDS 4096 // Commands parsed ahead of the consumers
 
 extern int numberBuckets;
 
@@ -19,10 +22,7 @@ extern int numberBuckets;
 tecnicofs* fs;
 FILE *input,*output;
 
-// Thread and semaphore variables
-pthread_mutex_t commandLock; // For the command vector access and iNumber obtainment
-sem_t produce, consume;
-
+// Thread variables
 int numberThreads;
 
 // Thread macro 
@@ -30,20 +30,32 @@ int numberThreads;
     int compileOption = 0; // Variable used to differentiate chosen compilation option from others
 #elif RWLOCK 
     int compileOption = 1; // Variable used to differentiate chosen compilation option from others
+#elif SHARDED
+    int compileOption = 2; // Variable used to differentiate chosen compilation option from others
 #else 
     int compileOption = -1; // Variable used to differentiate chosen compilation option from others
 #endif
-#define MUTEX_COMMAND_LOCK(commandLock) operationStatus = pthread_mutex_lock(&commandLock)
-#define MUTEX_COMMAND_UNLOCK(commandLock) operationStatus = pthread_mutex_unlock(&commandLock)
-#define SEM_WAIT(sem) operationStatus = sem_wait(&sem)
-#define SEM_POST(sem) operationStatus = sem_post(&sem)
-#define ASSERT_CHECK assert(operationStatus == 0) // Verifies that a specific operation executes succesfully 
+
+/* Commands are parsed once by the producer and handed to the consumers
+ * whole. Names are interned, so a command only carries pointers to them
+ * and the buckets they hash to. Commands are applied in input order
+ * within the bucket of their name, and in any order across buckets, by
+ * a work-stealing executor keyed by that bucket. Built with SHARDED,
+ * the executor does not steal: each thread owns the buckets that map to
+ * it and runs pinned to a core, and the file system takes no locks. */
+typedef struct command {
+    char* name;
+    char* rename; // Only for 'r'
+    int bucketIndex; // Of name
+    int renameBucketIndex; // Of rename
+    char token;
+} command;
 
 //Command variables
-char inputCommands[MAX_COMMANDS][MAX_INPUT_SIZE];
+executor commands;
+name_table names;
 char inputFile[MAX_INPUT_SIZE];
 char outputFile[MAX_INPUT_SIZE];
-int producerPtr = 0, consumerPtr = 0;
 
 static void displayUsage (const char* appName){
     printf("Usage: %s\n", appName);
@@ -71,59 +83,72 @@ static void parseArgs (long argc, char* const argv[]){
     }
 }
 
-int insertCommand(char* data) { // producer
-    if (strlen(data) <= MAX_INPUT_SIZE) {
-        SEM_WAIT(produce);
-        ASSERT_CHECK;
-        strcpy(inputCommands[producerPtr++%MAX_COMMANDS], data);
-        SEM_POST(consume);
-        ASSERT_CHECK;
-        return 1;
-    }
-    return 0;
+void errorParse(){
+    fprintf(stderr, "Error: command invalid\n");
+    exit(EXIT_FAILURE);
 }
 
-char* removeCommand() { // consumer
-    SEM_WAIT(consume);
-    ASSERT_CHECK;
-    MUTEX_COMMAND_LOCK(commandLock);
-    ASSERT_CHECK; 
-    return inputCommands[consumerPtr++%MAX_COMMANDS];  
+/* Interns name and stores the bucket it belongs to in bucketIndex */
+static char* parsedName(const char* name, int* bucketIndex){
+    uint64_t hash = hash_key(name);
+    *bucketIndex = (int) (hash % numberBuckets);
+    return intern(&names, name, hash);
 }
 
-void errorParse(){
-    fprintf(stderr, "Error: command invalid\n");
-    exit(EXIT_FAILURE);
+/* Reads line the way sscanf(line, "%c %s %s", ...) would, but leaves
+ * the names '\0' terminated in place instead of copying them. Returns
+ * the number of fields read. */
+static int splitLine(char* line, char* token, char** name, char** rename){
+    char* words[2] = { NULL, NULL };
+    char* p = line + 1;
+    int numTokens = 1;
+
+    if (line[0] == '\0')
+        return 0;
+    *token = line[0];
+    for (int i = 0; i < 2; i++, numTokens++) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0')
+            break;
+        words[i] = p;
+        while (*p != '\0' && !isspace((unsigned char) *p))
+            p++;
+        if (*p != '\0')
+            *p++ = '\0';
+    }
+    *name = words[0];
+    *rename = words[1];
+    return numTokens;
 }
 
-void processInput(){
+void processInput(){ // producer
     char line[MAX_INPUT_SIZE];
     while (fgets(line, sizeof(line)/sizeof(char), input)) { 
-        char token;
-        char name[MAX_INPUT_SIZE];
-        char rename[MAX_INPUT_SIZE];
-        int numTokens = sscanf(line, "%c %s %s", &token, name, rename);
+        command next;
+        char *name, *rename;
+        int numTokens = splitLine(line, &next.token, &name, &rename);
 
         /* perform minimal validation */
         if (numTokens < 1) {
             continue;
         }
-        switch (token) {
+        switch (next.token) {
             case 'c':
             case 'l':
             case 'd':
                 if(numTokens != 2)
                     errorParse();
-                if(insertCommand(line)) {
-                    break;
-                }                    
+                next.name = parsedName(name, &next.bucketIndex);
+                executor_submit(&commands, next.bucketIndex, &next);
+                break;
             case 'r':
                 if(numTokens != 3)
                     errorParse();
-                if(insertCommand(line)) {
-                    break;
-                }
-                return;
+                next.name = parsedName(name, &next.bucketIndex);
+                next.rename = parsedName(rename, &next.renameBucketIndex);
+                executor_submit_joined(&commands, next.bucketIndex, next.renameBucketIndex, &next);
+                break;
             case '#':
                 break;
             default: { /* error */
@@ -131,81 +156,73 @@ void processInput(){
             }
         }
     }
-    for (int i = 0; i < numberThreads; i++) {
-        insertCommand("f"); 
-    }
+    executor_close(&commands); // Consumers stop once they applied every command
 }
 
 
-void* applyCommands(){    
-    while(1){
-        const char* command = removeCommand();
-        if (strcmp(command,"f") == 0) { // Whenever a thread reads a command 'f', the calling thread breaks from the while
-            MUTEX_COMMAND_UNLOCK(commandLock);
-            ASSERT_CHECK;
-            SEM_POST(produce);
-            ASSERT_CHECK;
+static void applyCommand(void* element){
+    command* c = element;
+    int searchResult;
+    switch (c->token) {
+        case 'c':
+            create(fs, c->name, obtainNewInumber(fs), c->bucketIndex);
             break;
+        case 'l':
+            searchResult = lookup(fs, c->name, c->bucketIndex);
+            if(!searchResult)
+                fprintf(stdout,"%s not found\n", c->name);
+            else
+                fprintf(stdout,"%s found with inumber %d\n", c->name, searchResult);
+            break;
+        case 'd':
+            delete(fs, c->name, c->bucketIndex);
+            break;
+        case 'r':
+            renameNode(fs, c->name, c->rename, c->bucketIndex, c->renameBucketIndex);
+            break;
+        default: { /* error */
+            fprintf(stderr, "Error: command to apply\n");
+            exit(EXIT_FAILURE);
         }
-        char token;
-        char name[MAX_INPUT_SIZE];
-        char rename[MAX_INPUT_SIZE];
-        sscanf(command, "%c %s %s", &token, name, rename);
-        int searchResult, iNumber;
-        int bucketIndex = hash(name, numberBuckets);
-        switch (token) {
-            case 'c':
-                iNumber = obtainNewInumber(fs);
-                MUTEX_COMMAND_UNLOCK(commandLock);
-                ASSERT_CHECK;
-                SEM_POST(produce);
-                ASSERT_CHECK;
-                create(fs, name, iNumber, bucketIndex);
-                break;
-            case 'l':
-                MUTEX_COMMAND_UNLOCK(commandLock);
-                ASSERT_CHECK;
-                SEM_POST(produce);
-                ASSERT_CHECK;
-                searchResult = lookup(fs, name, bucketIndex);
-                if(!searchResult)
-                    fprintf(stdout,"%s not found\n", name);
-                else
-                    fprintf(stdout,"%s found with inumber %d\n", name, searchResult);
-                break;
-            case 'd':
-                MUTEX_COMMAND_UNLOCK(commandLock);
-                ASSERT_CHECK;
-                SEM_POST(produce);
-                ASSERT_CHECK;
-                delete(fs, name, bucketIndex);
-                break;
-            case 'r':
-                MUTEX_COMMAND_UNLOCK(commandLock);
-                ASSERT_CHECK;
-                SEM_POST(produce);
-                ASSERT_CHECK;
-                renameNode(fs, name, rename, bucketIndex);
-                break;
-            default: { /* error */
-                MUTEX_COMMAND_UNLOCK(commandLock);
-                ASSERT_CHECK;
-                SEM_POST(produce);
-                ASSERT_CHECK;
-                fprintf(stderr, "Error: command to apply\n");
-                exit(EXIT_FAILURE);
-            }
-        }
     }
+}
+
+/* Pins the calling thread to the worker-th core it may run on, so a
+ * shard keeps its buckets in the same caches */
+static void pinThread(int worker){
+    cpu_set_t allowed, pinned;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+        perror("Error: Couldn't get the thread affinity");
+        exit(EXIT_FAILURE);
+    }
+    int core = -1;
+    for (int skip = worker % CPU_COUNT(&allowed); skip >= 0; skip--) {
+        while (!CPU_ISSET(++core, &allowed));
+    }
+    CPU_ZERO(&pinned);
+    CPU_SET(core, &pinned);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &pinned) != 0) {
+        fprintf(stderr, "Error: Couldn't pin thread to core %d\n", core);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void* applyCommands(void* worker){ // consumer
+    if (compileOption == 2)
+        pinThread((int) (long) worker);
+    executor_work(&commands, (int) (long) worker);
     return NULL;
 }
 
 int main(int argc, char* argv[]) {
     int i = 0, err;
     struct timeval start, end; // gettimeofday struct variables
-    srand(time(NULL)); // Seeding the random number generator used by the function rand
     
     parseArgs(argc, argv); // Reads the 3 arguments (Input,Output,Threads) from file
+    if (delay_configure(getenv(DELAY_ENV)) != 0) {
+        fprintf(stderr, "Error: Invalid %s, expected e.g. search=5000,insert,remove.\n", DELAY_ENV);
+        exit(EXIT_FAILURE);
+    }
     if (numberBuckets <= 0) {
         fprintf(stderr, "Error: Please use atleast one bucket.\n");
         exit(EXIT_FAILURE);
@@ -224,10 +241,8 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (sem_init(&produce, 0, MAX_COMMANDS) != 0 || sem_init(&consume, 0, 0) != 0) {
-            fprintf(stderr, "Error: Couldn't initialize semaphore\n");
-            exit(EXIT_FAILURE);
-        }
+    executor_init(&commands, numberThreads, numberBuckets, compileOption != 2, MAX_PENDING_COMMANDS, sizeof(command), applyCommand);
+    intern_init(&names);
     // Thread handling
     pthread_t tid[numberThreads]; // Thread declaration according to compilation arguments received
     if (compileOption == -1) {
@@ -235,7 +250,7 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "Error:Couldn't gettimeofday\n"); 
             exit(EXIT_FAILURE);
         }
-        err = pthread_create(&(tid[0]), NULL, applyCommands, NULL);
+        err = pthread_create(&(tid[0]), NULL, applyCommands, (void*) 0L);
         if (err != 0) {
             fprintf(stderr, "Error: Couldn't create thread\n");
             exit(EXIT_FAILURE);
@@ -251,16 +266,12 @@ int main(int argc, char* argv[]) {
             fprintf(stderr, "Error: Please use a thread number higher than 0 for this specific compiling option\n");
             exit(EXIT_FAILURE);
         }
-        if (pthread_mutex_init(&commandLock, NULL) != 0) {
-            fprintf(stderr, "Error: Couldn't initialize mutex\n");
-            exit(EXIT_FAILURE);
-        }   
         if ((err = gettimeofday(&start, NULL) != 0)) { 
             fprintf(stderr, "Error: Couldn't gettimeofday\n"); 
             exit(EXIT_FAILURE);
         }   
         while (i < numberThreads) {
-            err = pthread_create(&(tid[i]), NULL, applyCommands, NULL);
+            err = pthread_create(&(tid[i]), NULL, applyCommands, (void*) (long) i);
             if (err != 0) {
                 fprintf(stderr, "Error: Couldn't create thread\n");
                 exit(EXIT_FAILURE);
@@ -275,16 +286,10 @@ int main(int argc, char* argv[]) {
                 exit(EXIT_FAILURE);
             }
         }
-        if (pthread_mutex_destroy(&commandLock) != 0) {
-            fprintf(stderr, "Error: Couldn't destroy mutex\n");
-            exit(EXIT_FAILURE);
-        } // Destroying the lock that takes care of the command vector and the iNumber obtainment
     }
 
-    if (sem_destroy(&produce) != 0 || sem_destroy(&consume) != 0) {
-            fprintf(stderr, "Error: Couldn't destroy semaphore\n");
-            exit(EXIT_FAILURE);
-        }
+    executor_destroy(&commands);
+    intern_destroy(&names);
 
     fclose(input);   
     // Output handling
@@ -29,5 +29,11 @@ typedef enum permission { NONE, WRITE, READ, RW } permission;
 #define TECNICOFS_ERROR_INVALID_MODE -10 // perm denied
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
+/* A directory of the path is a file */
+#define TECNICOFS_ERROR_NOT_A_DIRECTORY -12
+/* The directory still has entries */
+#define TECNICOFS_ERROR_DIRECTORY_NOT_EMPTY -13
+/* The operation needs a file and was given a directory */
+#define TECNICOFS_ERROR_IS_A_DIRECTORY -14
 
 #endif /* TECNICOFS_API_CONSTANTS_H */
@@ -1,4 +1,5 @@
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-protocol.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -9,14 +10,306 @@
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <poll.h>
+#include <errno.h>
 
 #define MAX_INPUT_SIZE 100
+#define SEND_BUFFER_SIZE (64 * 1024) // Requests queued before they are sent
+#define MAX_IN_FLIGHT 128 // Requests sent whose response was not read yet
+
+/* A submitted request, kept until its result is collected. Responses
+ * come back in the order requests were sent, so the oldest request
+ * still waiting is always the one the next response belongs to. */
+typedef struct pending_request {
+    uint32_t requestId;
+    int state;
+    int status;
+    void* data; // Where the data that follows the status is stored
+    size_t maxLength;
+    int isText; // Reads get their data '\0' terminated and return its length
+} pending_request;
+
+enum { REQUEST_SENT, REQUEST_DONE, REQUEST_COLLECTED };
 
 int client_fd;
+uint32_t nextRequestId = 0;
+
+char* sendBuffer;
+size_t sendLength, sendCapacity;
+
+pending_request* pending; // Ring of submitted requests, oldest first
+size_t pendingHead, pendingCount, pendingCapacity;
+size_t pendingReceived; // Requests at the head whose response was read
+
+static pending_request* pendingAt(size_t i) {
+    return &pending[(pendingHead + i) % pendingCapacity];
+}
+
+static int receiveOldest();
+
+/* Sends the iovecs whole. The server stops reading requests while we
+ * don't take its responses, so while the socket would block, the
+ * responses that arrive are read into the requests they belong to. */
+static int sendMessage(struct iovec* iov, int count) {
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(client_fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            struct pollfd ready = { client_fd, POLLOUT, 0 };
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return TECNICOFS_ERROR_NO_OPEN_SESSION;
+            }
+            if (pendingReceived < pendingCount) {
+                ready.events |= POLLIN;
+            }
+            if (poll(&ready, 1, -1) < 0 && errno != EINTR) {
+                return TECNICOFS_ERROR_NO_OPEN_SESSION;
+            }
+            if ((ready.revents & POLLIN) && receiveOldest() != 0) {
+                return TECNICOFS_ERROR_NO_OPEN_SESSION;
+            }
+            continue;
+        }
+        while (message.msg_iovlen > 0 && (size_t) sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (char*) message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+static int flushRequests() {
+    struct iovec iov = { sendBuffer, sendLength };
+
+    if (sendLength > 0 && sendMessage(&iov, 1) != 0) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    sendLength = 0;
+    return 0;
+}
+
+/* Queues a request made of a fixed argument struct, an optional name
+ * and optional trailing data. Small requests are gathered and sent
+ * together, large ones go out straight from the caller's buffers. */
+static int sendRequest(uint8_t opcode, uint32_t requestId, const void* args, size_t argsLength,
+                       const char* name, size_t nameLength, const void* data, size_t dataLength) {
+    tfs_header header;
+    struct iovec iov[4] = {
+        { &header, sizeof(header) },
+        { (void*) args, argsLength },
+        { (void*) name, nameLength },
+        { (void*) data, dataLength }
+    };
+    size_t total = sizeof(header) + argsLength + nameLength + dataLength;
+
+    if (total - sizeof(header) > TFS_MAX_PAYLOAD_SIZE) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    memset(&header, 0, sizeof(header));
+    header.opcode = opcode;
+    header.requestId = requestId;
+    header.payloadLength = total - sizeof(header);
+
+    if (sendLength + total > SEND_BUFFER_SIZE && flushRequests() != 0) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    if (total <= SEND_BUFFER_SIZE) {
+        if (!sendBuffer && !(sendBuffer = malloc(SEND_BUFFER_SIZE))) {
+            return TECNICOFS_ERROR_OTHER;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (iov[i].iov_len > 0) {
+                memcpy(sendBuffer + sendLength, iov[i].iov_base, iov[i].iov_len);
+                sendLength += iov[i].iov_len;
+            }
+        }
+        return 0;
+    }
+
+    return sendMessage(iov, 4);
+}
+
+static int receiveAll(void* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t received = recv(client_fd, buffer, length, 0);
+        if (received <= 0) {
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+        buffer = (char*) buffer + received;
+        length -= received;
+    }
+    return 0;
+}
+
+/* Receives a response and returns its status. Any data that follows
+ * the status is stored in data, up to maxLength bytes, and its full
+ * length in dataLength. */
+static int receiveResponse(uint32_t* requestId, void* data, size_t maxLength, size_t* dataLength) {
+    tfs_header header;
+    tfs_status status;
+    char discard[MAX_INPUT_SIZE];
+
+    if (receiveAll(&header, sizeof(header)) != 0 || header.payloadLength < sizeof(status) ||
+        receiveAll(&status, sizeof(status)) != 0) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    *requestId = header.requestId;
+    size_t length = header.payloadLength - sizeof(status);
+    size_t kept = length < maxLength ? length : maxLength;
+    if (dataLength) {
+        *dataLength = length;
+    }
+    if (kept > 0 && receiveAll(data, kept) != 0) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    for (length -= kept; length > 0; length -= (length < sizeof(discard) ? length : sizeof(discard))) {
+        if (receiveAll(discard, length < sizeof(discard) ? length : sizeof(discard)) != 0) {
+            return TECNICOFS_ERROR_NO_OPEN_SESSION;
+        }
+    }
+    return status.status;
+}
+
+/* Reads the response of the oldest request still waiting for one,
+ * which must have been sent */
+static int receiveOldest() {
+    pending_request* entry = pendingAt(pendingReceived);
+    uint32_t requestId;
+    size_t readLength;
+    int status;
+
+    status = receiveResponse(&requestId, entry->data, entry->maxLength, &readLength);
+    if (entry->isText && status >= 0) {
+        char* text = entry->data;
+        text[readLength < entry->maxLength ? readLength : entry->maxLength] = '\0';
+        status = strlen(text);
+    }
+    if (status == TECNICOFS_ERROR_NO_OPEN_SESSION || requestId != entry->requestId) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    entry->status = status;
+    entry->state = REQUEST_DONE;
+    pendingReceived++;
+    return 0;
+}
 
-char return_message[100];
+/* Sends what is queued and reads the response of the oldest request
+ * still waiting for one, unless it arrived while sending */
+static int receiveNext() {
+    size_t received = pendingReceived;
+
+    if (pendingReceived == pendingCount) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    if (flushRequests() != 0) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    return pendingReceived > received ? 0 : receiveOldest();
+}
+
+static void collect(pending_request* entry) {
+    entry->state = REQUEST_COLLECTED;
+    while (pendingCount > 0 && pendingAt(0)->state == REQUEST_COLLECTED) {
+        pendingHead = (pendingHead + 1) % pendingCapacity;
+        pendingCount--;
+        pendingReceived--;
+    }
+}
+
+/* Queues a request and remembers it until its result is collected.
+ * Returns the request id, or a negative error. */
+static int submit(uint8_t opcode, const void* args, size_t argsLength, const char* name, size_t nameLength,
+                  const void* data, size_t dataLength, void* responseData, size_t maxLength, int isText) {
+    uint32_t requestId = nextRequestId;
+    int err;
+
+    // Bound what the server has to hold for us while we are not reading
+    if (pendingCount - pendingReceived >= MAX_IN_FLIGHT && (err = receiveNext()) != 0) {
+        return err;
+    }
+    if (pendingCount == pendingCapacity) {
+        size_t newCapacity = pendingCapacity ? pendingCapacity * 2 : MAX_IN_FLIGHT;
+        pending_request* grown = malloc(newCapacity * sizeof(pending_request));
+        if (!grown) {
+            return TECNICOFS_ERROR_OTHER;
+        }
+        for (size_t i = 0; i < pendingCount; i++) {
+            grown[i] = *pendingAt(i);
+        }
+        free(pending);
+        pending = grown;
+        pendingHead = 0;
+        pendingCapacity = newCapacity;
+    }
+    if ((err = sendRequest(opcode, requestId, args, argsLength, name, nameLength, data, dataLength)) != 0) {
+        return err;
+    }
+
+    pending_request* entry = pendingAt(pendingCount++);
+    entry->requestId = requestId;
+    entry->state = REQUEST_SENT;
+    entry->data = responseData;
+    entry->maxLength = maxLength;
+    entry->isText = isText;
+    nextRequestId = (nextRequestId + 1) & INT32_MAX;
+    return requestId;
+}
+
+int tfsFlush() {
+    return flushRequests();
+}
+
+int tfsWait(int requestId) {
+    size_t index = ((uint32_t) requestId - (pendingCount ? pendingAt(0)->requestId : 0)) & INT32_MAX;
+    int err;
+
+    if (requestId < 0 || index >= pendingCount || pendingAt(index)->state == REQUEST_COLLECTED) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    while (pendingAt(index)->state == REQUEST_SENT) {
+        if ((err = receiveNext()) != 0) {
+            return err;
+        }
+    }
+    pending_request* entry = pendingAt(index);
+    int status = entry->status;
+    collect(entry);
+    return status;
+}
+
+int tfsWaitAny(int* requestId) {
+    int err;
+
+    for (size_t i = 0; i < pendingCount; i++) {
+        pending_request* entry = pendingAt(i);
+        if (entry->state == REQUEST_DONE) {
+            int status = entry->status;
+            *requestId = entry->requestId;
+            collect(entry);
+            return status;
+        }
+    }
+    if (pendingReceived == pendingCount) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    // Everything received was collected, so the next response is the oldest request
+    if ((err = receiveNext()) != 0) {
+        return err;
+    }
+    return tfsWaitAny(requestId);
+}
 
 int tfsMount(char* sun_path) {
     
@@ -35,162 +328,274 @@ int tfsMount(char* sun_path) {
     return 0;
 }
 
-int tfsCreate(char *filename, permission ownerPermissions, permission othersPermissions) {
-    char command[MAX_INPUT_SIZE];
+int tfsSubmitCreate(char *filename, permission ownerPermissions, permission othersPermissions) {
+    tfs_create_args args;
+    size_t nameLength = strlen(filename);
 
-    if(!filename[0] || (ownerPermissions > 3 || ownerPermissions < 0) || (othersPermissions > 3 || othersPermissions < 0)) {
+    if(!filename[0] || nameLength > TFS_MAX_NAME_SIZE || (ownerPermissions > 3 || ownerPermissions < 0) || (othersPermissions > 3 || othersPermissions < 0)) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    snprintf(command, MAX_INPUT_SIZE, "c %s %d%d", filename, ownerPermissions, othersPermissions);
-   
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
-    }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
-    }
-    
-    return atoi(return_message);
+    args.ownerPermissions = ownerPermissions;
+    args.othersPermissions = othersPermissions;
+    return submit(TFS_OP_CREATE, &args, sizeof(args), filename, nameLength, NULL, 0, NULL, 0, 0);
 }
 
-int tfsDelete(char *filename) {
-    char command[MAX_INPUT_SIZE]; 
+int tfsSubmitDelete(char *filename) {
+    size_t nameLength = strlen(filename);
 
-    if (!filename[0]) {
+    if (!filename[0] || nameLength > TFS_MAX_NAME_SIZE) {
         return TECNICOFS_ERROR_OTHER;
     }
  
-    snprintf(command, MAX_INPUT_SIZE, "d %s", filename);
-    
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    return submit(TFS_OP_DELETE, NULL, 0, filename, nameLength, NULL, 0, NULL, 0, 0);
+}
+
+int tfsSubmitRename(char *filenameOld, char *filenameNew) {
+    tfs_rename_args args;
+    size_t oldLength = strlen(filenameOld), newLength = strlen(filenameNew);
+
+    if (!filenameOld[0] || !filenameNew[0] || oldLength > TFS_MAX_NAME_SIZE || newLength > TFS_MAX_NAME_SIZE) {
+        return TECNICOFS_ERROR_OTHER;
     }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+    args.oldNameLength = oldLength;
+    return submit(TFS_OP_RENAME, &args, sizeof(args), filenameOld, oldLength, filenameNew, newLength, NULL, 0, 0);
+}
+
+int tfsSubmitOpen(char *filename, permission mode) {
+    tfs_open_args args;
+    size_t nameLength = strlen(filename);
+
+    if (!filename[0] || nameLength > TFS_MAX_NAME_SIZE || (mode > 3 || mode < 0)) {
+        return TECNICOFS_ERROR_OTHER;
     }
 
-    return atoi(return_message);
+    args.mode = mode;
+    return submit(TFS_OP_OPEN, &args, sizeof(args), filename, nameLength, NULL, 0, NULL, 0, 0);
 }
 
-int tfsRename(char *filenameOld, char *filenameNew) {
-    char command[MAX_INPUT_SIZE];
+int tfsSubmitClose(int fd) {
+    tfs_fd_args args;
 
-    if (!filenameOld[0] || !filenameNew[0]) {
+    if (fd < 0 || fd > 4) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    snprintf(command, MAX_INPUT_SIZE, "r %s %s", filenameOld, filenameNew);
+    args.fd = fd;
+    return submit(TFS_OP_CLOSE, &args, sizeof(args), NULL, 0, NULL, 0, NULL, 0, 0);
+}
 
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+int tfsSubmitRead(int fd, char *buffer, int len) {
+    tfs_io_args args;
+    
+    if ((fd < 0 || fd > 4) || len <= 0) {
+        return TECNICOFS_ERROR_OTHER;
     }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    
+    args.fd = fd;
+    args.len = len - 1; // Room for the '\0'
+    return submit(TFS_OP_READ, &args, sizeof(args), NULL, 0, NULL, 0, buffer, len - 1, 1);
+}
+
+int tfsSubmitWrite(int fd, char *buffer, int len) {
+    tfs_fd_args args;
+
+    if ((fd < 0 || fd > 4) || !buffer[0] || len <= 0) {
+        return TECNICOFS_ERROR_OTHER;
     }
 
-    return atoi(return_message);
+    args.fd = fd;
+    return submit(TFS_OP_WRITE, &args, sizeof(args), NULL, 0, buffer, strnlen(buffer, len), NULL, 0, 0);
 }
 
-int tfsOpen(char *filename, permission mode) {
-    char command[MAX_INPUT_SIZE];
+int tfsSubmitReadAt(int fd, char *buffer, int len, long offset) {
+    tfs_read_at_args args;
 
-    if (!filename[0] || (mode > 3 || mode < 0)) {
+    if ((fd < 0 || fd > 4) || len < 0 || offset < 0) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    snprintf(command, MAX_INPUT_SIZE, "o %s %d", filename, mode);
-    
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
-    }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    args.fd = fd;
+    args.len = len;
+    args.offset = offset;
+    return submit(TFS_OP_READ_AT, &args, sizeof(args), NULL, 0, NULL, 0, buffer, len, 0);
+}
+
+int tfsSubmitWriteAt(int fd, char *buffer, int len, long offset) {
+    tfs_write_at_args args;
+
+    if ((fd < 0 || fd > 4) || len < 0 || offset < 0) {
+        return TECNICOFS_ERROR_OTHER;
     }
 
-    return atoi(return_message);
+    args.fd = fd;
+    args.offset = offset;
+    return submit(TFS_OP_WRITE_AT, &args, sizeof(args), NULL, 0, buffer, len, NULL, 0, 0);
 }
 
-int tfsClose(int fd) {
-    char command[MAX_INPUT_SIZE];
+int tfsSubmitAppend(int fd, char *buffer, int len) {
+    tfs_fd_args args;
 
-    if (fd < 0 || fd > 4) {
+    if ((fd < 0 || fd > 4) || len < 0) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    snprintf(command, MAX_INPUT_SIZE, "x %d", fd);
+    args.fd = fd;
+    return submit(TFS_OP_APPEND, &args, sizeof(args), NULL, 0, buffer, len, NULL, 0, 0);
+}
 
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
-    }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, 4, 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+int tfsSubmitTruncate(int fd, long size) {
+    tfs_truncate_args args;
+
+    if ((fd < 0 || fd > 4) || size < 0) {
+        return TECNICOFS_ERROR_OTHER;
     }
-    
-    return atoi(return_message);
+
+    args.fd = fd;
+    args.size = size;
+    return submit(TFS_OP_TRUNCATE, &args, sizeof(args), NULL, 0, NULL, 0, NULL, 0, 0);
+}
+
+static int waitSubmitted(int requestId) {
+    return requestId < 0 ? requestId : tfsWait(requestId);
+}
+
+int tfsCreate(char *filename, permission ownerPermissions, permission othersPermissions) {
+    return waitSubmitted(tfsSubmitCreate(filename, ownerPermissions, othersPermissions));
+}
+
+int tfsDelete(char *filename) {
+    return waitSubmitted(tfsSubmitDelete(filename));
+}
+
+int tfsRename(char *filenameOld, char *filenameNew) {
+    return waitSubmitted(tfsSubmitRename(filenameOld, filenameNew));
+}
+
+int tfsOpen(char *filename, permission mode) {
+    return waitSubmitted(tfsSubmitOpen(filename, mode));
+}
+
+int tfsClose(int fd) {
+    return waitSubmitted(tfsSubmitClose(fd));
 }
 
 int tfsRead(int fd, char *buffer, int len) {
-    char command[MAX_INPUT_SIZE]; 
-    
-    if ((fd < 0 || fd > 4) || len <= 0) {
+    return waitSubmitted(tfsSubmitRead(fd, buffer, len));
+}
+
+int tfsWrite(int fd, char *buffer, int len) {
+    return waitSubmitted(tfsSubmitWrite(fd, buffer, len));
+}
+
+int tfsReadAt(int fd, char *buffer, int len, long offset) {
+    return waitSubmitted(tfsSubmitReadAt(fd, buffer, len, offset));
+}
+
+int tfsWriteAt(int fd, char *buffer, int len, long offset) {
+    return waitSubmitted(tfsSubmitWriteAt(fd, buffer, len, offset));
+}
+
+int tfsAppend(int fd, char *buffer, int len) {
+    return waitSubmitted(tfsSubmitAppend(fd, buffer, len));
+}
+
+int tfsTruncate(int fd, long size) {
+    return waitSubmitted(tfsSubmitTruncate(fd, size));
+}
+
+int tfsCreateMany(char **filenames, int count, permission ownerPermissions, permission othersPermissions, int *results) {
+    tfs_create_many_args args;
+    size_t payloadLength = 0, offset = 0;
+    char* payload;
+    int requestId;
+
+    if (count <= 0 || (ownerPermissions > 3 || ownerPermissions < 0) || (othersPermissions > 3 || othersPermissions < 0)) {
         return TECNICOFS_ERROR_OTHER;
     }
-    
-    snprintf(command, MAX_INPUT_SIZE, "l %d %d", fd, len);
-    
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    for (int i = 0; i < count; i++) {
+        size_t nameLength = strlen(filenames[i]);
+        if (!nameLength || nameLength > TFS_MAX_NAME_SIZE) {
+            return TECNICOFS_ERROR_OTHER;
+        }
+        payloadLength += sizeof(uint16_t) + nameLength;
     }
-    
-    memset(return_message, 0, sizeof(return_message));
-    
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    if (payloadLength > TFS_MAX_PAYLOAD_SIZE || !(payload = malloc(payloadLength))) {
+        return TECNICOFS_ERROR_OTHER;
     }
+    for (int i = 0; i < count; i++) {
+        uint16_t nameLength = strlen(filenames[i]);
+        memcpy(payload + offset, &nameLength, sizeof(nameLength));
+        memcpy(payload + offset + sizeof(nameLength), filenames[i], nameLength);
+        offset += sizeof(nameLength) + nameLength;
+    }
+
+    args.ownerPermissions = ownerPermissions;
+    args.othersPermissions = othersPermissions;
+    args.count = count;
+    requestId = submit(TFS_OP_CREATE_MANY, &args, sizeof(args), NULL, 0, payload, payloadLength,
+                       results, results ? count * sizeof(int32_t) : 0, 0);
+    free(payload);
+    return waitSubmitted(requestId);
+}
 
-    if (atoi(return_message) < 0) {
-        return atoi(return_message);
+int tfsMkdir(char *path, permission ownerPermissions, permission othersPermissions) {
+    tfs_create_args args;
+    size_t pathLength = strlen(path);
+
+    if (!path[0] || pathLength > TFS_MAX_NAME_SIZE || (ownerPermissions > 3 || ownerPermissions < 0) || (othersPermissions > 3 || othersPermissions < 0)) {
+        return TECNICOFS_ERROR_OTHER;
     }
-    
-    strncpy(buffer, return_message, len-1);
-    buffer[len-1] = '\0';
-    return strlen(buffer);
+
+    args.ownerPermissions = ownerPermissions;
+    args.othersPermissions = othersPermissions;
+    return waitSubmitted(submit(TFS_OP_MKDIR, &args, sizeof(args), path, pathLength, NULL, 0, NULL, 0, 0));
 }
 
-int tfsWrite(int fd, char *buffer, int len) {
-    char command[5 + len];
+int tfsReaddir(char *path, char *buffer, int len) {
+    tfs_readdir_args args;
+    size_t pathLength = strlen(path);
 
-    if ((fd < 0 || fd > 4) || !buffer[0] || len <= 0) {
+    if (!path[0] || pathLength > TFS_MAX_NAME_SIZE || len < 0) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    snprintf(command, MAX_INPUT_SIZE, "w %d %s", fd, buffer);
+    args.len = len;
+    return waitSubmitted(submit(TFS_OP_READDIR, &args, sizeof(args), path, pathLength, NULL, 0, buffer, len, 0));
+}
 
-    if (send(client_fd, command, strlen(command), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+int tfsSetDelay(char *spec) {
+    size_t specLength = strlen(spec);
+
+    if (specLength > TFS_MAX_NAME_SIZE) {
+        return TECNICOFS_ERROR_OTHER;
     }
-    memset(return_message, 0, sizeof(return_message));
-    if (recv(client_fd, return_message, sizeof(return_message), 0) < 0) {
-        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+    return waitSubmitted(submit(TFS_OP_SET_DELAY, NULL, 0, spec, specLength, NULL, 0, NULL, 0, 0));
+}
+
+int tfsStats(char *buffer, int len) {
+    if (len <= 0) {
+        return TECNICOFS_ERROR_OTHER;
     }
 
-    return atoi(return_message);
+    return waitSubmitted(submit(TFS_OP_STATS, NULL, 0, NULL, 0, NULL, 0, buffer, len - 1, 1));
 }
 
 int tfsUnmount() {
-    char term_msg[2];
-    strncpy(term_msg, "f", 2);
-    if (send(client_fd, term_msg, strlen(term_msg), 0)  < 0) {
+    int err = sendRequest(TFS_OP_UNMOUNT, nextRequestId, NULL, 0, NULL, 0, NULL, 0);
+
+    // Results not collected yet are dropped with the session
+    free(pending);
+    pending = NULL;
+    pendingHead = pendingCount = pendingCapacity = pendingReceived = 0;
+
+    if (err != 0 || flushRequests() != 0) {
         return TECNICOFS_ERROR_NO_OPEN_SESSION;
     } else if (close(client_fd) == 0) {
         return 0;
     } else {
         return TECNICOFS_ERROR_OTHER;
     }
-}
\ No newline at end of file
+}
@@ -14,4 +14,53 @@ int tfsWrite(int fd, char *buffer, int len);
 int tfsMount(char * address);
 int tfsUnmount();
 
+/* Offset based access to binary contents. tfsReadAt returns how many
+ * bytes were read, fewer than len at the end of the file, and doesn't
+ * '\0' terminate them. Writing past the end leaves a hole of zeros. */
+int tfsReadAt(int fd, char *buffer, int len, long offset);
+int tfsWriteAt(int fd, char *buffer, int len, long offset);
+int tfsAppend(int fd, char *buffer, int len);
+int tfsTruncate(int fd, long size);
+
+/* Creates count files in a single request, storing the result of each
+ * create in results when it is not NULL. Returns how many were created. */
+int tfsCreateMany(char **filenames, int count, permission ownerPermissions, permission othersPermissions, int *results);
+
+/* Paths name files below directories, as in "/a/b/file", a leading
+ * '/' being optional; every function taking a file name takes a path.
+ * Directories are deleted with tfsDelete once empty. tfsReaddir fills
+ * buffer with the names in a directory, "/" for the root, each '\0'
+ * terminated, as many whole names as fit in len bytes, and returns how
+ * many it stored. */
+int tfsMkdir(char *path, permission ownerPermissions, permission othersPermissions);
+int tfsReaddir(char *path, char *buffer, int len);
+
+/* Administration, only allowed to the user running the server. Sets
+ * the latency injected into the server's trees, e.g. "search=5000",
+ * with the spec of TECNICOFS_DELAY; an empty spec turns it off. */
+int tfsSetDelay(char *spec);
+
+/* Administration, fills buffer with the server's latency and lock
+ * statistics, one "key=value ..." line each, truncated to len - 1
+ * characters. Returns the length of the text. */
+int tfsStats(char *buffer, int len);
+
+/* Pipelined variants: each call queues its request and returns an id
+ * to collect the result with later, without waiting for the server.
+ * A read's buffer must stay valid until its result is collected. */
+int tfsSubmitCreate(char *filename, permission ownerPermissions, permission othersPermissions);
+int tfsSubmitDelete(char *filename);
+int tfsSubmitRename(char *filenameOld, char *filenameNew);
+int tfsSubmitOpen(char *filename, permission mode);
+int tfsSubmitClose(int fd);
+int tfsSubmitRead(int fd, char *buffer, int len);
+int tfsSubmitWrite(int fd, char *buffer, int len);
+int tfsSubmitReadAt(int fd, char *buffer, int len, long offset);
+int tfsSubmitWriteAt(int fd, char *buffer, int len, long offset);
+int tfsSubmitAppend(int fd, char *buffer, int len);
+int tfsSubmitTruncate(int fd, long size);
+int tfsFlush(); // Sends queued requests without waiting for results
+int tfsWait(int requestId); // Result of the given request, as its blocking call would return it
+int tfsWaitAny(int *requestId); // Result of any finished request, oldest first
+
 #endif /* TECNICOFS_CLIENT_API_H */
@@ -0,0 +1,101 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+#include <stdint.h>
+
+/* Every message, request or response, is a tfs_header followed by
+ * payloadLength bytes of payload. Integers travel in host byte order,
+ * client and server always share a machine over a Unix socket.
+ * Names are sent without their terminating '\0'. */
+
+#define TFS_MAX_PAYLOAD_SIZE (64 << 20)
+#define TFS_MAX_NAME_SIZE 1024
+
+typedef enum tfs_opcode {
+    TFS_OP_CREATE = 'c',  /* tfs_create_args, name */
+    TFS_OP_DELETE = 'd',  /* name */
+    TFS_OP_RENAME = 'r',  /* tfs_rename_args, old name, new name */
+    TFS_OP_OPEN = 'o',    /* tfs_open_args, name */
+    TFS_OP_CLOSE = 'x',   /* tfs_fd_args */
+    TFS_OP_READ = 'l',    /* tfs_io_args */
+    TFS_OP_WRITE = 'w',   /* tfs_fd_args, data */
+    TFS_OP_CREATE_MANY = 'C', /* tfs_create_many_args, count names each preceded by a uint16_t length */
+    TFS_OP_READ_AT = 'R',  /* tfs_read_at_args */
+    TFS_OP_WRITE_AT = 'W', /* tfs_write_at_args, data */
+    TFS_OP_APPEND = 'a',   /* tfs_fd_args, data */
+    TFS_OP_TRUNCATE = 't', /* tfs_truncate_args */
+    TFS_OP_SET_DELAY = 'D', /* delay spec, see delay_configure in Server/lib/bst.c */
+    TFS_OP_STATS = 'S',     /* empty, answered with the report of Server/stats.c as text */
+    TFS_OP_MKDIR = 'm',     /* tfs_create_args, path */
+    TFS_OP_READDIR = 'e',   /* tfs_readdir_args, path, "/" for the root */
+    TFS_OP_UNMOUNT = 'f'  /* empty, the server closes the session without a response */
+} tfs_opcode;
+
+typedef struct tfs_header {
+    uint8_t opcode;
+    uint8_t reserved[3];
+    uint32_t requestId; /* Echoed back in the response */
+    uint32_t payloadLength;
+} tfs_header;
+
+/* Responses carry the opcode and id of their request and a
+ * tfs_status payload, followed by the data read for TFS_OP_READ and
+ * TFS_OP_READ_AT,
+ * an int32_t status per file for TFS_OP_CREATE_MANY and, for
+ * TFS_OP_READDIR, as many names as the status says, each '\0'
+ * terminated. A client may send
+ * several requests before reading their responses, which come back
+ * in the same order. */
+typedef struct tfs_status {
+    int32_t status;
+} tfs_status;
+
+typedef struct tfs_create_args {
+    uint8_t ownerPermissions;
+    uint8_t othersPermissions;
+} __attribute__((packed)) tfs_create_args;
+
+typedef struct tfs_create_many_args {
+    uint8_t ownerPermissions;
+    uint8_t othersPermissions;
+    uint32_t count;
+} __attribute__((packed)) tfs_create_many_args;
+
+typedef struct tfs_readdir_args {
+    int32_t len; /* Most bytes of names wanted, only whole names are sent */
+} __attribute__((packed)) tfs_readdir_args;
+
+typedef struct tfs_rename_args {
+    uint16_t oldNameLength;
+} __attribute__((packed)) tfs_rename_args;
+
+typedef struct tfs_open_args {
+    uint8_t mode;
+} __attribute__((packed)) tfs_open_args;
+
+typedef struct tfs_fd_args {
+    int32_t fd;
+} __attribute__((packed)) tfs_fd_args;
+
+typedef struct tfs_io_args {
+    int32_t fd;
+    int32_t len;
+} __attribute__((packed)) tfs_io_args;
+
+typedef struct tfs_read_at_args {
+    int32_t fd;
+    int32_t len;
+    int64_t offset;
+} __attribute__((packed)) tfs_read_at_args;
+
+typedef struct tfs_write_at_args {
+    int32_t fd;
+    int64_t offset;
+} __attribute__((packed)) tfs_write_at_args;
+
+typedef struct tfs_truncate_args {
+    int32_t fd;
+    int64_t size;
+} __attribute__((packed)) tfs_truncate_args;
+
+#endif /* TECNICOFS_PROTOCOL_H */
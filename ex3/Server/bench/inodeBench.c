@@ -0,0 +1,108 @@
+/* inodeBench.c
+ * Measures i-node throughput. Every thread reads and writes the
+ * contents of its own files, so operations only compete for the
+ * i-node table itself.
+ * Usage: inodeBench numberThreads numberFiles numberOps writePercent fileSize */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../lib/inodes.h"
+
+int numberThreads, numberFiles, numberOps, writePercent, fileSize;
+int* inumbers; // numberFiles per thread
+
+static double elapsed(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void* accessFiles(void* arg) {
+    long thread = (long) arg;
+    unsigned int seed = thread + 1;
+    char* contents = malloc(fileSize + 1);
+    char* buffer = malloc(fileSize + 1);
+
+    if (!contents || !buffer) {
+        perror("Failed to allocate file buffers");
+        exit(EXIT_FAILURE);
+    }
+    memset(contents, 'a' + thread % 26, fileSize);
+    contents[fileSize] = '\0';
+
+    for (int i = 0; i < numberOps; i++) {
+        int inumber = inumbers[thread * numberFiles + rand_r(&seed) % numberFiles];
+        if (rand_r(&seed) % 100 < writePercent) {
+            if (inode_set(inumber, contents, fileSize) != 0) {
+                fprintf(stderr, "Error: write of i-node %d failed\n", inumber);
+                exit(EXIT_FAILURE);
+            }
+        } else if (inode_get(inumber, NULL, NULL, NULL, buffer, fileSize) != fileSize) {
+            fprintf(stderr, "Error: read of i-node %d failed\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(contents);
+    free(buffer);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    struct timespec start, end;
+
+    if (argc != 6) {
+        fprintf(stderr, "Usage: %s numberThreads numberFiles numberOps writePercent fileSize\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    numberThreads = atoi(argv[1]);
+    numberFiles = atoi(argv[2]);
+    numberOps = atoi(argv[3]);
+    writePercent = atoi(argv[4]);
+    fileSize = atoi(argv[5]);
+    if (numberThreads <= 0 || numberFiles <= 0 || numberOps <= 0 || writePercent < 0 || writePercent > 100 || fileSize <= 0) {
+        fprintf(stderr, "Error: Counts and sizes must be positive, writePercent within 0-100.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    inode_table_init();
+    inumbers = malloc(sizeof(int) * numberThreads * numberFiles);
+    char* initial = malloc(fileSize + 1);
+    pthread_t tid[numberThreads];
+    if (!inumbers || !initial) {
+        perror("Failed to allocate files");
+        exit(EXIT_FAILURE);
+    }
+    memset(initial, 'z', fileSize);
+    initial[fileSize] = '\0';
+    for (int i = 0; i < numberThreads * numberFiles; i++) {
+        if ((inumbers[i] = inode_create(0, RW, RW)) == -1 || inode_set(inumbers[i], initial, fileSize) != 0) {
+            fprintf(stderr, "Error: Couldn't create i-node\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long t = 0; t < numberThreads; t++) {
+        if (pthread_create(&tid[t], NULL, accessFiles, (void*) t) != 0) {
+            fprintf(stderr, "Error: Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < numberThreads; t++) {
+        if (pthread_join(tid[t], NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't join thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long total = (long) numberThreads * numberOps;
+    double seconds = elapsed(&start, &end);
+    printf("threads=%d ops=%ld write_pct=%d size=%d seconds=%.3f ops_per_sec=%.0f\n",
+           numberThreads, total, writePercent, fileSize, seconds, total / seconds);
+
+    free(initial);
+    free(inumbers);
+    inode_table_destroy();
+    exit(EXIT_SUCCESS);
+}
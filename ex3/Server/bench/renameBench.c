@@ -0,0 +1,103 @@
+/* renameBench.c
+ * Measures renameNode latency under contention. Every thread renames
+ * its own files back and forth between two names, so renames always
+ * succeed and only compete for bucket locks.
+ * Usage: renameBench numberThreads numberFiles numberRenames numberBuckets */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "../fs.h"
+
+#define MAX_NAME_SIZE 32
+
+tecnicofs* fs;
+int numberThreads, numberFiles, numberRenames;
+double* latencies; // Microseconds, numberRenames per thread
+
+static double elapsed(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * 1e6 + (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void* renameFiles(void* arg) {
+    long thread = (long) arg;
+    char name[MAX_NAME_SIZE], rename[MAX_NAME_SIZE];
+    struct timespec start, end;
+
+    for (int i = 0; i < numberRenames; i++) {
+        int file = i % numberFiles, round = i / numberFiles;
+        snprintf(name, MAX_NAME_SIZE, "%c%ld-%d", round % 2 ? 'g' : 'f', thread, file);
+        snprintf(rename, MAX_NAME_SIZE, "%c%ld-%d", round % 2 ? 'f' : 'g', thread, file);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (renameNode(fs, name, rename) != 0) {
+            fprintf(stderr, "Error: rename of %s failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies[thread * numberRenames + i] = elapsed(&start, &end);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    char name[MAX_NAME_SIZE];
+    struct timespec start, end;
+
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s numberThreads numberFiles numberRenames numberBuckets\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    numberThreads = atoi(argv[1]);
+    numberFiles = atoi(argv[2]);
+    numberRenames = atoi(argv[3]);
+    numberBuckets = atoi(argv[4]);
+    if (numberThreads <= 0 || numberFiles <= 0 || numberRenames <= 0 || numberBuckets <= 0) {
+        fprintf(stderr, "Error: All arguments must be positive.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fs = new_tecnicofs();
+    latencies = malloc(sizeof(double) * numberThreads * numberRenames);
+    pthread_t tid[numberThreads];
+    if (!latencies) {
+        perror("Failed to allocate latencies");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < numberThreads; t++) {
+        for (int i = 0; i < numberFiles; i++) {
+            snprintf(name, MAX_NAME_SIZE, "f%d-%d", t, i);
+            create(fs, name, t * numberFiles + i);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long t = 0; t < numberThreads; t++) {
+        if (pthread_create(&tid[t], NULL, renameFiles, (void*) t) != 0) {
+            fprintf(stderr, "Error: Couldn't create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < numberThreads; t++) {
+        if (pthread_join(tid[t], NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't join thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long total = (long) numberThreads * numberRenames;
+    qsort(latencies, total, sizeof(double), compare_latencies);
+    printf("threads=%d renames=%ld seconds=%.3f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+           numberThreads, total, elapsed(&start, &end) / 1e6,
+           latencies[total / 2], latencies[total * 99 / 100], latencies[total - 1]);
+
+    free(latencies);
+    free_tecnicofs(fs);
+    exit(EXIT_SUCCESS);
+}
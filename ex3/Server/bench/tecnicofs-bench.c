@@ -0,0 +1,360 @@
+/* tecnicofs-bench.c
+ * Load generator for a running server. Forks numberClients clients,
+ * since the client API holds one session per process, and each does
+ * numberOps operations drawn from the op mix over a shared key space.
+ * Prints the throughput and latency percentiles of every operation,
+ * and of all of them together, as key=value lines.
+ * Usage: tecnicofs-bench [-c numberClients] [-n numberOps] [-k numberKeys]
+ *                        [-s payloadSize] [-m mix] [-d distribution] [-e] socketPath
+ *  - mix: weights such as "create=10,read=40,write=20", from the
+ *         operations create, open, read, write, rename and delete
+ *  - distribution: uniform, zipfian or sequential choice of keys
+ *  - e: start from an empty file system instead of creating every key */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../../Client/tecnicofs-client-api.h"
+
+#define MAX_NAME_SIZE 32
+#define PREFILL_BATCH 1000
+#define ZIPF_THETA 0.99
+#define DEFAULT_MIX "create=10,open=10,read=40,write=20,rename=10,delete=10"
+
+/* Latencies are counted in buckets 1/SUB_BUCKETS of a power of two
+ * wide, so percentiles come out within about 3% of the real value */
+#define SUB_BUCKETS 32
+#define HISTOGRAM_SIZE (2 * SUB_BUCKETS + (64 - 6) * SUB_BUCKETS)
+
+typedef enum bench_op { OP_CREATE, OP_OPEN, OP_READ, OP_WRITE, OP_RENAME, OP_DELETE, NUMBER_OPS } bench_op;
+static const char* opNames[NUMBER_OPS] = { "create", "open", "read", "write", "rename", "delete" };
+
+typedef enum key_distribution { UNIFORM, ZIPFIAN, SEQUENTIAL } key_distribution;
+
+typedef struct op_stats {
+    uint64_t count;
+    uint64_t failed;
+    uint64_t histogram[HISTOGRAM_SIZE]; // Nanoseconds
+} op_stats;
+
+int numberClients = 4, numberOps = 10000, numberKeys = 1000, payloadSize = 100, prefill = 1;
+key_distribution distribution = UNIFORM;
+int weights[NUMBER_OPS], totalWeight;
+double zetan, eta; // Zipfian constants over numberKeys
+char* socketPath;
+char* payload;
+op_stats* stats; // NUMBER_OPS per client, shared with the clients
+
+static int histogram_index(uint64_t ns) {
+    if (ns < 2 * SUB_BUCKETS)
+        return ns;
+    int exponent = 63 - __builtin_clzll(ns); // At least 6
+    int index = 2 * SUB_BUCKETS + (exponent - 6) * SUB_BUCKETS + (int) ((ns >> (exponent - 5)) - SUB_BUCKETS);
+    return index < HISTOGRAM_SIZE ? index : HISTOGRAM_SIZE - 1;
+}
+
+/* Highest latency counted in a bucket */
+static uint64_t histogram_value(int index) {
+    if (index < 2 * SUB_BUCKETS)
+        return index;
+    int exponent = 6 + (index - 2 * SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t mantissa = SUB_BUCKETS + (index - 2 * SUB_BUCKETS) % SUB_BUCKETS;
+    return ((mantissa + 1) << (exponent - 5)) - 1;
+}
+
+static double percentile_us(const op_stats* s, double fraction) {
+    uint64_t rank = (uint64_t) ceil(fraction * s->count), seen = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += s->histogram[i];
+        if (seen >= rank && seen > 0)
+            return histogram_value(i) / 1e3;
+    }
+    return 0;
+}
+
+static double elapsed(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void parse_mix(const char* mix) {
+    char* copy = strdup(mix);
+    char* token, *save;
+
+    memset(weights, 0, sizeof(weights));
+    totalWeight = 0;
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(token, '=');
+        int op;
+        if (value)
+            *value++ = '\0';
+        for (op = 0; op < NUMBER_OPS && strcmp(token, opNames[op]) != 0; op++);
+        if (op == NUMBER_OPS || !value || atoi(value) < 0) {
+            fprintf(stderr, "Error: Invalid op mix entry %s.\n", token);
+            exit(EXIT_FAILURE);
+        }
+        weights[op] = atoi(value);
+        totalWeight += weights[op];
+    }
+    free(copy);
+    if (totalWeight == 0) {
+        fprintf(stderr, "Error: The op mix must have some weight.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void parseArgs(int argc, char* argv[]) {
+    const char* mix = DEFAULT_MIX;
+    int option;
+
+    while ((option = getopt(argc, argv, "c:n:k:s:m:d:e")) != -1) {
+        switch (option) {
+            case 'c': numberClients = atoi(optarg); break;
+            case 'n': numberOps = atoi(optarg); break;
+            case 'k': numberKeys = atoi(optarg); break;
+            case 's': payloadSize = atoi(optarg); break;
+            case 'm': mix = optarg; break;
+            case 'd':
+                if (!strcmp(optarg, "uniform"))
+                    distribution = UNIFORM;
+                else if (!strcmp(optarg, "zipfian"))
+                    distribution = ZIPFIAN;
+                else if (!strcmp(optarg, "sequential"))
+                    distribution = SEQUENTIAL;
+                else {
+                    fprintf(stderr, "Error: Unknown key distribution %s.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e': prefill = 0; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c numberClients] [-n numberOps] [-k numberKeys] [-s payloadSize] "
+                        "[-m mix] [-d uniform|zipfian|sequential] [-e] socketPath\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1 || numberClients <= 0 || numberOps <= 0 || numberKeys <= 0 || payloadSize < 0) {
+        fprintf(stderr, "Error: Expected a socket path and positive counts.\n");
+        exit(EXIT_FAILURE);
+    }
+    socketPath = argv[optind];
+    parse_mix(mix);
+}
+
+/* Constants of the zipfian generator of Gray et al., "Quickly
+ * Generating Billion-Record Synthetic Databases" */
+static void init_zipfian() {
+    zetan = 0;
+    for (int i = 1; i <= numberKeys; i++)
+        zetan += 1 / pow(i, ZIPF_THETA);
+    double zeta2 = 1 + 1 / pow(2, ZIPF_THETA);
+    eta = (1 - pow(2.0 / numberKeys, 1 - ZIPF_THETA)) / (1 - zeta2 / zetan);
+}
+
+static int pick_key(int client, unsigned int* seed, long* next) {
+    switch (distribution) {
+        case ZIPFIAN: {
+            double u = rand_r(seed) / (RAND_MAX + 1.0), uz = u * zetan;
+            if (uz < 1)
+                return 0;
+            if (uz < 1 + pow(0.5, ZIPF_THETA))
+                return 1 % numberKeys;
+            int key = numberKeys * pow(eta * u - eta + 1, 1 / (1 - ZIPF_THETA));
+            return key < numberKeys ? key : numberKeys - 1;
+        }
+        case SEQUENTIAL: // Each client starts at its own share of the keys
+            return ((long) client * numberKeys / numberClients + (*next)++) % numberKeys;
+        default:
+            return rand_r(seed) % numberKeys;
+    }
+}
+
+static bench_op pick_op(unsigned int* seed) {
+    int weight = rand_r(seed) % totalWeight, op = 0;
+    while (weight >= weights[op])
+        weight -= weights[op++];
+    return op;
+}
+
+/* Returns a negative error if any of the calls making up op failed */
+static int run_op(bench_op op, const char* name, const char* newName, char* buffer) {
+    int fd, result;
+
+    switch (op) {
+        case OP_CREATE:
+            return tfsCreate((char*) name, RW, READ);
+        case OP_OPEN:
+            if ((fd = tfsOpen((char*) name, READ)) < 0)
+                return fd;
+            return tfsClose(fd);
+        case OP_READ:
+            if ((fd = tfsOpen((char*) name, READ)) < 0)
+                return fd;
+            result = tfsReadAt(fd, buffer, payloadSize, 0);
+            return tfsClose(fd) != 0 || result < 0 ? TECNICOFS_ERROR_OTHER : 0;
+        case OP_WRITE:
+            if ((fd = tfsOpen((char*) name, WRITE)) < 0)
+                return fd;
+            result = tfsWriteAt(fd, payload, payloadSize, 0);
+            return tfsClose(fd) != 0 || result < 0 ? TECNICOFS_ERROR_OTHER : 0;
+        case OP_RENAME:
+            return tfsRename((char*) name, (char*) newName);
+        default:
+            return tfsDelete((char*) name);
+    }
+}
+
+static void runClient(int client, int startPipe) {
+    op_stats* own = &stats[client * NUMBER_OPS];
+    unsigned int seed = client + 1;
+    long next = 0;
+    char name[MAX_NAME_SIZE], newName[MAX_NAME_SIZE], start;
+    char* buffer = malloc(payloadSize + 1);
+    struct timespec before, after;
+
+    if (!buffer) {
+        perror("Failed to allocate read buffer");
+        exit(EXIT_FAILURE);
+    }
+    if (tfsMount(socketPath) != 0) {
+        fprintf(stderr, "Error: Client %d couldn't mount %s.\n", client, socketPath);
+        exit(EXIT_FAILURE);
+    }
+    if (read(startPipe, &start, 1) != 0) { // Returns once every client is ready
+        fprintf(stderr, "Error: Client %d wasn't started.\n", client);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numberOps; i++) {
+        bench_op op = pick_op(&seed);
+        snprintf(name, MAX_NAME_SIZE, "k%d", pick_key(client, &seed, &next));
+        snprintf(newName, MAX_NAME_SIZE, "k%d", pick_key(client, &seed, &next));
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        int result = run_op(op, name, newName, buffer);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        uint64_t ns = (after.tv_sec - before.tv_sec) * 1000000000ULL + after.tv_nsec - before.tv_nsec;
+        own[op].count++;
+        own[op].failed += result < 0;
+        own[op].histogram[histogram_index(ns)]++;
+    }
+    tfsUnmount();
+    free(buffer);
+}
+
+/* Creates every key, with payloadSize bytes of contents */
+static void prefillKeys() {
+    char* names[PREFILL_BATCH];
+    char name[MAX_NAME_SIZE];
+
+    if (tfsMount(socketPath) != 0) {
+        fprintf(stderr, "Error: Couldn't mount %s.\n", socketPath);
+        exit(EXIT_FAILURE);
+    }
+    for (int first = 0; first < numberKeys; first += PREFILL_BATCH) {
+        int count = numberKeys - first < PREFILL_BATCH ? numberKeys - first : PREFILL_BATCH;
+        for (int i = 0; i < count; i++) {
+            names[i] = malloc(MAX_NAME_SIZE);
+            snprintf(names[i], MAX_NAME_SIZE, "k%d", first + i);
+        }
+        tfsCreateMany(names, count, RW, READ, NULL);
+        for (int i = 0; i < count; i++)
+            free(names[i]);
+    }
+    for (int key = 0; key < numberKeys && payloadSize > 0; key++) {
+        snprintf(name, MAX_NAME_SIZE, "k%d", key);
+        int fd = tfsOpen(name, WRITE);
+        if (fd >= 0) {
+            tfsWriteAt(fd, payload, payloadSize, 0);
+            tfsClose(fd);
+        }
+    }
+    tfsUnmount();
+}
+
+static void printStats(const char* name, const op_stats* s, double seconds) {
+    if (s->count == 0)
+        return;
+    printf("op=%s count=%lu failed=%lu ops_per_sec=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+           name, (unsigned long) s->count, (unsigned long) s->failed, s->count / seconds,
+           percentile_us(s, 0.5), percentile_us(s, 0.99), percentile_us(s, 0.999), percentile_us(s, 1));
+}
+
+int main(int argc, char* argv[]) {
+    int startPipe[2];
+    struct timespec start, end;
+
+    parseArgs(argc, argv);
+    if (distribution == ZIPFIAN)
+        init_zipfian();
+    if (!(payload = malloc(payloadSize + 1))) {
+        perror("Failed to allocate payload");
+        exit(EXIT_FAILURE);
+    }
+    memset(payload, 'p', payloadSize);
+    stats = mmap(NULL, sizeof(op_stats) * NUMBER_OPS * numberClients, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("Failed to allocate statistics");
+        exit(EXIT_FAILURE);
+    }
+    if (prefill)
+        prefillKeys();
+
+    if (pipe(startPipe) != 0) {
+        perror("Failed to create start pipe");
+        exit(EXIT_FAILURE);
+    }
+    for (int c = 0; c < numberClients; c++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Failed to fork client");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(startPipe[1]);
+            runClient(c, startPipe[0]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    close(startPipe[0]);
+    usleep(100000); // Let the clients mount before starting them
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    close(startPipe[1]);
+    int status, failedClients = 0;
+    while (wait(&status) > 0)
+        failedClients += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (failedClients > 0) {
+        fprintf(stderr, "Error: %d clients failed.\n", failedClients);
+        exit(EXIT_FAILURE);
+    }
+
+    double seconds = elapsed(&start, &end);
+    op_stats total, byOp;
+    memset(&total, 0, sizeof(total));
+    for (int op = 0; op < NUMBER_OPS; op++) {
+        memset(&byOp, 0, sizeof(byOp));
+        for (int c = 0; c < numberClients; c++) {
+            const op_stats* s = &stats[c * NUMBER_OPS + op];
+            byOp.count += s->count;
+            byOp.failed += s->failed;
+            for (int i = 0; i < HISTOGRAM_SIZE; i++)
+                byOp.histogram[i] += s->histogram[i];
+        }
+        printStats(opNames[op], &byOp, seconds);
+        total.count += byOp.count;
+        total.failed += byOp.failed;
+        for (int i = 0; i < HISTOGRAM_SIZE; i++)
+            total.histogram[i] += byOp.histogram[i];
+    }
+    printf("clients=%d keys=%d payload=%d seconds=%.3f ", numberClients, numberKeys, payloadSize, seconds);
+    printStats("all", &total, seconds);
+
+    munmap(stats, sizeof(op_stats) * NUMBER_OPS * numberClients);
+    free(payload);
+    exit(EXIT_SUCCESS);
+}
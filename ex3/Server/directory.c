@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "directory.h"
+#include "fs.h"
+#include "lib/inodes.h"
+#include "lib/rcu.h"
+
+directory_entries* directory_new() {
+	directory_entries* d = malloc(sizeof(directory_entries));
+	if (!d) {
+		perror("Failed to allocate directory entries");
+		exit(EXIT_FAILURE);
+	}
+	d->root = NULL;
+	d->count = 0;
+	if (pthread_mutex_init(&d->lock, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't initialize mutex\n");
+		exit(EXIT_FAILURE);
+	}
+	return d;
+}
+
+/* Only once nothing can list the directory anymore */
+void directory_free(directory_entries* d) {
+	free_tree(d->root);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+/* Held while a name in the directory changes, both in the table and
+ * here, so the two change together */
+void directory_lock(directory_entries* d) {
+	if (pthread_mutex_lock(&d->lock) != 0) {
+		fprintf(stderr, "Error: Couldn't lock mutex\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void directory_unlock(directory_entries* d) {
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Both only under directory_lock, or before the server starts serving */
+void directory_add(directory_entries* d, const char* name, int inumber) {
+	if (!search(d->root, (char*) name)) {
+		__atomic_store_n(&d->root, insert(d->root, (char*) name, inumber), __ATOMIC_RELEASE);
+		__atomic_add_fetch(&d->count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void directory_remove(directory_entries* d, const char* name) {
+	if (search(d->root, (char*) name)) {
+		__atomic_store_n(&d->root, remove_item(d->root, (char*) name), __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&d->count, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Exact for whoever holds the directory's i-node lock for writing */
+long directory_count(directory_entries* d) {
+	return __atomic_load_n(&d->count, __ATOMIC_RELAXED);
+}
+
+typedef struct list_args {
+	void (*visit)(const char* name, int inumber, void* arg);
+	void* arg;
+} list_args;
+
+static void list_visit(node* p, void* arg) {
+	list_args* list = arg;
+	list->visit(p->key, p->inumber, list->arg);
+}
+
+/* Calls visit on every name of the directory in name order, as they
+ * were when the listing started */
+void directory_list(directory_entries* d, void (*visit)(const char* name, int inumber, void* arg), void* arg) {
+	list_args list = { visit, arg };
+	rcu_read_lock();
+	traverse_tree(__atomic_load_n(&d->root, __ATOMIC_ACQUIRE), list_visit, &list);
+	rcu_read_unlock();
+}
+
+typedef struct rebuild_args {
+	int* directories;
+	size_t count, capacity;
+} rebuild_args;
+
+static void find_directory(int inumber, const inode_t* inode, void* arg) {
+	rebuild_args* rebuild = arg;
+	if (!inode->directory)
+		return;
+	if (rebuild->count == rebuild->capacity) {
+		rebuild->capacity = rebuild->capacity ? 2 * rebuild->capacity : 64;
+		if (!(rebuild->directories = realloc(rebuild->directories, rebuild->capacity * sizeof(int)))) {
+			perror("Failed to allocate directory list");
+			exit(EXIT_FAILURE);
+		}
+	}
+	rebuild->directories[rebuild->count++] = inumber;
+}
+
+static void add_entry(unsigned long bucket, const char* key, int inumber, void* arg) {
+	const char* name = strchr(key, '/');
+	if (!name)
+		return;
+	directory_entries* d = inode_directory_entries(atoi(key));
+	if (d)
+		directory_add(d, name + 1, inumber);
+}
+
+/* Gives every directory i-node its entries from the names in the
+ * table, which are only kept in memory. Must be called once the state
+ * was recovered and before it changes; without directories it doesn't
+ * look at the names at all. */
+void directory_rebuild(tecnicofs* fs) {
+	rebuild_args rebuild = { NULL, 0, 0 };
+	inode_traverse(find_directory, &rebuild);
+	for (size_t i = 0; i < rebuild.count; i++)
+		inode_set_directory_entries(rebuild.directories[i], directory_new());
+	if (rebuild.count > 0)
+		traverse_tecnicofs(fs, add_entry, NULL);
+	free(rebuild.directories);
+}
@@ -0,0 +1,31 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+#include <pthread.h>
+#include "lib/bst.h"
+
+/* The names in a directory, kept next to the table so listing or
+ * emptying a directory only looks at its own entries. Every directory
+ * i-node has one, hung from it while the directory exists. Changes
+ * come from those holding the directory's i-node lock, as the names in
+ * the table do, and only wait for each other on the directory's own
+ * mutex, under which they change both; listings go through lib/rcu and
+ * take no lock. */
+typedef struct directory_entries {
+	node* root; // Last components of the names, with their inumbers
+	pthread_mutex_t lock; // Only taken by writers
+	long count;
+} directory_entries;
+
+struct tecnicofs;
+
+directory_entries* directory_new();
+void directory_free(directory_entries* d);
+void directory_lock(directory_entries* d);
+void directory_unlock(directory_entries* d);
+void directory_add(directory_entries* d, const char* name, int inumber);
+void directory_remove(directory_entries* d, const char* name);
+long directory_count(directory_entries* d);
+void directory_list(directory_entries* d, void (*visit)(const char* name, int inumber, void* arg), void* arg);
+void directory_rebuild(struct tecnicofs* fs);
+
+#endif /* DIRECTORY_H */
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE // For IOV_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "dump.h"
+#include "fs.h"
+
+#define MAX_TREE_HEIGHT 96 // As in lib/bst.c
+#define DUMP_PIECE_BUCKETS 64 // Buckets formatted into each buffer
+#define DUMP_WINDOW 4096 // Pieces formatted ahead of the ones written at most
+#define DUMP_BUFFER_SIZE (1 << 20) // Bytes of a sorted listing written at a time
+
+/* Names of a bucket in order, either gathered from its tree or read
+ * from its snapshot entries in place */
+typedef struct bucket_cursor {
+	const char** keys;
+	const snapshot_entry* entries;
+	uint64_t count;
+	uint64_t next;
+} bucket_cursor;
+
+/* Consecutive buckets formatted by one worker. Buffers are kept and
+ * reused by the later pieces that take the same slot. */
+typedef struct piece {
+	char* text;
+	size_t length;
+	size_t capacity;
+	const char** keys; // Sorted listings only, the names of every tree bucket of the piece
+	size_t keyCount;
+	size_t keyCapacity;
+	int done;
+} piece;
+
+typedef struct dumper {
+	tecnicofs* fs;
+	bucket_view* views;
+	unsigned long numberBuckets;
+	unsigned long numberPieces;
+	unsigned long window; // Slots in pieces
+	piece* pieces; // Piece i is formatted into slot i % window
+	bucket_cursor* cursors; // Sorted listings only, one per bucket
+	int sorted;
+	unsigned long nextPiece; // Next to be taken by a worker, taken atomically
+	unsigned long written; // Pieces written so far
+	pthread_mutex_t lock;
+	pthread_cond_t formatted;
+	pthread_cond_t freed;
+} dumper;
+
+static void* reserve(void* data, size_t* capacity, size_t needed, size_t size) {
+	if (needed <= *capacity)
+		return data;
+	size_t newCapacity = *capacity ? *capacity : 4096;
+	while (newCapacity < needed)
+		newCapacity *= 2;
+	if (!(data = realloc(data, newCapacity * size))) {
+		perror("Failed to allocate dump buffer");
+		exit(EXIT_FAILURE);
+	}
+	*capacity = newCapacity;
+	return data;
+}
+
+static void append_name(piece* p, int level, const char* key) {
+	size_t indent = 2 * (level + 1), length = strlen(key);
+	p->text = reserve(p->text, &p->capacity, p->length + indent + length + 1, 1);
+	memset(p->text + p->length, ' ', indent);
+	memcpy(p->text + p->length + indent, key, length);
+	p->length += indent + length;
+	p->text[p->length++] = '\n';
+}
+
+static void format_tree(piece* p, node* root) {
+	node* stack[MAX_TREE_HEIGHT];
+	int levels[MAX_TREE_HEIGHT];
+	int top = 0, level = 0;
+
+	while (root || top > 0) {
+		while (root) {
+			stack[top] = root;
+			levels[top++] = level++;
+			root = root->left;
+		}
+		root = stack[--top];
+		level = levels[top];
+		append_name(p, level, root->key);
+		root = root->right;
+		level++;
+	}
+}
+
+/* Frozen buckets are written as the tree build_tree would make of
+ * them, the middle of every range being the root of its subtree */
+static void format_frozen(piece* p, tecnicofs* fs, const snapshot_entry* entries, uint64_t count) {
+	uint64_t lows[MAX_TREE_HEIGHT], highs[MAX_TREE_HEIGHT];
+	int levels[MAX_TREE_HEIGHT];
+	uint64_t low = 0, high = count;
+	int top = 0, level = 0;
+
+	while (low < high || top > 0) {
+		while (low < high) {
+			lows[top] = low;
+			highs[top] = high;
+			levels[top++] = level++;
+			high = low + (high - low) / 2;
+		}
+		top--;
+		uint64_t mid = lows[top] + (highs[top] - lows[top]) / 2;
+		level = levels[top];
+		append_name(p, level, fs->snapshot + entries[mid].keyOffset);
+		low = mid + 1;
+		high = highs[top];
+		level++;
+	}
+}
+
+static void gather_keys(piece* p, node* root) {
+	node* stack[MAX_TREE_HEIGHT];
+	int top = 0;
+
+	while (root || top > 0) {
+		while (root) {
+			stack[top++] = root;
+			root = root->left;
+		}
+		root = stack[--top];
+		p->keys = reserve(p->keys, &p->keyCapacity, p->keyCount + 1, sizeof(char*));
+		p->keys[p->keyCount++] = root->key;
+		root = root->right;
+	}
+}
+
+static void format_piece(dumper* d, unsigned long index, piece* p) {
+	unsigned long first = index * DUMP_PIECE_BUCKETS;
+	unsigned long last = first + DUMP_PIECE_BUCKETS < d->numberBuckets ? first + DUMP_PIECE_BUCKETS : d->numberBuckets;
+
+	for (unsigned long i = first; i < last; i++) {
+		bucket_view* view = &d->views[i];
+		if (!d->sorted) {
+			p->text = reserve(p->text, &p->capacity, p->length + 1, 1);
+			p->text[p->length++] = '\n';
+			if (view->entries)
+				format_frozen(p, d->fs, view->entries, view->count);
+			else
+				format_tree(p, view->root);
+			continue;
+		}
+		if (view->entries) {
+			d->cursors[i] = (bucket_cursor) { NULL, view->entries, view->count, 0 };
+			continue;
+		}
+		size_t start = p->keyCount;
+		gather_keys(p, view->root);
+		d->cursors[i] = (bucket_cursor) { NULL, NULL, p->keyCount - start, start };
+	}
+	if (d->sorted) { // The keys may have moved while they were gathered
+		for (unsigned long i = first; i < last; i++) {
+			if (!d->cursors[i].entries) {
+				d->cursors[i].keys = p->keys + d->cursors[i].next;
+				d->cursors[i].next = 0;
+			}
+		}
+	}
+}
+
+static void* dump_worker(void* arg) {
+	dumper* d = arg;
+	unsigned long index;
+
+	while ((index = __atomic_fetch_add(&d->nextPiece, 1, __ATOMIC_RELAXED)) < d->numberPieces) {
+		piece* p = &d->pieces[index % d->window];
+		pthread_mutex_lock(&d->lock);
+		while (index >= d->written + d->window)
+			pthread_cond_wait(&d->freed, &d->lock);
+		pthread_mutex_unlock(&d->lock);
+
+		format_piece(d, index, p);
+
+		pthread_mutex_lock(&d->lock);
+		p->done = 1;
+		pthread_cond_signal(&d->formatted);
+		pthread_mutex_unlock(&d->lock);
+	}
+	return NULL;
+}
+
+static void write_vector(int fd, struct iovec* iov, int count) {
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write the file system");
+			exit(EXIT_FAILURE);
+		}
+		while (count > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+/* Writes the pieces in order as they are formatted, as many at a time
+ * as one writev takes */
+static void write_pieces(dumper* d, int fd) {
+	struct iovec iov[IOV_MAX];
+
+	while (d->written < d->numberPieces) {
+		unsigned long first = d->written, last = first;
+		pthread_mutex_lock(&d->lock);
+		while (!d->pieces[first % d->window].done)
+			pthread_cond_wait(&d->formatted, &d->lock);
+		while (last < d->numberPieces && last - first < IOV_MAX && d->pieces[last % d->window].done) {
+			piece* p = &d->pieces[last % d->window];
+			iov[last - first] = (struct iovec) { p->text, p->length };
+			last++;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		write_vector(fd, iov, last - first);
+
+		pthread_mutex_lock(&d->lock);
+		for (unsigned long i = first; i < last; i++) {
+			d->pieces[i % d->window].length = 0;
+			d->pieces[i % d->window].done = 0;
+		}
+		d->written = last;
+		pthread_cond_broadcast(&d->freed);
+		pthread_mutex_unlock(&d->lock);
+	}
+}
+
+static const char* cursor_key(dumper* d, bucket_cursor* c) {
+	return c->keys ? c->keys[c->next] : d->fs->snapshot + c->entries[c->next].keyOffset;
+}
+
+static void sift_down(dumper* d, bucket_cursor** heap, unsigned long size, unsigned long i) {
+	while (1) {
+		unsigned long smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+		if (left < size && strcmp(cursor_key(d, heap[left]), cursor_key(d, heap[smallest])) < 0)
+			smallest = left;
+		if (right < size && strcmp(cursor_key(d, heap[right]), cursor_key(d, heap[smallest])) < 0)
+			smallest = right;
+		if (smallest == i)
+			return;
+		bucket_cursor* swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+/* Merges the sorted names of every bucket with a heap of cursors,
+ * writing them DUMP_BUFFER_SIZE bytes at a time */
+static void write_sorted(dumper* d, int fd) {
+	bucket_cursor** heap = malloc(d->numberBuckets * sizeof(bucket_cursor*));
+	char* buffer = malloc(DUMP_BUFFER_SIZE);
+	unsigned long size = 0;
+	size_t length = 0;
+	if (!heap || !buffer) {
+		perror("Failed to allocate dump buffer");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned long i = 0; i < d->numberBuckets; i++) {
+		if (d->cursors[i].count > 0)
+			heap[size++] = &d->cursors[i];
+	}
+	for (unsigned long i = size; i-- > 0;)
+		sift_down(d, heap, size, i);
+
+	while (size > 0) {
+		bucket_cursor* c = heap[0];
+		const char* key = cursor_key(d, c);
+		size_t keyLength = strlen(key);
+		if (length + keyLength + 1 > DUMP_BUFFER_SIZE) {
+			struct iovec iov = { buffer, length };
+			write_vector(fd, &iov, 1);
+			length = 0;
+		}
+		if (keyLength + 1 > DUMP_BUFFER_SIZE) { // Only names longer than the buffer skip it
+			struct iovec iov[2] = { { (char*) key, keyLength }, { "\n", 1 } };
+			write_vector(fd, iov, 2);
+		} else {
+			memcpy(buffer + length, key, keyLength);
+			length += keyLength;
+			buffer[length++] = '\n';
+		}
+		if (++c->next == c->count)
+			heap[0] = heap[--size];
+		sift_down(d, heap, size, 0);
+	}
+	struct iovec iov = { buffer, length };
+	write_vector(fd, &iov, 1);
+	free(buffer);
+	free(heap);
+}
+
+void dump_tecnicofs(tecnicofs* fs, int fd, int sorted) {
+	dumper d;
+	d.fs = fs;
+	d.sorted = sorted;
+	d.numberBuckets = view_tecnicofs(fs, &d.views);
+	d.numberPieces = (d.numberBuckets + DUMP_PIECE_BUCKETS - 1) / DUMP_PIECE_BUCKETS;
+	d.window = sorted || d.numberPieces < DUMP_WINDOW ? d.numberPieces : DUMP_WINDOW; // Merging needs every bucket at once
+	d.pieces = calloc(d.window ? d.window : 1, sizeof(piece));
+	d.cursors = sorted ? malloc((d.numberBuckets ? d.numberBuckets : 1) * sizeof(bucket_cursor)) : NULL;
+	d.nextPiece = 0;
+	d.written = 0;
+	if (!d.pieces || (sorted && !d.cursors)) {
+		perror("Failed to allocate dump buffers");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_mutex_init(&d.lock, NULL) != 0 || pthread_cond_init(&d.formatted, NULL) != 0 ||
+	    pthread_cond_init(&d.freed, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't initialize the dump locks\n");
+		exit(EXIT_FAILURE);
+	}
+
+	long numberWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numberWorkers <= 0)
+		numberWorkers = 1;
+	if ((unsigned long) numberWorkers > d.numberPieces)
+		numberWorkers = d.numberPieces;
+	pthread_t workers[numberWorkers ? numberWorkers : 1];
+	for (long i = 0; i < numberWorkers; i++) {
+		if (pthread_create(&workers[i], NULL, dump_worker, &d) != 0) {
+			fprintf(stderr, "Error: Couldn't create dump thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!sorted)
+		write_pieces(&d, fd);
+	for (long i = 0; i < numberWorkers; i++) {
+		if (pthread_join(workers[i], NULL) != 0) {
+			fprintf(stderr, "Error: Couldn't join dump thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (sorted)
+		write_sorted(&d, fd);
+
+	release_view(d.views);
+	for (unsigned long i = 0; i < d.window; i++) {
+		free(d.pieces[i].text);
+		free(d.pieces[i].keys);
+	}
+	free(d.pieces);
+	free(d.cursors);
+	pthread_mutex_destroy(&d.lock);
+	pthread_cond_destroy(&d.formatted);
+	pthread_cond_destroy(&d.freed);
+}
@@ -0,0 +1,17 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+/* Writes the names of the file system as they were at a single point
+ * in time. By default every bucket is written in turn as an indented
+ * tree, as print_tree does; sorted listings hold one name per line in
+ * name order across every bucket. Buckets are formatted by a thread per
+ * core while the caller writes them, and the server keeps serving
+ * requests meanwhile. */
+
+#define SORTED_DUMP_ENV "TECNICOFS_SORTED_DUMP" // Set to 1 to dump a sorted listing
+
+struct tecnicofs;
+
+void dump_tecnicofs(struct tecnicofs* fs, int fd, int sorted);
+
+#endif /* DUMP_H */
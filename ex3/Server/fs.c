@@ -4,20 +4,242 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
-#include <errno.h>
-#include <unistd.h>
 #include "lib/hash.h"
 #include "lib/inodes.h"
+#include "lib/rcu.h"
+#include "wal.h"
+#include "../Client/tecnicofs-protocol.h"
 
 #define ASSERT_CHECK assert(operationStatus == 0) // Verifies that a specific operation executes succesfully 
 extern int operationStatus; // Global variable intended for assert operations
 
-#define RWLOCK_RDLOCK(treeLock) operationStatus = pthread_rwlock_rdlock(treeLock)
-#define RWLOCK_WRLOCK(treeLock) operationStatus = pthread_rwlock_wrlock(treeLock)
-#define RWLOCK_UNLOCK(treeLock) operationStatus = pthread_rwlock_unlock(treeLock)
-#define RWLOCK_TREE_INIT(treeLock) pthread_rwlock_init(treeLock, NULL)
-#define RWLOCK_TREE_DESTROY(treeLock) pthread_rwlock_destroy(treeLock)
-#define RWLOCK_WRTRYLOCK(treeLock) pthread_rwlock_trywrlock(treeLock)
+#define MUTEX_TREE_LOCK(treeLock) operationStatus = pthread_mutex_lock(treeLock)
+#define MUTEX_TREE_UNLOCK(treeLock) operationStatus = pthread_mutex_unlock(treeLock)
+#define MUTEX_TREE_INIT(treeLock) pthread_mutex_init(treeLock, NULL)
+#define MUTEX_TREE_DESTROY(treeLock) pthread_mutex_destroy(treeLock)
+
+#define TABLE_LEVEL(state) ((state) >> 32)
+#define TABLE_SPLIT(state) ((state) & 0xffffffffUL)
+
+static unsigned long load_table_state(tecnicofs* fs) {
+	return __atomic_load_n(&fs->tableState, __ATOMIC_ACQUIRE);
+}
+
+/* Buckets below the split pointer were already split in the current
+ * level, so they are addressed with twice the modulus. */
+static unsigned long bucket_index(unsigned long state, uint64_t keyHash) {
+	unsigned long levelSize = (unsigned long) numberBuckets << TABLE_LEVEL(state);
+	unsigned long index = keyHash % levelSize;
+	if (index < TABLE_SPLIT(state))
+		index = keyHash % (2 * levelSize);
+	return index;
+}
+
+static unsigned long bucket_count(unsigned long state) {
+	return ((unsigned long) numberBuckets << TABLE_LEVEL(state)) + TABLE_SPLIT(state);
+}
+
+static bucket* get_bucket(tecnicofs* fs, unsigned long index) {
+	if (index < numberBuckets)
+		return fs->segments[0] + index;
+	int segment = 64 - __builtin_clzl(index / numberBuckets);
+	bucket* segmentStart = __atomic_load_n(&fs->segments[segment], __ATOMIC_ACQUIRE);
+	return segmentStart + (index - ((unsigned long) numberBuckets << (segment - 1)));
+}
+
+static bucket* new_segment(unsigned long size) {
+	bucket* segment = malloc(size * sizeof(bucket));
+	if (!segment) {
+		perror("Failed to allocate bucket segment");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned long i = 0; i < size; i++) {
+		segment[i].bstRoot = NULL;
+		segment[i].frozen = NULL;
+		memset(&segment[i].lockStats, 0, sizeof(lock_stats));
+		if (MUTEX_TREE_INIT(&segment[i].treeLock) != 0) {
+			fprintf(stderr, "Error: Couldn't initialize mutex\n");
+			exit(EXIT_FAILURE);
+		} 
+	}
+	return segment;
+}
+
+/* Bucket locks keep their wait and hold times, the wait only being
+ * timed when the lock is busy so uncontended acquisitions stay cheap.
+ * Both are recorded by the holder, which is the only one writing them. */
+static void lock_tree(bucket* b) {
+	int contended = pthread_mutex_trylock(&b->treeLock) != 0;
+	uint64_t waitStart = 0;
+	if (contended) {
+		waitStart = stats_now();
+		MUTEX_TREE_LOCK(&b->treeLock);
+		ASSERT_CHECK;
+	}
+	b->lockedAt = stats_now();
+	stats_lock_acquired(&b->lockStats, STATS_TREE_LOCKS, contended, b->lockedAt - waitStart);
+}
+
+static void unlock_tree(bucket* b) {
+	stats_lock_released(&b->lockStats, STATS_TREE_LOCKS, stats_now() - b->lockedAt);
+	MUTEX_TREE_UNLOCK(&b->treeLock);
+	ASSERT_CHECK;
+}
+
+/* Locks the bucket currently holding keyHash. The table may split that
+ * bucket between computing its index and acquiring its lock, in which case
+ * the index is recomputed and the lookup retried. */
+static bucket* lock_bucket(tecnicofs* fs, uint64_t keyHash) {
+	while (1) {
+		unsigned long index = bucket_index(load_table_state(fs), keyHash);
+		bucket* b = get_bucket(fs, index);
+		lock_tree(b);
+		if (bucket_index(load_table_state(fs), keyHash) == index)
+			return b;
+		unlock_tree(b);
+	}
+}
+
+/* Makes a new version of a bucket tree visible to lookups. Only the
+ * holder of the bucket lock publishes, so plain reads of the root are
+ * fine on the writer side. */
+static void publish_root(bucket* b, node* root) {
+	__atomic_store_n(&b->bstRoot, root, __ATOMIC_RELEASE);
+}
+
+/* Buckets loaded from a snapshot keep their entries in the mapped file,
+ * sorted, until a writer first changes them and turns them into a tree.
+ * The root is swapped in a single store, so lookups either search the
+ * frozen entries or the tree, never a mix of both. */
+static node frozenMarker;
+#define FROZEN_ROOT (&frozenMarker)
+
+static const snapshot_entry* frozen_entries(tecnicofs* fs, const snapshot_bucket* frozen) {
+	return (const snapshot_entry*) (fs->snapshot + frozen->entriesOffset);
+}
+
+static int search_frozen(tecnicofs* fs, const snapshot_bucket* frozen, const char* name) {
+	const snapshot_entry* entries = frozen_entries(fs, frozen);
+	uint64_t low = 0, high = frozen->count;
+	while (low < high) {
+		uint64_t mid = low + (high - low) / 2;
+		int comp = strcmp(name, fs->snapshot + entries[mid].keyOffset);
+		if (comp == 0)
+			return entries[mid].inumber;
+		if (comp < 0)
+			high = mid;
+		else
+			low = mid + 1;
+	}
+	return -1;
+}
+
+/* Returns the tree of a locked bucket, building it out of the frozen
+ * entries the first time the bucket is changed */
+static node* bucket_root(tecnicofs* fs, bucket* b) {
+	if (b->bstRoot != FROZEN_ROOT)
+		return b->bstRoot;
+	const snapshot_entry* entries = frozen_entries(fs, b->frozen);
+	uint64_t count = b->frozen->count;
+	node* copies = malloc(count * sizeof(node));
+	node** sorted = malloc(count * sizeof(node*));
+	if (!copies || !sorted) {
+		perror("Failed to allocate bucket tree");
+		exit(EXIT_FAILURE);
+	}
+	for (uint64_t i = 0; i < count; i++) {
+		set_key(&copies[i], fs->snapshot + entries[i].keyOffset);
+		copies[i].inumber = entries[i].inumber;
+		sorted[i] = &copies[i];
+	}
+	node* root = build_tree(sorted, count);
+	free(copies);
+	free(sorted);
+	publish_root(b, root);
+	return root;
+}
+
+typedef struct node_list {
+	node** nodes;
+	int count;
+	int capacity;
+} node_list;
+
+typedef struct split_args {
+	unsigned long index;
+	unsigned long modulus;
+	node_list kept;
+	node_list moved;
+} split_args;
+
+static void node_list_push(node_list* list, node* p) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 2 * MAX_LOAD_FACTOR;
+		list->nodes = realloc(list->nodes, list->capacity * sizeof(node*));
+		if (!list->nodes) {
+			perror("Failed to allocate split list");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->nodes[list->count++] = p;
+}
+
+static void split_visit(node* p, void* arg) {
+	split_args* split = arg;
+	if (hash_key(p->key) % split->modulus == split->index)
+		node_list_push(&split->kept, p);
+	else
+		node_list_push(&split->moved, p);
+}
+
+/* Splits the bucket under the split pointer, moving the entries that
+ * now address the new bucket. Only one split runs at a time; if another
+ * thread is already splitting, the load is left for it to handle. */
+static void split_bucket(tecnicofs* fs) {
+	if (pthread_mutex_trylock(&fs->splitLock) != 0)
+		return;
+	unsigned long state = load_table_state(fs);
+	if (__atomic_load_n(&fs->numberEntries, __ATOMIC_RELAXED) <= MAX_LOAD_FACTOR * (long) bucket_count(state)) {
+		pthread_mutex_unlock(&fs->splitLock);
+		return;
+	}
+	unsigned long level = TABLE_LEVEL(state), split = TABLE_SPLIT(state);
+	unsigned long levelSize = (unsigned long) numberBuckets << level;
+	if (level + 1 >= MAX_BUCKET_SEGMENTS) {
+		pthread_mutex_unlock(&fs->splitLock);
+		return;
+	}
+	if (split == 0)
+		__atomic_store_n(&fs->segments[level + 1], new_segment(levelSize), __ATOMIC_RELEASE);
+
+	bucket* oldBucket = get_bucket(fs, split);
+	bucket* newBucket = get_bucket(fs, split + levelSize);
+	lock_tree(oldBucket);
+	lock_tree(newBucket);
+
+	/* Lookups check the table state before and after reading a bucket,
+	 * so publishing the moved entries before the state and removing
+	 * them from the old bucket after it never hides an entry. */
+	split_args args = { split, 2 * levelSize, { NULL, 0, 0 }, { NULL, 0, 0 } };
+	node* oldRoot = bucket_root(fs, oldBucket);
+	traverse_tree(oldRoot, split_visit, &args);
+	publish_root(newBucket, build_tree(args.moved.nodes, args.moved.count));
+
+	if (split + 1 == levelSize)
+		state = (level + 1) << 32;
+	else
+		state = level << 32 | (split + 1);
+	__atomic_store_n(&fs->tableState, state, __ATOMIC_RELEASE);
+
+	publish_root(oldBucket, build_tree(args.kept.nodes, args.kept.count));
+	retire_tree(oldRoot);
+	free(args.kept.nodes);
+	free(args.moved.nodes);
+
+	unlock_tree(newBucket);
+	unlock_tree(oldBucket);
+	pthread_mutex_unlock(&fs->splitLock);
+}
 
 tecnicofs* new_tecnicofs(){
 	tecnicofs*fs = malloc(sizeof(tecnicofs));
@@ -26,116 +248,341 @@ tecnicofs* new_tecnicofs(){
 		exit(EXIT_FAILURE);
 	}
 	fs->nextINumber = 0;
-	fs->bstRoot = malloc(numberBuckets * sizeof(node*));
-	if (!(fs->bstRoot)) {
-		perror("Failed to allocate btRoot");
+	fs->tableState = 0;
+	fs->numberEntries = 0;
+	fs->snapshot = NULL;
+	for (int i = 0; i < MAX_BUCKET_SEGMENTS; i++) {
+		fs->segments[i] = NULL;
 	}
-	fs->treeLock = malloc(numberBuckets * sizeof(tree_lock_t));
-	if (!(fs->treeLock)) {
-		perror("Failed to allocate treeLock");
+	rcu_init();
+	node_pool_init();
+	fs->segments[0] = new_segment(numberBuckets);
+	if (pthread_mutex_init(&fs->splitLock, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't initialize mutex\n");
+		exit(EXIT_FAILURE);
 	}
-	for (int i = 0; i < numberBuckets; i++) {
-		*(fs->bstRoot + i) = NULL;
-		if (RWLOCK_TREE_INIT(fs->treeLock + i) != 0) {
-			fprintf(stderr, "Error: Couldn't initialize mutex\n");
-			exit(EXIT_FAILURE);
-		} 
-	}	
 	return fs;
 }
 
 void free_tecnicofs(tecnicofs* fs){
-	for (int i = 0; i < numberBuckets; i++) {
-		free_tree(*(fs->bstRoot + i));
-		if (RWLOCK_TREE_DESTROY(fs->treeLock + i) != 0) {
-			fprintf(stderr, "Error: Couldn't destroy mutex\n");
-			exit(EXIT_FAILURE);
-		} 
+	for (int i = 0; i < MAX_BUCKET_SEGMENTS && fs->segments[i]; i++) {
+		unsigned long size = i == 0 ? numberBuckets : (unsigned long) numberBuckets << (i - 1);
+		for (unsigned long j = 0; j < size; j++) {
+			if (fs->segments[i][j].bstRoot != FROZEN_ROOT)
+				free_tree(fs->segments[i][j].bstRoot);
+			if (MUTEX_TREE_DESTROY(&fs->segments[i][j].treeLock) != 0) {
+				fprintf(stderr, "Error: Couldn't destroy mutex\n");
+				exit(EXIT_FAILURE);
+			} 
+		}
+		free(fs->segments[i]);
 	}
-	free(fs->treeLock);
-	free(fs->bstRoot);
+	pthread_mutex_destroy(&fs->splitLock);
+	rcu_destroy();
+	node_pool_destroy(); // After the retired nodes went back to it
 	free(fs);
 }
 
-void create(tecnicofs* fs, char *name, int inumber, int bucketIndex){
-	RWLOCK_WRLOCK(fs->treeLock + bucketIndex); 
-	ASSERT_CHECK;
-	*(fs->bstRoot + bucketIndex) = insert(*(fs->bstRoot + bucketIndex), name, inumber);
-	RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-	ASSERT_CHECK;
+void create(tecnicofs* fs, char *name, int inumber){
+	bucket* b = lock_bucket(fs, hash_key(name));
+	publish_root(b, insert(bucket_root(fs, b), name, inumber));
+	wal_log_name_create(name, inumber);
+	unlock_tree(b);
+	// Counted without checking for an existing name, callers only create after a failed lookup
+	long entries = __atomic_add_fetch(&fs->numberEntries, 1, __ATOMIC_RELAXED);
+	if (entries > MAX_LOAD_FACTOR * (long) bucket_count(load_table_state(fs)))
+		split_bucket(fs);
 }
 
-void delete(tecnicofs* fs, char *name, int bucketIndex){
-    RWLOCK_WRLOCK(fs->treeLock + bucketIndex);
-	ASSERT_CHECK;
-	*(fs->bstRoot + bucketIndex) = remove_item(*(fs->bstRoot + bucketIndex), name);
-    RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-	ASSERT_CHECK;
+/* Returns -1 if there was no such name */
+int delete(tecnicofs* fs, char *name){
+	bucket* b = lock_bucket(fs, hash_key(name));
+	node* searchNode = search(bucket_root(fs, b), name);
+	if (searchNode) {
+		int inumber = searchNode->inumber;
+		publish_root(b, remove_item(b->bstRoot, name));
+		wal_log_name_delete(name, inumber);
+	}
+	unlock_tree(b);
+	if (!searchNode)
+		return -1;
+	__atomic_sub_fetch(&fs->numberEntries, 1, __ATOMIC_RELAXED);
+	return 0;
 }
 
-int lookup(tecnicofs* fs, char *name, int bucketIndex){
-    RWLOCK_RDLOCK(fs->treeLock + bucketIndex);
-	ASSERT_CHECK;
-	node* searchNode = search(*(fs->bstRoot + bucketIndex), name);
-    RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-	ASSERT_CHECK;
-	if ( searchNode ) return searchNode->inumber;
-	return -1;
+/* Lookups take no locks and write no shared memory: they only announce
+ * their epoch in their own reclamation slot and retry if a split
+ * changed the table while they were reading it. */
+int lookup(tecnicofs* fs, char *name){
+	uint64_t keyHash = hash_key(name);
+	unsigned long state;
+	int inumber;
+	rcu_read_lock();
+	do {
+		state = load_table_state(fs);
+		bucket* b = get_bucket(fs, bucket_index(state, keyHash));
+		node* root = __atomic_load_n(&b->bstRoot, __ATOMIC_ACQUIRE);
+		if (root == FROZEN_ROOT) {
+			inumber = search_frozen(fs, b->frozen, name);
+		} else {
+			node* searchNode = search(root, name);
+			inumber = searchNode ? searchNode->inumber : -1;
+		}
+	} while (load_table_state(fs) != state);
+	rcu_read_unlock();
+	return inumber;
 }
 
-int renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex) { 
-	int searchResult = lookup(fs, name, bucketIndex);
-	int iNumberSaver = searchResult;
-	if (searchResult == -1)
-		return -4;
-	else {
-		int newBucketIndex = hash(rename, numberBuckets); 
-		searchResult = lookup(fs, rename, newBucketIndex);
-		if (searchResult != -1) {
-			return -5;
+/* Locks the buckets holding both hashes in increasing index order, so
+ * renames and splits never wait on each other in a cycle. */
+static void lock_bucket_pair(tecnicofs* fs, uint64_t keyHash, uint64_t newKeyHash, bucket** oldBucket, bucket** newBucket) {
+	while (1) {
+		unsigned long state = load_table_state(fs);
+		unsigned long bucketIndex = bucket_index(state, keyHash);
+		unsigned long newBucketIndex = bucket_index(state, newKeyHash);
+		*oldBucket = get_bucket(fs, bucketIndex);
+		*newBucket = get_bucket(fs, newBucketIndex);
+		bucket* first = bucketIndex <= newBucketIndex ? *oldBucket : *newBucket;
+		bucket* second = bucketIndex <= newBucketIndex ? *newBucket : *oldBucket;
+		lock_tree(first);
+		if (second != first) {
+			lock_tree(second);
 		}
-		int sleepTime, retVal, tryNumber = 0, renameConditions = 0;
-		srand(time(NULL));
-		sleepTime = ((rand() % 1000)) + 1;
-		while (renameConditions != 1) {
-			tryNumber++;
-			retVal = RWLOCK_WRTRYLOCK(fs->treeLock + bucketIndex);
-			if (retVal == 0) {
-				retVal = RWLOCK_WRTRYLOCK(fs->treeLock + newBucketIndex);
-				if ((retVal == 0) || bucketIndex == newBucketIndex) {
-					renameConditions = 1;
-				} else if (retVal != EBUSY) {
-					fprintf(stderr,"Error: Trylock error not related to busy lock");
-					exit(EXIT_FAILURE);
-				} else {
-					RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-					ASSERT_CHECK;
-				}
-			} else if (retVal != EBUSY) { // Exit if the error is not associated with the thread being already busy
-				fprintf(stderr,"Error: Trylock error not related to busy lock");
-				exit(EXIT_FAILURE);
-			} 
-			if (renameConditions == 0) {
-				if (usleep((sleepTime * tryNumber) * 1000) != 0) { // Sleep a random time between 0 and 1 sec times the number of tries
-					fprintf(stderr,"Error: Failure on usleep function.");
-					exit(EXIT_FAILURE);
-				}	
-			}
+		state = load_table_state(fs);
+		if (bucket_index(state, keyHash) == bucketIndex && bucket_index(state, newKeyHash) == newBucketIndex)
+			return;
+		if (second != first) { // A split moved one of the names, retry right away
+			unlock_tree(second);
 		}
-		*(fs->bstRoot + bucketIndex) = remove_item(*(fs->bstRoot + bucketIndex), name);
-		*(fs->bstRoot + newBucketIndex) = insert(*(fs->bstRoot + newBucketIndex), rename, iNumberSaver);
-		RWLOCK_UNLOCK(fs->treeLock + bucketIndex);
-		ASSERT_CHECK;
-		if (bucketIndex != newBucketIndex) {
-			RWLOCK_UNLOCK(fs->treeLock + newBucketIndex);
-			ASSERT_CHECK;
+		unlock_tree(first);
+	}
+}
+
+/* Renames name to rename if name exists and rename does not. Both checks
+ * and the move happen under the two bucket locks, so the rename is atomic
+ * with respect to every other update. */
+int renameNode(tecnicofs* fs, char* name, char* rename) { 
+	bucket *oldBucket, *newBucket;
+	int result = 0;
+	lock_bucket_pair(fs, hash_key(name), hash_key(rename), &oldBucket, &newBucket);
+	node* searchNode = search(bucket_root(fs, oldBucket), name);
+	if (!searchNode) {
+		result = -4;
+	} else if (search(bucket_root(fs, newBucket), rename)) {
+		result = -5;
+	} else {
+		int iNumberSaver = searchNode->inumber;
+		publish_root(newBucket, insert(newBucket->bstRoot, rename, iNumberSaver)); // Lookups may briefly see both names, never neither
+		publish_root(oldBucket, remove_item(oldBucket->bstRoot, name));
+		wal_log_name_rename(name, rename, iNumberSaver);
+	}
+	unlock_tree(oldBucket);
+	if (newBucket != oldBucket) {
+		unlock_tree(newBucket);
+	}
+	return result;
+}
+
+typedef struct traverse_args {
+	void (*visit)(unsigned long bucket, const char* key, int inumber, void* arg);
+	void* arg;
+	unsigned long index;
+} traverse_args;
+
+static void traverse_visit(node* p, void* arg) {
+	traverse_args* traverse = arg;
+	traverse->visit(traverse->index, p->key, p->inumber, traverse->arg);
+}
+
+/* Calls visit on every entry, bucket by bucket and in name order within
+ * a bucket, and returns the table state the buckets belong to. Splits
+ * wait until the traversal ends, and each bucket is seen as it was when
+ * its root was read, so an entry renamed meanwhile may be seen twice or
+ * not at all. */
+unsigned long traverse_tecnicofs(tecnicofs* fs, void (*visit)(unsigned long bucket, const char* key, int inumber, void* arg), void* arg){
+	if (pthread_mutex_lock(&fs->splitLock) != 0) {
+		fprintf(stderr, "Error: Couldn't lock mutex\n");
+		exit(EXIT_FAILURE);
+	}
+	rcu_read_lock();
+	unsigned long state = load_table_state(fs);
+	unsigned long count = bucket_count(state);
+	traverse_args traverse = { visit, arg, 0 };
+	for (; traverse.index < count; traverse.index++) {
+		bucket* b = get_bucket(fs, traverse.index);
+		node* root = __atomic_load_n(&b->bstRoot, __ATOMIC_ACQUIRE);
+		if (root != FROZEN_ROOT) {
+			traverse_tree(root, traverse_visit, &traverse);
+			continue;
+		}
+		const snapshot_entry* entries = frozen_entries(fs, b->frozen);
+		for (uint64_t i = 0; i < b->frozen->count; i++) {
+			visit(traverse.index, fs->snapshot + entries[i].keyOffset, entries[i].inumber, arg);
 		}
-		return 0;
 	}
+	rcu_read_unlock();
+	pthread_mutex_unlock(&fs->splitLock);
+	return state;
+}
+
+/* Makes the buckets of a mapped snapshot the table's, with each bucket
+ * frozen until first changed. Must be called on an empty table.
+ * Returns -1 if the snapshot was taken with another number of buckets. */
+int load_tecnicofs(tecnicofs* fs, const char* snapshot){
+	const snapshot_header* header = (const snapshot_header*) snapshot;
+	unsigned long state = header->tableState;
+	if (header->numberBuckets != numberBuckets || header->bucketCount != bucket_count(state) ||
+	    TABLE_LEVEL(state) + 1 >= MAX_BUCKET_SEGMENTS)
+		return -1;
+
+	fs->snapshot = snapshot;
+	for (unsigned long i = 1; i <= TABLE_LEVEL(state) + (TABLE_SPLIT(state) > 0); i++) {
+		fs->segments[i] = new_segment((unsigned long) numberBuckets << (i - 1));
+	}
+	fs->tableState = state;
+	const snapshot_bucket* buckets = (const snapshot_bucket*) (snapshot + header->bucketsOffset);
+	for (unsigned long i = 0; i < header->bucketCount; i++) {
+		bucket* b = get_bucket(fs, i);
+		b->frozen = &buckets[i];
+		b->bstRoot = buckets[i].count > 0 ? FROZEN_ROOT : NULL;
+		fs->numberEntries += buckets[i].count;
+	}
+	return 0;
+}
+
+/* Visits the lock statistics of every bucket, which keep changing
+ * while they are read */
+void traverse_bucket_locks(tecnicofs* fs, void (*visit)(unsigned long bucket, const lock_stats* stats, void* arg), void* arg) {
+	unsigned long count = bucket_count(load_table_state(fs));
+	for (unsigned long i = 0; i < count; i++)
+		visit(i, &get_bucket(fs, i)->lockStats, arg);
+}
+
+/* Reads the root of every bucket while holding every bucket lock, so
+ * the views form a single point in time that no update is halfway
+ * through. Writers only wait for the roots to be read and lookups not
+ * at all. Published trees never change, and the caller stays in a
+ * read-side section until release_view, so the views keep describing
+ * that point however the table changes meanwhile. Returns the number
+ * of buckets. */
+unsigned long view_tecnicofs(tecnicofs* fs, bucket_view** views){
+	if (pthread_mutex_lock(&fs->splitLock) != 0) {
+		fprintf(stderr, "Error: Couldn't lock mutex\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned long count = bucket_count(load_table_state(fs));
+	bucket_view* v = malloc(count * sizeof(bucket_view));
+	if (!v) {
+		perror("Failed to allocate bucket views");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned long i = 0; i < count; i++)
+		lock_tree(get_bucket(fs, i));
+	rcu_read_lock();
+	for (unsigned long i = 0; i < count; i++) {
+		bucket* b = get_bucket(fs, i);
+		if (b->bstRoot == FROZEN_ROOT)
+			v[i] = (bucket_view) { NULL, frozen_entries(fs, b->frozen), b->frozen->count };
+		else
+			v[i] = (bucket_view) { b->bstRoot, NULL, 0 };
+	}
+	for (unsigned long i = 0; i < count; i++)
+		unlock_tree(get_bucket(fs, i));
+	pthread_mutex_unlock(&fs->splitLock);
+	*views = v;
+	return count;
+}
+
+void release_view(bucket_view* views){
+	rcu_read_unlock();
+	free(views);
+}
+
+/* Names are kept in the table keyed by their directory and last
+ * component: the component alone for the root, and
+ * "<inumber of the directory>/<component>" below it, which makes the
+ * table a cache of every directory entry: a path costs one lookup per
+ * component, each in the bucket its pair hashes to, so operations in
+ * different directories only meet when their names share a bucket,
+ * and renaming a directory moves a single name. */
+static int directory_key(char* key, int directory, const char* component, size_t length) {
+	int prefix = directory == ROOT_DIRECTORY ? 0 : snprintf(key, TFS_MAX_NAME_SIZE + 1, "%d/", directory);
+	if (prefix + length > TFS_MAX_NAME_SIZE)
+		return -1;
+	memcpy(key + prefix, component, length);
+	key[prefix + length] = '\0';
+	return 0;
 }
 
-void print_tecnicofs_tree(FILE * fp, tecnicofs *fs){
-	for (int i = 0; i < numberBuckets; i++) {
-		print_tree(fp, fs->bstRoot[i]);
+/* Follows path up to its last component, setting crossed if one of the
+ * directories it goes through is watch */
+static int walk_path(tecnicofs* fs, const char* path, int* directory, char* key, char* directoryKey,
+                     int watch, int* crossed) {
+	int parent = ROOT_DIRECTORY;
+	if (directoryKey)
+		directoryKey[0] = '\0';
+	if (*path == '/')
+		path++;
+	while (1) {
+		const char* end = strchr(path, '/');
+		size_t length = end ? (size_t) (end - path) : strlen(path);
+		if (length == 0 || (length == 1 && path[0] == '.') || (length == 2 && path[0] == '.' && path[1] == '.') ||
+		    directory_key(key, parent, path, length) != 0)
+			return TECNICOFS_ERROR_OTHER;
+		if (!end)
+			break;
+		if ((parent = lookup(fs, key)) == -1)
+			return TECNICOFS_ERROR_FILE_NOT_FOUND;
+		if (!inode_is_directory(parent))
+			return TECNICOFS_ERROR_NOT_A_DIRECTORY;
+		if (parent == watch)
+			*crossed = 1;
+		if (directoryKey)
+			strcpy(directoryKey, key);
+		path = end + 1;
 	}
-}
\ No newline at end of file
+	*directory = parent;
+	return 0;
+}
+
+/* Finds the directory the last component of path is in, setting it and
+ * the key of the name in the table (TFS_MAX_NAME_SIZE + 1 bytes), which
+ * may not exist, and if directoryKey is not NULL the key of the
+ * directory itself, empty for the root. Lookups are all it takes, so a
+ * directory renamed or deleted meanwhile may still be followed: once
+ * the directory is locked, looking its key up again tells whether the
+ * path still leads to it.
+ * Returns 0, or the error for the client if a directory is missing, is
+ * a file or the path is malformed. */
+int resolve_path(tecnicofs* fs, const char* path, int* directory, char* key, char* directoryKey) {
+	return walk_path(fs, path, directory, key, directoryKey, ROOT_DIRECTORY, NULL);
+}
+
+/* Tells whether path goes through directory, which a directory can't be
+ * moved into. Only stable while directories are not being moved. */
+int path_crosses(tecnicofs* fs, const char* path, int directory) {
+	char key[TFS_MAX_NAME_SIZE + 1];
+	int parent, crossed = 0;
+	walk_path(fs, path, &parent, key, NULL, directory, &crossed);
+	return crossed;
+}
+
+typedef struct list_args {
+	void (*visit)(const char* name, int inumber, void* arg);
+	void* arg;
+} list_args;
+
+static void list_visit(unsigned long bucket, const char* key, int inumber, void* arg) {
+	list_args* list = arg;
+	if (!strchr(key, '/'))
+		list->visit(key, inumber, list->arg);
+}
+
+/* Calls visit on the name of every entry of the root, with the
+ * guarantees of traverse_tecnicofs. Unlike other directories the root
+ * keeps no entries of its own, so names at the top never wait for each
+ * other outside their buckets, and listing it goes through every name. */
+void list_root(tecnicofs* fs, void (*visit)(const char* name, int inumber, void* arg), void* arg) {
+	list_args list = { visit, arg };
+	traverse_tecnicofs(fs, list_visit, &list);
+}
@@ -1,6 +1,8 @@
 #ifndef FS_H
 #define FS_H
 #include "lib/bst.h"
+#include "snapshot.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -13,23 +15,56 @@
 int numberBuckets;
 int operationStatus; // Global variable intended for assert operations
 
+#define MAX_LOAD_FACTOR 4 // Average entries per bucket above which the next bucket is split
+#define MAX_BUCKET_SEGMENTS 48 // Segment i > 0 holds numberBuckets << (i-1) buckets, so this is never reached
 
-#define tree_lock_t pthread_rwlock_t
+#define ROOT_DIRECTORY -1 // Directory of the names at the top of paths, which has no i-node
 
+#define tree_lock_t pthread_mutex_t // Only taken by writers, lookups go through lib/rcu
 
+typedef struct bucket {
+    node* bstRoot; // FROZEN_ROOT while the bucket is still the snapshot's
+    tree_lock_t treeLock;
+    const snapshot_bucket* frozen;
+    lock_stats lockStats;
+    uint64_t lockedAt; // When the holder of treeLock acquired it
+} bucket;
+
+/* The buckets form a linear hash table: the table grows one bucket at a
+ * time by splitting bucket tableSplit into itself and bucket
+ * tableSplit + (numberBuckets << tableLevel), so no operation ever waits
+ * for the whole table to be rehashed. */
 typedef struct tecnicofs {
-    node** bstRoot;
+    bucket* segments[MAX_BUCKET_SEGMENTS];
+    unsigned long tableState; // tableLevel << 32 | tableSplit, read and written atomically
+    long numberEntries;
+    pthread_mutex_t splitLock;
     int nextINumber;
-    tree_lock_t *treeLock;
+    const char* snapshot; // Mapped snapshot file frozen buckets point into
 } tecnicofs;
 
+/* A bucket as it was when a view of the table was taken: a tree, or the
+ * sorted entries of a snapshot when entries is not NULL */
+typedef struct bucket_view {
+    node* root;
+    const snapshot_entry* entries;
+    uint64_t count; // Of entries
+} bucket_view;
+
 int obtainNewInumber(tecnicofs* fs);
 tecnicofs* new_tecnicofs();
 void free_tecnicofs(tecnicofs* fs);
-void create(tecnicofs* fs, char *name, int inumber, int bucketIndex);
-void delete(tecnicofs* fs, char *name, int bucketIndex);
-int renameNode(tecnicofs* fs, char* name, char* rename, int bucketIndex);
-int lookup(tecnicofs* fs, char *name, int bucketIndex);
-void print_tecnicofs_tree(FILE * fp, tecnicofs *fs);
+void create(tecnicofs* fs, char *name, int inumber);
+int delete(tecnicofs* fs, char *name);
+int renameNode(tecnicofs* fs, char* name, char* rename);
+int lookup(tecnicofs* fs, char *name);
+int load_tecnicofs(tecnicofs* fs, const char* snapshot);
+unsigned long traverse_tecnicofs(tecnicofs* fs, void (*visit)(unsigned long bucket, const char* key, int inumber, void* arg), void* arg);
+void traverse_bucket_locks(tecnicofs* fs, void (*visit)(unsigned long bucket, const lock_stats* stats, void* arg), void* arg);
+unsigned long view_tecnicofs(tecnicofs* fs, bucket_view** views);
+int resolve_path(tecnicofs* fs, const char* path, int* directory, char* key, char* directoryKey);
+int path_crosses(tecnicofs* fs, const char* path, int directory);
+void list_root(tecnicofs* fs, void (*visit)(const char* name, int inumber, void* arg), void* arg);
+void release_view(bucket_view* views);
 
 #endif /* FS_H */
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "blocks.h"
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static char* freeBlocks; // Each free block starts with a pointer to the next one
+static char** slabs;
+static int slabCount, slabCapacity;
+
+void block_pool_init() {
+    freeBlocks = NULL;
+    slabs = NULL;
+    slabCount = slabCapacity = 0;
+}
+
+void block_pool_destroy() {
+    for (int i = 0; i < slabCount; i++)
+        free(slabs[i]);
+    free(slabs);
+    block_pool_init();
+}
+
+/* Carves a new slab into free blocks, with poolLock held */
+static void add_slab() {
+    if (slabCount == slabCapacity) {
+        slabCapacity = slabCapacity ? 2 * slabCapacity : 16;
+        if (!(slabs = realloc(slabs, slabCapacity * sizeof(char*)))) {
+            perror("block_alloc: no memory for slabs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char* slab = malloc((size_t) BLOCK_SIZE * BLOCKS_PER_SLAB);
+    if (!slab) {
+        perror("block_alloc: no memory for blocks");
+        exit(EXIT_FAILURE);
+    }
+    slabs[slabCount++] = slab;
+    for (int i = BLOCKS_PER_SLAB - 1; i >= 0; i--) {
+        char* block = slab + (size_t) i * BLOCK_SIZE;
+        *(char**) block = freeBlocks;
+        freeBlocks = block;
+    }
+}
+
+/* Returns an uninitialized block */
+char* block_alloc() {
+    if (pthread_mutex_lock(&poolLock) != 0) {
+        perror("Failed to acquire the block pool lock.");
+        exit(EXIT_FAILURE);
+    }
+    if (!freeBlocks)
+        add_slab();
+    char* block = freeBlocks;
+    freeBlocks = *(char**) block;
+    if (pthread_mutex_unlock(&poolLock) != 0) {
+        perror("Failed to release the block pool lock.");
+        exit(EXIT_FAILURE);
+    }
+    return block;
+}
+
+void block_free(char* block) {
+    if (pthread_mutex_lock(&poolLock) != 0) {
+        perror("Failed to acquire the block pool lock.");
+        exit(EXIT_FAILURE);
+    }
+    *(char**) block = freeBlocks;
+    freeBlocks = block;
+    if (pthread_mutex_unlock(&poolLock) != 0) {
+        perror("Failed to release the block pool lock.");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+/* Fixed-size blocks holding file contents. Blocks are carved out of
+ * slabs and recycled through a free list, the memory only goes back
+ * to the system when the pool is destroyed. */
+
+#define BLOCK_SIZE 4096
+#define BLOCKS_PER_SLAB 256
+
+void block_pool_init();
+void block_pool_destroy();
+char* block_alloc();
+void block_free(char* block);
+
+#endif /* BLOCKS_H */
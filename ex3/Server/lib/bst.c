@@ -1,135 +1,619 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 #include "bst.h"
+#include "rcu.h"
+
+/* An AVL tree is at most 1.44*log2(n) high, so 96 levels
+ * covers any tree that fits in memory */
+#define MAX_TREE_HEIGHT 96
+
+#define NODES_PER_SLAB 1024
+#define NODE_CACHE_BATCH 64 // Nodes moved between a thread's cache and the pool at a time
+#define CACHE_LINE_SIZE 64
 
 void insertDelay(int cycles){
-    for(int i=0; i < cycles; i++){}
+    for(volatile int i=0; i < cycles; i++){}
 }
 
-node* new_node(char* key, int inumber)
-{
-    node* p = malloc(sizeof(node));
-    if (!p){
+/* Latency injection, to reproduce contention on the trees: every level
+ * an operation walks spins for treeDelays[op] iterations. All are 0
+ * unless configured, and then only cost one load per operation. */
+static int treeDelays[DELAY_OPS];
+static const char* delayNames[DELAY_OPS] = { "search", "insert", "remove" };
+
+static int tree_delay(delay_op op) {
+    return __atomic_load_n(&treeDelays[op], __ATOMIC_RELAXED);
+}
+
+/*
+ * Sets the delay of every operation from a spec such as
+ * "search=5000,insert" (an operation without a value gets DELAY, "all"
+ * names every one). Operations not named are not delayed, so a NULL or
+ * empty spec turns injection off.
+ * Returns:
+ *    0: if successful
+ *   -1: if the spec is invalid, leaving the delays as they were
+ */
+int delay_configure(const char* spec) {
+    int delays[DELAY_OPS] = { 0 };
+
+    while (spec && *spec) {
+        size_t nameLength = strcspn(spec, "=,");
+        int cycles = DELAY, op;
+        for (op = 0; op < DELAY_OPS; op++) {
+            if (strlen(delayNames[op]) == nameLength && !strncmp(spec, delayNames[op], nameLength))
+                break;
+        }
+        if (op == DELAY_OPS && !(nameLength == 3 && !strncmp(spec, "all", 3)))
+            return -1;
+        spec += nameLength;
+        if (*spec == '=') {
+            char* end;
+            long value = strtol(spec + 1, &end, 10);
+            if (end == spec + 1 || value < 0 || value > INT_MAX)
+                return -1;
+            cycles = value;
+            spec = end;
+        }
+        if (*spec == ',')
+            spec++;
+        else if (*spec)
+            return -1;
+        for (int i = 0; i < DELAY_OPS; i++) {
+            if (op == DELAY_OPS || op == i)
+                delays[i] = cycles;
+        }
+    }
+    for (int i = 0; i < DELAY_OPS; i++) {
+        __atomic_store_n(&treeDelays[i], delays[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* Nodes are carved out of slabs and recycled rather than freed. Each
+ * thread keeps a cache of free nodes and only takes the pool lock to
+ * move a batch in or out of it, so once the pool has grown an entry
+ * takes no allocation at all, short keys being stored in the node. */
+typedef struct node_cache {
+    node* nodes; // Linked through their right pointer, as in the pool
+    int count;
+    int registered; // Set once the thread returns the cache when it exits
+} node_cache;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static node* freeNodes;
+static node** slabs;
+static int slabCount, slabCapacity;
+static pthread_key_t cacheKey;
+static __thread node_cache cache;
+
+static void lock_pool() {
+    if (pthread_mutex_lock(&poolLock) != 0) {
+        perror("Failed to acquire the node pool lock.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void unlock_pool() {
+    if (pthread_mutex_unlock(&poolLock) != 0) {
+        perror("Failed to release the node pool lock.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Moves count nodes from the front of c back to the pool */
+static void return_nodes(node_cache* c, int count) {
+    if (count == 0)
+        return;
+    node* first = c->nodes;
+    node* last = first;
+    for (int i = 1; i < count; i++)
+        last = last->right;
+    c->nodes = last->right;
+    c->count -= count;
+    lock_pool();
+    last->right = freeNodes;
+    freeNodes = first;
+    unlock_pool();
+}
+
+/* Called by the thread key destructor when a thread exits */
+static void return_cache(void* arg) {
+    node_cache* c = arg;
+    return_nodes(c, c->count);
+    c->registered = 0;
+}
+
+static void register_cache() {
+    if (pthread_setspecific(cacheKey, &cache) != 0) {
+        perror("Failed to register the node cache.");
+        exit(EXIT_FAILURE);
+    }
+    cache.registered = 1;
+}
+
+void node_pool_init() {
+    freeNodes = NULL;
+    slabs = NULL;
+    slabCount = slabCapacity = 0;
+    cache = (node_cache) { NULL, 0, 0 };
+    if (pthread_key_create(&cacheKey, return_cache) != 0) {
+        perror("Failed to create the node cache key.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Releases every node at once. Must only run once no other thread
+ * holds nodes or a cache, and after retired nodes were reclaimed. */
+void node_pool_destroy() {
+    for (int i = 0; i < slabCount; i++)
+        free(slabs[i]);
+    free(slabs);
+    if (pthread_key_delete(cacheKey) != 0) {
+        perror("Failed to delete the node cache key.");
+        exit(EXIT_FAILURE);
+    }
+    freeNodes = NULL;
+    slabs = NULL;
+    slabCount = slabCapacity = 0;
+    cache = (node_cache) { NULL, 0, 0 };
+}
+
+/* Carves a new slab into free nodes, with poolLock held */
+static void add_slab() {
+    if (slabCount == slabCapacity) {
+        slabCapacity = slabCapacity ? 2 * slabCapacity : 16;
+        if (!(slabs = realloc(slabs, slabCapacity * sizeof(node*)))) {
+            perror("new_node: no memory for slabs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    node* slab;
+    if (posix_memalign((void**) &slab, CACHE_LINE_SIZE, NODES_PER_SLAB * sizeof(node)) != 0) {
         perror("new_node: no memory for a new node");
         exit(EXIT_FAILURE);
     }
+    slabs[slabCount++] = slab;
+    for (int i = NODES_PER_SLAB - 1; i >= 0; i--) {
+        slab[i].right = freeNodes;
+        freeNodes = &slab[i];
+    }
+}
+
+static node* take_node() {
+    if (!cache.nodes) {
+        if (!cache.registered)
+            register_cache();
+        lock_pool();
+        for (int i = 0; i < NODE_CACHE_BATCH; i++) {
+            if (!freeNodes)
+                add_slab();
+            node* p = freeNodes;
+            freeNodes = p->right;
+            p->right = cache.nodes;
+            cache.nodes = p;
+        }
+        unlock_pool();
+        cache.count = NODE_CACHE_BATCH;
+    }
+    node* p = cache.nodes;
+    cache.nodes = p->right;
+    cache.count--;
+    return p;
+}
+
+/* Puts a node no one can reach anymore in the calling thread's cache,
+ * its key having been released or taken over */
+static void release_node(node* p) {
+    if (!cache.registered)
+        register_cache();
+    p->right = cache.nodes;
+    cache.nodes = p;
+    if (++cache.count >= 2 * NODE_CACHE_BATCH)
+        return_nodes(&cache, NODE_CACHE_BATCH);
+}
+
+static void reclaim_node(void* ptr) {
+    release_node(ptr);
+}
+
+/* Stores key in p, inline if it fits */
+void set_key(node* p, const char* key) {
     size_t size = strlen(key) + 1;
-    p->key = malloc(sizeof(char) * size);
+    if (size <= INLINE_KEY_SIZE) {
+        p->key = p->inlineKey;
+    } else if (!(p->key = malloc(sizeof(char) * size))) {
+        perror("new_node: no memory for a key");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(p->key, key, size);
+}
+
+/* Moves the key of from into p. A key allocated on its own is shared
+ * rather than copied, so it must only be released once. */
+static void take_key(node* p, node* from) {
+    if (from->key == from->inlineKey) {
+        memcpy(p->inlineKey, from->inlineKey, INLINE_KEY_SIZE);
+        p->key = p->inlineKey;
+    } else {
+        p->key = from->key;
+    }
+}
+
+static void retire_key(node* p) {
+    if (p->key != p->inlineKey)
+        rcu_retire(p->key, free);
+}
 
-    strncpy(p->key, key, size);
+/* Nodes reachable from a published root are never modified, since
+ * lookups walk the trees without locks. Updates copy the nodes they
+ * change and retire the originals, and the copies stay private to the
+ * update, marked fresh, until the caller publishes the new root. */
+typedef struct tree_update {
+    node* created[4 * MAX_TREE_HEIGHT];
+    int count;
+} tree_update;
+
+static node* alloc_node(tree_update* u)
+{
+    node* p = take_node();
+    p->fresh = 1;
+    u->created[u->count++] = p;
+    return p;
+}
+
+static node* new_node(tree_update* u, char* key, int inumber)
+{
+    node* p = alloc_node(u);
+    set_key(p, key);
     p->inumber = inumber;
+    p->height = 1;
     p->left  = NULL;
     p->right = NULL;
     return p;
 }
 
+/* Returns a private version of p, copying it if it was published.
+ * The copy takes over the key, so only the node itself is retired. */
+static node* own(tree_update* u, node* p)
+{
+    if (p->fresh)
+        return p;
+    node* copy = alloc_node(u);
+    take_key(copy, p);
+    copy->inumber = p->inumber;
+    copy->height = p->height;
+    copy->left = p->left;
+    copy->right = p->right;
+    rcu_retire(p, reclaim_node);
+    return copy;
+}
+
+static void seal_update(tree_update* u)
+{
+    for (int i = 0; i < u->count; i++) {
+        u->created[i]->fresh = 0;
+    }
+}
+
 int max(int a, int b)
 {
     return a > b ? a : b;
 }
 
-node* search(node* p, char* key)
+static int height(node* p)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
+    return p ? p->height : 0;
+}
 
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        return search(p->left, key);
-    else if (comp > 0)
-        return search(p->right, key);
-    else
-        return p;
+static void update_height(node* p)
+{
+    p->height = max(height(p->left), height(p->right)) + 1;
 }
 
-node* insert(node* p, char* key, int inumber)
+/* Rotations expect p to be private and copy the child they lift */
+static node* rotate_right(tree_update* u, node* p)
+{
+    node* l = own(u, p->left);
+    p->left = l->right;
+    l->right = p;
+    update_height(p);
+    update_height(l);
+    return l;
+}
+
+static node* rotate_left(tree_update* u, node* p)
+{
+    node* r = own(u, p->right);
+    p->right = r->left;
+    r->left = p;
+    update_height(p);
+    update_height(r);
+    return r;
+}
+
+/* Restores the AVL invariant at the private node p, assuming both
+ * subtrees are balanced, and returns the new subtree root */
+static node* rebalance(tree_update* u, node* p)
 {
-    insertDelay(DELAY);
-    if (!p){
-        return new_node(key, inumber);
+    update_height(p);
+    int balance = height(p->left) - height(p->right);
+    if (balance > 1) {
+        if (height(p->left->left) < height(p->left->right)) {
+            p->left = own(u, p->left);
+            p->left = rotate_left(u, p->left);
+        }
+        return rotate_right(u, p);
     }
+    if (balance < -1) {
+        if (height(p->right->right) < height(p->right->left)) {
+            p->right = own(u, p->right);
+            p->right = rotate_right(u, p->right);
+        }
+        return rotate_left(u, p);
+    }
+    return p;
+}
 
-    int comp = strcmp(key, p->key);
-    if (comp < 0){
-        p->left = insert(p->left, key, inumber);
+/* Rebalances the private subtrees referenced by the links in path, from
+ * the deepest up, stopping once a subtree keeps its height */
+static void rebalance_path(tree_update* u, node** path[], int depth)
+{
+    while (depth > 0) {
+        node** link = path[--depth];
+        int oldHeight = (*link)->height;
+        *link = rebalance(u, *link);
+        if ((*link)->height == oldHeight)
+            break;
     }
-    else if (comp > 0){
-        p->right = insert(p->right, key, inumber);
+}
+
+static node* find(node* p, char* key, delay_op op)
+{
+    int delay = tree_delay(op);
+
+    while (p) {
+        if (delay)
+            insertDelay(delay);
+        int comp = strcmp(key, p->key);
+        if (comp < 0)
+            p = p->left;
+        else if (comp > 0)
+            p = p->right;
+        else
+            return p;
     }
-    else 
-        p->inumber = inumber;
+    return NULL;
+}
+
+node* search(node* p, char* key)
+{
+    return find(p, key, DELAY_SEARCH);
+}
+
+/* Returns the root of a new version of p holding key. The nodes of p
+ * that were replaced are retired, so p must have been published. */
+node* insert(node* p, char* key, int inumber)
+{
+    tree_update u = { .count = 0 };
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
+    int delay = tree_delay(DELAY_INSERT);
+
+    while (*link) {
+        if (delay)
+            insertDelay(delay);
+        int comp = strcmp(key, (*link)->key);
+        *link = own(&u, *link);
+        if (comp == 0) {
+            (*link)->inumber = inumber;
+            seal_update(&u);
+            return p;
+        }
+        path[depth++] = link;
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
+    }
+    *link = new_node(&u, key, inumber);
+    rebalance_path(&u, path, depth);
+    seal_update(&u);
     return p;
 }
 
 node* find_min(node* p)
 {
-    if ( p->left != NULL )
-        return find_min(p->left);
-    else
-        return p;
+    while (p->left != NULL)
+        p = p->left;
+    return p;
+}
+
+/* Unlinks the minimum of p, copying its ancestors, and moves the
+ * minimum's entry into into. The minimum node itself is retired. */
+static node* detach_min(tree_update* u, node* p, node* into)
+{
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
+
+    while ((*link)->left != NULL) {
+        *link = own(u, *link);
+        path[depth++] = link;
+        link = &(*link)->left;
+    }
+    node* m = *link;
+    take_key(into, m);
+    into->inumber = m->inumber;
+    *link = m->right;
+    rcu_retire(m, reclaim_node);
+    rebalance_path(u, path, depth);
+    return p;
 }
 
 node* remove_min(node* p)
 {
-    if ( p->left == NULL )
-        return p->right;
+    tree_update u = { .count = 0 };
+    node removed;
 
-    p->left = remove_min(p->left);
+    p = detach_min(&u, p, &removed);
+    retire_key(&removed);
+    seal_update(&u);
     return p;
 }
 
+/* Returns the root of a new version of p without key, or p itself if
+ * key is not there. Replaced and removed nodes are retired. */
 node* remove_item(node* p, char* key)
 {
-    insertDelay(DELAY);
-    if (!p)
-        return NULL;
-    
-    int comp = strcmp(key, p->key);
-    if (comp < 0)
-        p->left = remove_item(p->left, key);
-    else if (comp > 0)
-        p->right = remove_item(p->right, key);
-    else
-    {
-        node* l = p->left;
-        node* r = p->right;
-        node* m;
-        free(p->key);
-        free(p);
+    if (!find(p, key, DELAY_REMOVE))
+        return p;
 
-        if (r == NULL)
-            return l;
+    tree_update u = { .count = 0 };
+    node** path[MAX_TREE_HEIGHT];
+    int depth = 0;
+    node** link = &p;
 
-        m = find_min(r);
-        m->right = remove_min(r);        
-        m->left = l;
+    while (1) {
+        int comp = strcmp(key, (*link)->key);
+        if (comp == 0)
+            break;
+        *link = own(&u, *link);
+        path[depth++] = link;
+        link = comp < 0 ? &(*link)->left : &(*link)->right;
+    }
 
-        return m;
+    node* m = *link;
+    retire_key(m);
+    if (m->left == NULL || m->right == NULL) {
+        *link = m->left ? m->left : m->right;
+        rcu_retire(m, reclaim_node);
+    } else { // Take over the successor's entry and remove the successor instead
+        m = own(&u, m);
+        m->right = detach_min(&u, m->right, m);
+        *link = m;
+        path[depth++] = link;
     }
 
+    rebalance_path(&u, path, depth);
+    seal_update(&u);
     return p;
 }
 
+/* Builds a balanced tree over count nodes sorted by key. The new
+ * nodes take over the keys of the given ones, which the caller
+ * releases with retire_tree. */
+node* build_tree(node* sorted[], int count)
+{
+    node** slots[MAX_TREE_HEIGHT];
+    int low[MAX_TREE_HEIGHT], high[MAX_TREE_HEIGHT];
+    int top = 0;
+    node* root = NULL;
+
+    if (count > 0) {
+        slots[top] = &root;
+        low[top] = 0;
+        high[top++] = count;
+    }
+    while (top > 0) { // Each entry fills its slot with the middle of sorted[low, high)
+        top--;
+        int l = low[top], h = high[top], mid = l + (h - l) / 2;
+        node* p = take_node();
+        take_key(p, sorted[mid]);
+        p->inumber = sorted[mid]->inumber;
+        p->height = 32 - __builtin_clz(h - l); // Halving n nodes gives a height of floor(log2(n)) + 1
+        p->fresh = 0;
+        p->left = NULL;
+        p->right = NULL;
+        *slots[top] = p;
+        if (mid + 1 < h) {
+            slots[top] = &p->right;
+            low[top] = mid + 1;
+            high[top++] = h;
+        }
+        if (l < mid) {
+            slots[top] = &p->left;
+            low[top] = l;
+            high[top++] = mid;
+        }
+    }
+    return root;
+}
+
+/* Retires every node of a published tree, leaving the keys to the
+ * nodes that took them over */
+void retire_tree(node* p)
+{
+    node* stack[MAX_TREE_HEIGHT];
+    int top = 0;
+
+    while (p || top > 0) {
+        while (p) {
+            stack[top++] = p;
+            p = p->left;
+        }
+        p = stack[--top];
+        node* r = p->right;
+        rcu_retire(p, reclaim_node);
+        p = r;
+    }
+}
+
+/* Rotates every left child up into the right spine and frees the
+ * spine as it goes, so no stack is needed whatever the tree shape */
 void free_tree(node* p)
 {
-    if (!p)
-        return;
+    while (p) {
+        if (p->left) {
+            node* l = p->left;
+            p->left = l->right;
+            l->right = p;
+            p = l;
+        } else {
+            node* r = p->right;
+            if (p->key != p->inlineKey)
+                free(p->key);
+            release_node(p);
+            p = r;
+        }
+    }
+}
 
-    free_tree(p->left);
-    free_tree(p->right);
-    free(p->key);
-    free(p);
+void traverse_tree(node* p, void (*visit)(node* p, void* arg), void* arg)
+{
+    node* stack[MAX_TREE_HEIGHT];
+    int top = 0;
+
+    while (p || top > 0) {
+        while (p) {
+            stack[top++] = p;
+            p = p->left;
+        }
+        p = stack[--top];
+        visit(p, arg);
+        p = p->right;
+    }
 }
 
 void print_tree_2(FILE * fp, node* p, int l)
 {
-    if (p) {
-        print_tree_2(fp, p->left, l+1);
+    node* stack[MAX_TREE_HEIGHT];
+    int levels[MAX_TREE_HEIGHT];
+    int top = 0;
+
+    while (p || top > 0) {
+        while (p) {
+            stack[top] = p;
+            levels[top++] = l++;
+            p = p->left;
+        }
+        p = stack[--top];
+        l = levels[top];
         fprintf(fp, "%*s%s\n", 2*(l+1), "" , p->key);
-        print_tree_2(fp, p->right, l+1);
+        p = p->right;
+        l++;
     }
 }
 
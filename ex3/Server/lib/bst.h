@@ -3,23 +3,37 @@
 #define BST_H
 #include <stdio.h>
 
-#define DELAY 5000
+#define DELAY 5000 // Iterations per tree level for an operation enabled without a value
+#define DELAY_ENV "TECNICOFS_DELAY"
+#define INLINE_KEY_SIZE 34 // Fills a node up to 64 bytes
 
-typedef struct node {
-    char* key;
-    int inumber;
+/* Tree operations that can be slowed down on purpose */
+typedef enum delay_op { DELAY_SEARCH, DELAY_INSERT, DELAY_REMOVE, DELAY_OPS } delay_op;
 
+typedef struct node {
+    char* key; // inlineKey if the key fits there, otherwise allocated on its own
     struct node* left;
     struct node* right;
+    int inumber;
+    unsigned char height;
+    unsigned char fresh; // Set while the node is private to an update, see bst.c
+    char inlineKey[INLINE_KEY_SIZE];
 } node;
 
 void insertDelay(int cycles);
+int delay_configure(const char* spec);
+void node_pool_init();
+void node_pool_destroy();
+void set_key(node *p, const char* key);
 node *search(node *p, char* key);
 node *insert(node *p, char* key, int inumber);
 node *find_min(node *p);
 node *remove_min(node *p);
 node *remove_item(node *p, char* key);
+node *build_tree(node *sorted[], int count);
+void retire_tree(node *p);
 void free_tree(node *p);
+void traverse_tree(node *p, void (*visit)(node *p, void *arg), void *arg);
 void print_tree(FILE* fp, node *p);
 
 #endif /* BST_H */
@@ -1,5 +1,26 @@
 #include "hash.h"
 
+#define FNV_OFFSET_BASIS 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+/* Full-key 64 bit hash for strings.
+ * FNV-1a over every character followed by a 64 bit
+ * finalizer, so keys differing only in their last
+ * characters (f0001, f0002, ...) spread over all bits */
+uint64_t hash_key(const char* name) {
+	uint64_t h = FNV_OFFSET_BASIS;
+	for (const unsigned char* c = (const unsigned char*) name; *c; c++) {
+		h ^= *c;
+		h *= FNV_PRIME;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	h ^= h >> 33;
+	return h;
+}
+
 /* Simple hash function for strings.
  * Receives a string and resturns its hash value
  * which is a number between 0 and n-1
@@ -7,7 +28,6 @@
 int hash(char* name, int n) {
 	if (!name) 
 		return -1;
-	return (int) name[0] % n;
+	return (int) (hash_key(name) % n);
 }
 
-
@@ -2,55 +2,299 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "inodes.h"
+#include "../wal.h"
+#include "../stats.h"
 #include "../../Client/tecnicofs-api-constants.h"
 
-inode_t inode_table[INODE_TABLE_SIZE]; 
-pthread_mutex_t inode_table_lock;
+/* I-nodes live in chunks that are never moved or freed while the
+ * server runs, so an inumber always names the same inode_t. Free
+ * i-nodes are kept in a lock-free stack, the table only grows when
+ * it is empty. */
+inode_t* inode_chunks[MAX_INODE_CHUNKS];
+int inode_chunk_count;
+uint64_t inode_free_list; // Pop count in the high half against ABA, top inumber + 1 in the low half
+pthread_mutex_t inode_grow_lock;
+static uint64_t inode_table_locked_at; // Written by the holder of inode_grow_lock
 
-void lock_inode_table(){
-    if(pthread_mutex_lock(&inode_table_lock) != 0){
+static unsigned long chunk_start(int chunk){
+    return chunk == 0 ? 0 : (unsigned long) INODE_CHUNK_SIZE << (chunk - 1);
+}
+
+static unsigned long chunk_size(int chunk){
+    return chunk == 0 ? INODE_CHUNK_SIZE : (unsigned long) INODE_CHUNK_SIZE << (chunk - 1);
+}
+
+/* Returns the i-node named by inumber, or NULL if its chunk was never allocated */
+static inode_t* get_inode(int inumber){
+    if(inumber < 0)
+        return NULL;
+    int chunk = inumber < INODE_CHUNK_SIZE ? 0 : 64 - __builtin_clzl((unsigned long) inumber / INODE_CHUNK_SIZE);
+    if(chunk >= MAX_INODE_CHUNKS)
+        return NULL;
+    inode_t* start = __atomic_load_n(&inode_chunks[chunk], __ATOMIC_ACQUIRE);
+    if(!start)
+        return NULL;
+    return start + (inumber - chunk_start(chunk));
+}
+
+/* Readers share i-node locks, so only the waits for them are counted,
+ * and only timed when the lock turned out to be busy */
+void read_lock_inode(inode_t* inode){
+    int contended = pthread_rwlock_tryrdlock(&inode->lock) != 0;
+    uint64_t waitStart = contended ? stats_now() : 0;
+    if(contended && pthread_rwlock_rdlock(&inode->lock) != 0){
+        perror("Failed to acquire the i-node lock.");
+        exit(EXIT_FAILURE);
+    }
+    stats_lock_acquired(NULL, STATS_INODE_LOCKS, contended, contended ? stats_now() - waitStart : 0);
+}
+
+void write_lock_inode(inode_t* inode){
+    int contended = pthread_rwlock_trywrlock(&inode->lock) != 0;
+    uint64_t waitStart = contended ? stats_now() : 0;
+    if(contended && pthread_rwlock_wrlock(&inode->lock) != 0){
+        perror("Failed to acquire the i-node lock.");
+        exit(EXIT_FAILURE);
+    }
+    stats_lock_acquired(NULL, STATS_INODE_LOCKS, contended, contended ? stats_now() - waitStart : 0);
+}
+
+void unlock_inode(inode_t* inode){
+    if(pthread_rwlock_unlock(&inode->lock) != 0){
+        perror("Failed to release the i-node lock.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Returns the i-node locked for reading or writing, or NULL if
+ * inumber doesn't name an i-node in use */
+static inode_t* lock_valid_inode(int inumber, int write, const char* caller){
+    inode_t* inode = get_inode(inumber);
+    if(!inode){
+        printf("%s: invalid inumber %d\n", caller, inumber);
+        return NULL;
+    }
+    if(write)
+        write_lock_inode(inode);
+    else
+        read_lock_inode(inode);
+    if(inode->owner == FREE_INODE){
+        printf("%s: invalid inumber %d\n", caller, inumber);
+        unlock_inode(inode);
+        return NULL;
+    }
+    return inode;
+}
+
+static void free_contents(inode_contents* contents){
+    for(size_t i = 0; i < contents->blockSlots; i++){
+        if(contents->blocks[i])
+            block_free(contents->blocks[i]);
+    }
+    free(contents->blocks);
+    *contents = (inode_contents) { NULL, 0, 0 };
+}
+
+static void reserve_slots(inode_contents* contents, size_t slots){
+    if(slots <= contents->blockSlots)
+        return;
+    size_t newSlots = contents->blockSlots ? contents->blockSlots : 4;
+    while(newSlots < slots)
+        newSlots *= 2;
+    char** blocks = realloc(contents->blocks, newSlots * sizeof(char*));
+    if(!blocks){
+        perror("Failed to allocate file blocks");
+        exit(EXIT_FAILURE);
+    }
+    memset(blocks + contents->blockSlots, 0, (newSlots - contents->blockSlots) * sizeof(char*));
+    contents->blocks = blocks;
+    contents->blockSlots = newSlots;
+}
+
+/* Copies up to len bytes starting at offset, returns how many there were */
+static size_t read_blocks(inode_contents* contents, char* buffer, size_t len, size_t offset){
+    if(offset >= contents->size)
+        return 0;
+    if(len > contents->size - offset)
+        len = contents->size - offset;
+    for(size_t done = 0; done < len;){
+        size_t index = (offset + done) / BLOCK_SIZE, start = (offset + done) % BLOCK_SIZE;
+        size_t count = BLOCK_SIZE - start < len - done ? BLOCK_SIZE - start : len - done;
+        if(index < contents->blockSlots && contents->blocks[index])
+            memcpy(buffer + done, contents->blocks[index] + start, count);
+        else
+            memset(buffer + done, 0, count);
+        done += count;
+    }
+    return len;
+}
+
+/* Only touches the blocks the write covers, whatever the file size */
+static int write_blocks(inode_contents* contents, const char* buffer, size_t len, size_t offset){
+    if(offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE - offset)
+        return -1;
+    if(len == 0)
+        return 0;
+    reserve_slots(contents, (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for(size_t done = 0; done < len;){
+        size_t index = (offset + done) / BLOCK_SIZE, start = (offset + done) % BLOCK_SIZE;
+        size_t count = BLOCK_SIZE - start < len - done ? BLOCK_SIZE - start : len - done;
+        if(!contents->blocks[index]){
+            contents->blocks[index] = block_alloc();
+            if(count < BLOCK_SIZE)
+                memset(contents->blocks[index], 0, BLOCK_SIZE);
+        }
+        memcpy(contents->blocks[index] + start, buffer + done, count);
+        done += count;
+    }
+    if(offset + len > contents->size)
+        contents->size = offset + len;
+    return 0;
+}
+
+static int truncate_blocks(inode_contents* contents, size_t size){
+    if(size > MAX_FILE_SIZE)
+        return -1;
+    if(size < contents->size){
+        size_t kept = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for(size_t i = kept; i < contents->blockSlots; i++){
+            if(contents->blocks[i]){
+                block_free(contents->blocks[i]);
+                contents->blocks[i] = NULL;
+            }
+        }
+        // Keep the bytes past the new end zeroed for when the file grows back
+        if(size % BLOCK_SIZE && kept - 1 < contents->blockSlots && contents->blocks[kept - 1])
+            memset(contents->blocks[kept - 1] + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+    }
+    contents->size = size;
+    return 0;
+}
+
+/* Pushes the free i-nodes first..last, already linked through nextFree */
+static void push_free(int first, int last){
+    uint64_t head = __atomic_load_n(&inode_free_list, __ATOMIC_RELAXED), newHead;
+    do {
+        __atomic_store_n(&get_inode(last)->nextFree, (int) (uint32_t) head - 1, __ATOMIC_RELAXED);
+        newHead = (head & 0xffffffff00000000UL) | (uint32_t) (first + 1);
+    } while(!__atomic_compare_exchange_n(&inode_free_list, &head, newHead, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Pops a free inumber, or returns -1 if there is none. The pop count
+ * changes the head on every pop, so a top that was popped and pushed
+ * back meanwhile can't be mistaken for an unchanged stack. */
+static int pop_free(){
+    uint64_t head = __atomic_load_n(&inode_free_list, __ATOMIC_ACQUIRE), newHead;
+    int top;
+    do {
+        top = (int) (uint32_t) head - 1;
+        if(top < 0)
+            return -1;
+        int next = __atomic_load_n(&get_inode(top)->nextFree, __ATOMIC_RELAXED);
+        newHead = (((head >> 32) + 1) << 32) | (uint32_t) (next + 1);
+    } while(!__atomic_compare_exchange_n(&inode_free_list, &head, newHead, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return top;
+}
+
+/* Allocates a chunk of free i-nodes linked through nextFree, the caller
+ * holds inode_grow_lock and decides whether they join the free list */
+static void new_inode_chunk(int chunk){
+    unsigned long first = chunk_start(chunk), size = chunk_size(chunk);
+    inode_t* start = malloc(size * sizeof(inode_t));
+    if(!start){
+        perror("Failed to allocate i-node chunk");
+        exit(EXIT_FAILURE);
+    }
+    for(unsigned long i = 0; i < size; i++){
+        start[i].owner = FREE_INODE;
+        start[i].directory = 0;
+        start[i].entries = NULL;
+        start[i].contents = (inode_contents) { NULL, 0, 0 };
+        start[i].nextFree = first + i + 1;
+        if(pthread_rwlock_init(&start[i].lock, NULL) != 0){
+            perror("Failed to initialize inode lock.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    __atomic_store_n(&inode_chunks[chunk], start, __ATOMIC_RELEASE);
+    inode_chunk_count = chunk + 1;
+}
+
+static void lock_inode_table(){
+    int contended = pthread_mutex_trylock(&inode_grow_lock) != 0;
+    uint64_t waitStart = contended ? stats_now() : 0;
+    if(contended && pthread_mutex_lock(&inode_grow_lock) != 0){
         perror("Failed to acquire the i-node table lock.");
         exit(EXIT_FAILURE);
     }
+    inode_table_locked_at = stats_now();
+    stats_lock_acquired(NULL, STATS_INODE_TABLE_LOCK, contended, contended ? inode_table_locked_at - waitStart : 0);
 }
 
-void unlock_inode_table(){
-    if(pthread_mutex_unlock(&inode_table_lock) != 0){
+static void unlock_inode_table(){
+    stats_lock_released(NULL, STATS_INODE_TABLE_LOCK, stats_now() - inode_table_locked_at);
+    if(pthread_mutex_unlock(&inode_grow_lock) != 0){
         perror("Failed to release the i-node table lock.");
         exit(EXIT_FAILURE);
     }
 }
 
+/* Adds a chunk of free i-nodes, unless another thread already refilled
+ * the free list. Returns -1 once every chunk is in use. */
+static int grow_inode_table(){
+    lock_inode_table();
+    int chunk = inode_chunk_count;
+    if((uint32_t) __atomic_load_n(&inode_free_list, __ATOMIC_ACQUIRE) == 0 && chunk < MAX_INODE_CHUNKS){
+        new_inode_chunk(chunk);
+        push_free(chunk_start(chunk), chunk_start(chunk) + chunk_size(chunk) - 1);
+    }
+    unlock_inode_table();
+    return chunk < MAX_INODE_CHUNKS ? 0 : -1;
+}
+
 /*
- * Initializes the i-nodes table and the mutex.
+ * Initializes the i-nodes table and its lock.
  */
 void inode_table_init(){
-    if(pthread_mutex_init(&inode_table_lock, NULL) != 0){
+    if(pthread_mutex_init(&inode_grow_lock, NULL) != 0){
         perror("Failed to initialize inode table mutex.\n");
         exit(EXIT_FAILURE);
     }
-    for(int i = 0; i < INODE_TABLE_SIZE; i++){
-        inode_table[i].owner = FREE_INODE;
-        inode_table[i].fileContent = NULL;
-    }
+    for(int i = 0; i < MAX_INODE_CHUNKS; i++)
+        inode_chunks[i] = NULL;
+    inode_chunk_count = 0;
+    inode_free_list = 0;
+    block_pool_init();
 }
 
 /*
  * Releases the allocated memory for the i-nodes tables
- * and destroys the mutex.
+ * and destroys the locks.
  */
 
 void inode_table_destroy(){
-    for(int i = 0; i < INODE_TABLE_SIZE; i++){
-        if(inode_table[i].owner!=FREE_INODE && inode_table[i].fileContent)
-            free(inode_table[i].fileContent);
+    for(int chunk = 0; chunk < inode_chunk_count; chunk++){
+        unsigned long size = chunk_size(chunk);
+        for(unsigned long i = 0; i < size; i++){
+            free_contents(&inode_chunks[chunk][i].contents);
+            if(pthread_rwlock_destroy(&inode_chunks[chunk][i].lock) != 0){
+                perror("Failed to destroy inode lock.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(inode_chunks[chunk]);
     }
     
-    if(pthread_mutex_destroy(&inode_table_lock) != 0){
+    if(pthread_mutex_destroy(&inode_grow_lock) != 0){
         perror("Failed to destroy inode table mutex.\n");
         exit(EXIT_FAILURE);
     }
+    block_pool_destroy();
 }
 
 /*
@@ -63,20 +307,45 @@ void inode_table_destroy(){
  *  inumber: identifier of the new i-node, if successfully created
  *       -1: if an error occurs
  */
-int inode_create(uid_t owner, permission ownerPerm, permission othersPerm){
-    lock_inode_table();
-    for(int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++){
-        if(inode_table[inumber].owner == FREE_INODE){
-            inode_table[inumber].owner = owner;
-            inode_table[inumber].ownerPermissions = ownerPerm;
-            inode_table[inumber].othersPermissions = othersPerm;
-            inode_table[inumber].fileContent = NULL;
-            unlock_inode_table();
-            return inumber;
-        }
+static int create_inode(uid_t owner, permission ownerPerm, permission othersPerm, int directory){
+    int inumber;
+    while((inumber = pop_free()) == -1){
+        if(grow_inode_table() == -1)
+            return -1;
     }
-    unlock_inode_table();
-    return -1;
+    inode_t* inode = get_inode(inumber);
+    write_lock_inode(inode);
+    inode->owner = owner;
+    inode->ownerPermissions = ownerPerm;
+    inode->othersPermissions = othersPerm;
+    __atomic_store_n(&inode->directory, directory, __ATOMIC_RELEASE);
+    wal_log_inode_create(inumber, owner, ownerPerm, othersPerm, directory);
+    unlock_inode(inode);
+    return inumber;
+}
+
+int inode_create(uid_t owner, permission ownerPerm, permission othersPerm){
+    return create_inode(owner, ownerPerm, othersPerm, 0);
+}
+
+/*
+ * Creates an i-node for a directory. Its entries are kept in the
+ * namespace, so it never has contents of its own.
+ */
+int inode_create_directory(uid_t owner, permission ownerPerm, permission othersPerm){
+    return create_inode(owner, ownerPerm, othersPerm, 1);
+}
+
+/* Frees an i-node the caller holds the write lock of, and releases it */
+static void delete_locked(inode_t* inode, int inumber){
+    inode->owner = FREE_INODE;
+    __atomic_store_n(&inode->directory, 0, __ATOMIC_RELEASE);
+    inode_contents oldContents = inode->contents;
+    inode->contents = (inode_contents) { NULL, 0, 0 };
+    wal_log_inode_delete(inumber);
+    unlock_inode(inode);
+    free_contents(&oldContents);
+    push_free(inumber, inumber);
 }
 
 /*
@@ -88,21 +357,86 @@ int inode_create(uid_t owner, permission ownerPerm, permission othersPerm){
  *  -1: if an error occurs
  */
 int inode_delete(int inumber){
-    lock_inode_table();
-    if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_delete: invalid inumber");
-        unlock_inode_table();
+    inode_t* inode = lock_valid_inode(inumber, 1, "inode_delete");
+    if(!inode)
         return -1;
-    }
 
-    inode_table[inumber].owner = FREE_INODE;
-    if(inode_table[inumber].fileContent){
-        free(inode_table[inumber].fileContent);
-    }
-    unlock_inode_table();
+    delete_locked(inode, inumber);
     return 0;
 }
 
+/*
+ * Tells whether inumber names a directory, without taking its lock:
+ * paths are resolved one directory after another, and only the
+ * directory an operation changes is locked.
+ */
+int inode_is_directory(int inumber){
+    inode_t* inode = get_inode(inumber);
+    return inode && __atomic_load_n(&inode->directory, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Locks a directory while the entries in it change: for reading by
+ * those creating, deleting or renaming one of them, which only wait
+ * for each other in the buckets of their names, and for writing by
+ * whoever deletes the directory once it is empty. Unless access is
+ * NONE, uid must have access to the directory.
+ * Returns:
+ *    0: if the directory is locked
+ *   TECNICOFS_ERROR_FILE_NOT_FOUND: if inumber is no longer in use
+ *   TECNICOFS_ERROR_NOT_A_DIRECTORY: if it is a file
+ *   TECNICOFS_ERROR_PERMISSION_DENIED: if uid lacks access
+ */
+int inode_lock_directory(int inumber, int write, uid_t uid, permission access){
+    inode_t* inode = get_inode(inumber);
+    if(!inode)
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    if(write)
+        write_lock_inode(inode);
+    else
+        read_lock_inode(inode);
+    permission granted = inode->owner == uid ? inode->ownerPermissions : inode->othersPermissions;
+    int result = 0;
+    if(inode->owner == FREE_INODE)
+        result = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    else if(!inode->directory)
+        result = TECNICOFS_ERROR_NOT_A_DIRECTORY;
+    else if((access == READ && granted < READ) || (access == WRITE && granted != WRITE && granted != RW))
+        result = TECNICOFS_ERROR_PERMISSION_DENIED;
+    if(result != 0)
+        unlock_inode(inode);
+    return result;
+}
+
+void inode_unlock_directory(int inumber){
+    unlock_inode(get_inode(inumber));
+}
+
+/*
+ * Deletes a directory the caller locked for writing with
+ * inode_lock_directory, releasing it. Entries can't be added to it
+ * from the moment it was locked until it is free.
+ */
+void inode_delete_directory(int inumber){
+    delete_locked(get_inode(inumber), inumber);
+}
+
+/*
+ * The entries of a directory are set before its name is created and
+ * cleared while it is locked for deletion, so whoever holds its lock
+ * or resolved a path through it to lock it reads them without a lock.
+ */
+struct directory_entries* inode_directory_entries(int inumber){
+    inode_t* inode = get_inode(inumber);
+    return inode ? __atomic_load_n(&inode->entries, __ATOMIC_ACQUIRE) : NULL;
+}
+
+void inode_set_directory_entries(int inumber, struct directory_entries* entries){
+    inode_t* inode = get_inode(inumber);
+    if(inode)
+        __atomic_store_n(&inode->entries, entries, __ATOMIC_RELEASE);
+}
+
 /*
  * Copies the contents of the i-node into the arguments.
  * Only the fields referenced by non-null arguments are copied.
@@ -111,79 +445,376 @@ int inode_delete(int inumber){
  *  - owner: pointer to uid_t
  *  - ownerPerm: pointer to permission
  *  - othersPerm: pointer to permission
- *  - fileContent: pointer to a char array with size >= len
+ *  - fileContent: pointer to a char array with size > len, gets
+ *    the first len bytes of the file and a '\0'
  * Returns:
  *    len of content read:if successful
  *   -1: if an error occurs
  */
 int inode_get(int inumber,uid_t *owner, permission *ownerPerm, permission *othersPerm,
                      char* fileContents, int len){
-    lock_inode_table();
-    if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_getValues: invalid inumber %d\n", inumber);
-        unlock_inode_table();
-        return -1;
-    }
-
     if(len < 0){
         printf("inode_getValues: invalid len %d\n", len);
-        unlock_inode_table();
         return -1;
     }
 
+    inode_t* inode = lock_valid_inode(inumber, 0, "inode_getValues");
+    if(!inode)
+        return -1;
+
     if(owner)
-        *owner = inode_table[inumber].owner;
+        *owner = inode->owner;
 
     if(ownerPerm)
-        *ownerPerm = inode_table[inumber].ownerPermissions;
+        *ownerPerm = inode->ownerPermissions;
 
     if(othersPerm)
-        *othersPerm = inode_table[inumber].othersPermissions;
+        *othersPerm = inode->othersPermissions;
 
-    if(fileContents && len > 0 && inode_table[inumber].fileContent){
-        strncpy(fileContents, inode_table[inumber].fileContent, len);
-        fileContents[len] = '\0';
-        unlock_inode_table();
-        return strlen(fileContents);
+    if(fileContents && len > 0){
+        size_t length = read_blocks(&inode->contents, fileContents, len, 0);
+        fileContents[length] = '\0';
+        unlock_inode(inode);
+        return length;
     }
 
-    unlock_inode_table();
+    unlock_inode(inode);
     return 0;
 }
 
 
 /*
- * Updates the i-node file content.
+ * Replaces the i-node file content.
  * Input:
  *  - inumber: identifier of the i-node
- *  - fileContent: pointer to the string with size >= len
+ *  - fileContent: pointer to the new content, of size >= len
  *  - len: length to copy
  * Returns:
  *    0:if successful
  *   -1: if an error occurs
  */
-int inode_set(int inumber, char *fileContents, int len){
-    lock_inode_table();
-    if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_setFileContent: invalid inumber");
-        unlock_inode_table();
+int inode_set(int inumber, const char *fileContents, int len){
+    if(!fileContents || len < 0){
+        printf("inode_setFileContent: fileContents must be non-null && len >= 0\n");
         return -1;
     }
 
-    if(!fileContents || len < 0 || strlen(fileContents) < len){
-        printf("inode_setFileContent: \
-               fileContents must be non-null && len > 0 && strlen(fileContents) > len");
-        unlock_inode_table();
+    // Build the new blocks outside the lock so readers only wait for the swap
+    inode_contents newContents = { NULL, 0, 0 };
+    write_blocks(&newContents, fileContents, len, 0);
+
+    inode_t* inode = lock_valid_inode(inumber, 1, "inode_setFileContent");
+    if(!inode){
+        free_contents(&newContents);
         return -1;
     }
-    
-    if(inode_table[inumber].fileContent)
-        free(inode_table[inumber].fileContent);
+    inode_contents oldContents = inode->contents;
+    inode->contents = newContents;
+    wal_log_inode_set(inumber, fileContents, len);
+    unlock_inode(inode);
 
-    
-    inode_table[inumber].fileContent = malloc(sizeof(char) * (len+1));
-    strncpy(inode_table[inumber].fileContent, fileContents, len);
-    inode_table[inumber].fileContent[len] = '\0';
-    unlock_inode_table();
+    free_contents(&oldContents);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Reads from the i-node file content.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: where to copy to, of size >= len
+ *  - len: most bytes to copy
+ *  - offset: where in the file to start
+ * Returns:
+ *    number of bytes read, 0 past the end of the file
+ *   -1: if an error occurs
+ */
+int inode_read(int inumber, char *buffer, int len, long offset){
+    if(!buffer || len < 0 || offset < 0){
+        printf("inode_read: invalid len %d or offset %ld\n", len, offset);
+        return -1;
+    }
+    inode_t* inode = lock_valid_inode(inumber, 0, "inode_read");
+    if(!inode)
+        return -1;
+    size_t length = read_blocks(&inode->contents, buffer, len, offset);
+    unlock_inode(inode);
+    return length;
+}
+
+/*
+ * Writes into the i-node file content, growing the file if needed.
+ * Writing past the end leaves a hole that reads as zeros.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - buffer: bytes to write, of size >= len
+ *  - len: number of bytes to write
+ *  - offset: where in the file to write them
+ * Returns:
+ *    number of bytes written
+ *   -1: if an error occurs
+ */
+int inode_write(int inumber, const char *buffer, int len, long offset){
+    if(!buffer || len < 0 || offset < 0){
+        printf("inode_write: invalid len %d or offset %ld\n", len, offset);
+        return -1;
+    }
+    inode_t* inode = lock_valid_inode(inumber, 1, "inode_write");
+    if(!inode)
+        return -1;
+    int err = write_blocks(&inode->contents, buffer, len, offset);
+    if(err == 0)
+        wal_log_write(inumber, buffer, len, offset);
+    unlock_inode(inode);
+    return err == 0 ? len : -1;
+}
+
+/*
+ * Writes at the end of the i-node file content. Concurrent appends
+ * never overlap.
+ * Returns:
+ *    number of bytes written
+ *   -1: if an error occurs
+ */
+int inode_append(int inumber, const char *buffer, int len){
+    if(!buffer || len < 0){
+        printf("inode_append: invalid len %d\n", len);
+        return -1;
+    }
+    inode_t* inode = lock_valid_inode(inumber, 1, "inode_append");
+    if(!inode)
+        return -1;
+    long offset = inode->contents.size;
+    int err = write_blocks(&inode->contents, buffer, len, offset);
+    if(err == 0)
+        wal_log_write(inumber, buffer, len, offset); // Replays as a write, appending twice would grow the file twice
+    unlock_inode(inode);
+    return err == 0 ? len : -1;
+}
+
+/*
+ * Sets the i-node file size, dropping what is past it or growing
+ * the file with zeros.
+ * Returns:
+ *    0: if successful
+ *   -1: if an error occurs
+ */
+int inode_truncate(int inumber, long size){
+    if(size < 0){
+        printf("inode_truncate: invalid size %ld\n", size);
+        return -1;
+    }
+    inode_t* inode = lock_valid_inode(inumber, 1, "inode_truncate");
+    if(!inode)
+        return -1;
+    int err = truncate_blocks(&inode->contents, size);
+    if(err == 0)
+        wal_log_truncate(inumber, size);
+    unlock_inode(inode);
+    return err;
+}
+
+#define SEND_IOVECS 64
+
+/*
+ * Sends the iovecs without blocking, which may be partially sent more
+ * than once. Once the socket would block, blocked is set and the rest
+ * of them is handed to keep, as is everything sent after them.
+ */
+static int send_iovecs(int sock, struct iovec* iov, int count, int* blocked,
+                       void (*keep)(const char* data, size_t length, void* arg), void* arg){
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+    while(message.msg_iovlen > 0){
+        ssize_t sent = *blocked ? -1 : sendmsg(sock, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(sent < 0 && !*blocked && errno == EINTR)
+            continue;
+        if(sent < 0 && (*blocked || errno == EAGAIN || errno == EWOULDBLOCK)){
+            *blocked = 1;
+            for(; message.msg_iovlen > 0; message.msg_iov++, message.msg_iovlen--)
+                keep(message.msg_iov->iov_base, message.msg_iov->iov_len, arg);
+            return 0;
+        }
+        if(sent <= 0)
+            return -1;
+        while(message.msg_iovlen > 0 && (size_t) sent >= message.msg_iov->iov_len){
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if(message.msg_iovlen > 0){
+            message.msg_iov->iov_base = (char*) message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sends the i-node file content to a socket straight from its blocks,
+ * without copying it in user space first. Blocks that follow each
+ * other in memory share an iovec. The i-node stays locked while it is
+ * sent, which never waits for the socket: once the socket would block,
+ * the rest is copied out instead.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sock: socket to send to
+ *  - len: most bytes to send
+ *  - offset: where in the file to start
+ *  - start: called with the number of bytes about to be sent, setting
+ *    header to what is sent in front of them. Sending stops if it
+ *    fails (returns -1) and everything goes to keep if it returns 1.
+ *  - keep: given the bytes the socket would block on, and all after
+ *    them, in order, to be copied and sent later
+ * Returns:
+ *    number of bytes sent
+ *   -1: if the i-node is invalid, before anything was sent
+ *   -2: if sending failed
+ */
+int inode_send(int inumber, int sock, int len, long offset, int (*start)(int length, struct iovec* header, void* arg),
+               void (*keep)(const char* data, size_t length, void* arg), void* arg){
+    static const char zeros[BLOCK_SIZE];
+    struct iovec iov[SEND_IOVECS];
+    int count = 0, blocked;
+
+    if(len < 0 || offset < 0){
+        printf("inode_send: invalid len %d or offset %ld\n", len, offset);
+        return -1;
+    }
+    inode_t* inode = lock_valid_inode(inumber, 0, "inode_send");
+    if(!inode)
+        return -1;
+
+    // Contents stay locked until the kernel or keep has copied them
+    inode_contents* contents = &inode->contents;
+    size_t length = (size_t) offset >= contents->size ? 0 : contents->size - offset;
+    if(length > (size_t) len)
+        length = len;
+    iov[0].iov_len = 0;
+    int err = start(length, &iov[0], arg);
+    if((blocked = err == 1))
+        err = 0;
+    if(iov[0].iov_len > 0)
+        count = 1;
+
+    for(size_t done = 0; err == 0 && done < length;){
+        size_t index = (offset + done) / BLOCK_SIZE, first = (offset + done) % BLOCK_SIZE;
+        size_t bytes = BLOCK_SIZE - first < length - done ? BLOCK_SIZE - first : length - done;
+        const char* data = index < contents->blockSlots && contents->blocks[index] ?
+                           contents->blocks[index] + first : zeros;
+        if(count > 0 && data != zeros && (char*) iov[count - 1].iov_base + iov[count - 1].iov_len == data){
+            iov[count - 1].iov_len += bytes;
+        } else {
+            if(count == SEND_IOVECS){
+                err = send_iovecs(sock, iov, count, &blocked, keep, arg);
+                count = 0;
+            }
+            iov[count].iov_base = (void*) data;
+            iov[count++].iov_len = bytes;
+        }
+        done += bytes;
+    }
+    if(err == 0 && count > 0)
+        err = send_iovecs(sock, iov, count, &blocked, keep, arg);
+
+    unlock_inode(inode);
+    return err == 0 ? length : -2;
+}
+
+/*
+ * Tells whether inumber names an i-node in use, without complaining
+ * when it doesn't.
+ */
+int inode_in_use(int inumber){
+    inode_t* inode = get_inode(inumber);
+    if(!inode)
+        return 0;
+    read_lock_inode(inode);
+    int inUse = inode->owner != FREE_INODE;
+    unlock_inode(inode);
+    return inUse;
+}
+
+/*
+ * Puts the i-node back as it was when created, or frees it if owner is
+ * FREE_INODE, growing the table up to it if needed. Meant for rebuilding
+ * the table before it is used: the free list is left as it was until
+ * inode_rebuild_free_list is called.
+ */
+void inode_restore(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory){
+    if(inumber < 0){
+        printf("inode_restore: invalid inumber %d\n", inumber);
+        return;
+    }
+    lock_inode_table();
+    while(!get_inode(inumber) && inode_chunk_count < MAX_INODE_CHUNKS)
+        new_inode_chunk(inode_chunk_count);
+    unlock_inode_table();
+    inode_t* inode = get_inode(inumber);
+    if(!inode){
+        printf("inode_restore: invalid inumber %d\n", inumber);
+        return;
+    }
+    write_lock_inode(inode);
+    inode->owner = owner;
+    inode->ownerPermissions = ownerPerm;
+    inode->othersPermissions = othersPerm;
+    inode->directory = owner != FREE_INODE && directory;
+    free_contents(&inode->contents);
+    unlock_inode(inode);
+}
+
+/*
+ * Restores an i-node whose file blocks are already in memory, taking
+ * over the blocks array. Same conditions as inode_restore.
+ */
+void inode_load(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory,
+                char** blocks, size_t blockCount, size_t size){
+    inode_restore(inumber, owner, ownerPerm, othersPerm, directory);
+    inode_t* inode = get_inode(inumber);
+    if(!inode){
+        free(blocks);
+        return;
+    }
+    write_lock_inode(inode);
+    inode->contents = (inode_contents) { blocks, blockCount, size };
+    unlock_inode(inode);
+}
+
+/*
+ * Makes every free i-node of the table the free list, lowest inumber
+ * on top. Must not run while i-nodes are being created or deleted.
+ */
+void inode_rebuild_free_list(){
+    int top = -1;
+    lock_inode_table();
+    for(int chunk = inode_chunk_count - 1; chunk >= 0; chunk--){
+        for(long i = chunk_size(chunk) - 1; i >= 0; i--){
+            if(inode_chunks[chunk][i].owner == FREE_INODE){
+                inode_chunks[chunk][i].nextFree = top;
+                top = chunk_start(chunk) + i;
+            }
+        }
+    }
+    __atomic_store_n(&inode_free_list, (uint32_t) (top + 1), __ATOMIC_RELEASE);
+    unlock_inode_table();
+}
+
+/*
+ * Calls visit on every i-node in use, in inumber order, while holding
+ * its read lock. Each i-node is seen as it was at some point of the
+ * traversal, not all of them at the same point.
+ */
+void inode_traverse(void (*visit)(int inumber, const inode_t* inode, void* arg), void* arg){
+    lock_inode_table();
+    int chunks = inode_chunk_count;
+    unlock_inode_table();
+    for(int chunk = 0; chunk < chunks; chunk++){
+        unsigned long size = chunk_size(chunk);
+        for(unsigned long i = 0; i < size; i++){
+            inode_t* inode = &inode_chunks[chunk][i];
+            read_lock_inode(inode);
+            if(inode->owner != FREE_INODE)
+                visit(chunk_start(chunk) + i, inode, arg);
+            unlock_inode(inode);
+        }
+    }
+}
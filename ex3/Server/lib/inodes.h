@@ -3,27 +3,66 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "blocks.h"
 #include "../../Client/tecnicofs-api-constants.h"
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
+#define INODE_CHUNK_SIZE 1024 // Chunk 0 holds this many i-nodes, chunk i > 0 holds INODE_CHUNK_SIZE << (i-1)
+#define MAX_INODE_CHUNKS 21 // Up to 2^30 i-nodes
+#define MAX_FILE_SIZE (1L << 36)
 
 
+/* File contents are kept in BLOCK_SIZE blocks, block i holding bytes
+ * [i * BLOCK_SIZE, (i+1) * BLOCK_SIZE). Missing blocks read as zeros,
+ * and so does everything past size in the blocks that exist. */
+typedef struct inode_contents {
+    char** blocks;
+    size_t blockSlots; // Length of blocks
+    size_t size;
+} inode_contents;
+
+struct directory_entries;
+
 typedef struct inode_t {
     uid_t owner;
     permission ownerPermissions;
     permission othersPermissions;
-    char* fileContent;
+    inode_contents contents;
+    int directory; // Set while the i-node is a directory, read without the lock when resolving paths
+    struct directory_entries* entries; // Of a directory, kept by ../directory.c
+    pthread_rwlock_t lock; // Readers of the same file share it, writers only block that file
+    int nextFree; // Next i-node of the free list, while this one is free
 } inode_t;
 
 
 void inode_table_init();
 void inode_table_destroy();
 int inode_create(uid_t owner, permission ownerPerm, permission othersPerm);
+int inode_create_directory(uid_t owner, permission ownerPerm, permission othersPerm);
 int inode_delete(int inumber);
+int inode_is_directory(int inumber);
+int inode_lock_directory(int inumber, int write, uid_t uid, permission access);
+void inode_unlock_directory(int inumber);
+void inode_delete_directory(int inumber);
+struct directory_entries* inode_directory_entries(int inumber);
+void inode_set_directory_entries(int inumber, struct directory_entries* entries);
 int inode_get(int inumber,uid_t *owner, permission *ownerPerm, permission *othersPerm,
                      char* fileContents, int len);
-int inode_set(int inumber, char *contents, int len);
+int inode_set(int inumber, const char *contents, int len);
+int inode_read(int inumber, char *buffer, int len, long offset);
+int inode_write(int inumber, const char *buffer, int len, long offset);
+int inode_append(int inumber, const char *buffer, int len);
+int inode_truncate(int inumber, long size);
+int inode_send(int inumber, int sock, int len, long offset, int (*start)(int length, struct iovec* header, void* arg),
+               void (*keep)(const char* data, size_t length, void* arg), void* arg);
+int inode_in_use(int inumber);
+void inode_restore(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory);
+void inode_load(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory,
+                char** blocks, size_t blockCount, size_t size);
+void inode_rebuild_free_list();
+void inode_traverse(void (*visit)(int inumber, const inode_t* inode, void* arg), void* arg);
 
 
 #endif /* INODES_H */
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "rcu.h"
+
+#define RCU_GENERATIONS 3 // Retired memory is safe two epochs after it was retired
+#define RCU_ADVANCE_THRESHOLD 64 // Retirements between attempts to advance the epoch
+#define CACHE_LINE_SIZE 64
+
+typedef struct rcu_batch {
+    void** ptrs;
+    void (**reclaims)(void*);
+    int count;
+    int capacity;
+    unsigned long epoch;
+} rcu_batch;
+
+typedef struct rcu_thread {
+    unsigned long state; // epoch << 1 | 1 while inside a read-side section, 0 otherwise
+    int nesting;
+    int retired;
+    int inUse;
+    rcu_batch limbo[RCU_GENERATIONS];
+    struct rcu_thread* next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) rcu_thread;
+
+static unsigned long globalEpoch = 1;
+static rcu_thread* threads = NULL; // Only ever grows, slots of finished threads are reused
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+static rcu_batch orphans; // Limbo of threads that exited, guarded by threadsLock
+static pthread_key_t threadKey;
+static __thread rcu_thread* self = NULL;
+
+static void batch_push(rcu_batch* batch, void* ptr, void (*reclaim)(void*)) {
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? 2 * batch->capacity : RCU_ADVANCE_THRESHOLD;
+        batch->ptrs = realloc(batch->ptrs, batch->capacity * sizeof(void*));
+        batch->reclaims = realloc(batch->reclaims, batch->capacity * sizeof(void (*)(void*)));
+        if (!batch->ptrs || !batch->reclaims) {
+            perror("rcu_retire: no memory for retired pointers");
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch->ptrs[batch->count] = ptr;
+    batch->reclaims[batch->count++] = reclaim;
+}
+
+static void batch_reclaim(rcu_batch* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        batch->reclaims[i](batch->ptrs[i]);
+    }
+    batch->count = 0;
+}
+
+static void batch_free(rcu_batch* batch) {
+    batch_reclaim(batch);
+    free(batch->ptrs);
+    free(batch->reclaims);
+    batch->ptrs = NULL;
+    batch->reclaims = NULL;
+    batch->capacity = 0;
+}
+
+/* Called by the thread key destructor when a registered thread exits.
+ * Its pending memory is handed over to the orphan batch. */
+static void unregister_thread(void* arg) {
+    rcu_thread* thread = arg;
+    if (pthread_mutex_lock(&threadsLock) != 0) {
+        perror("Failed to acquire the rcu threads lock.");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < RCU_GENERATIONS; i++) {
+        for (int j = 0; j < thread->limbo[i].count; j++) {
+            batch_push(&orphans, thread->limbo[i].ptrs[j], thread->limbo[i].reclaims[j]);
+        }
+        thread->limbo[i].count = 0;
+    }
+    orphans.epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    thread->retired = 0;
+    __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
+    thread->inUse = 0;
+    pthread_mutex_unlock(&threadsLock);
+    self = NULL;
+}
+
+static rcu_thread* register_thread() {
+    rcu_thread* thread;
+    if (pthread_mutex_lock(&threadsLock) != 0) {
+        perror("Failed to acquire the rcu threads lock.");
+        exit(EXIT_FAILURE);
+    }
+    for (thread = threads; thread && thread->inUse; thread = thread->next);
+    if (!thread) {
+        if (posix_memalign((void**) &thread, CACHE_LINE_SIZE, sizeof(rcu_thread)) != 0) {
+            perror("register_thread: no memory for a new thread");
+            exit(EXIT_FAILURE);
+        }
+        *thread = (rcu_thread) { 0 };
+        thread->next = threads;
+        __atomic_store_n(&threads, thread, __ATOMIC_RELEASE);
+    }
+    thread->inUse = 1;
+    pthread_mutex_unlock(&threadsLock);
+    if (pthread_setspecific(threadKey, thread) != 0) {
+        perror("Failed to register the rcu thread.");
+        exit(EXIT_FAILURE);
+    }
+    return thread;
+}
+
+static rcu_thread* rcu_self() {
+    if (!self)
+        self = register_thread();
+    return self;
+}
+
+/* The epoch moves forward only once every thread inside a read-side
+ * section has observed the current one. */
+static void try_advance() {
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (rcu_thread* t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        unsigned long state = __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+        if ((state & 1) && (state >> 1) != epoch)
+            return;
+    }
+    __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    if (pthread_mutex_trylock(&threadsLock) == 0) {
+        if (orphans.count > 0 && orphans.epoch + 2 <= epoch + 1)
+            batch_reclaim(&orphans);
+        pthread_mutex_unlock(&threadsLock);
+    }
+}
+
+void rcu_init() {
+    if (pthread_key_create(&threadKey, unregister_thread) != 0) {
+        perror("Failed to create the rcu thread key.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Reclaims everything still pending. Must only run once no
+ * other thread can be inside a read-side section. */
+void rcu_destroy() {
+    rcu_thread* thread = threads;
+    while (thread) {
+        rcu_thread* next = thread->next;
+        for (int i = 0; i < RCU_GENERATIONS; i++) {
+            batch_free(&thread->limbo[i]);
+        }
+        free(thread);
+        thread = next;
+    }
+    threads = NULL;
+    self = NULL;
+    batch_free(&orphans);
+    if (pthread_key_delete(threadKey) != 0) {
+        perror("Failed to delete the rcu thread key.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void rcu_read_lock() {
+    rcu_thread* thread = rcu_self();
+    if (thread->nesting++ == 0) {
+        unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&thread->state, epoch << 1 | 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void rcu_read_unlock() {
+    rcu_thread* thread = self;
+    if (--thread->nesting == 0)
+        __atomic_store_n(&thread->state, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_retire(void* ptr, void (*reclaim)(void* ptr)) {
+    rcu_thread* thread = rcu_self();
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    rcu_batch* batch = &thread->limbo[epoch % RCU_GENERATIONS];
+    if (batch->epoch != epoch) { // Left over from three or more epochs ago
+        batch_reclaim(batch);
+        batch->epoch = epoch;
+    }
+    batch_push(batch, ptr, reclaim);
+
+    if (++thread->retired >= RCU_ADVANCE_THRESHOLD) {
+        thread->retired = 0;
+        try_advance();
+        epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < RCU_GENERATIONS; i++) {
+            if (thread->limbo[i].count > 0 && thread->limbo[i].epoch + 2 <= epoch)
+                batch_reclaim(&thread->limbo[i]);
+        }
+    }
+}
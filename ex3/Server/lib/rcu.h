@@ -0,0 +1,16 @@
+#ifndef RCU_H
+#define RCU_H
+
+/* Epoch-based reclamation for structures read without locks.
+ * Readers bracket their accesses with rcu_read_lock/rcu_read_unlock,
+ * which only write to the calling thread's own slot. Writers unlink
+ * memory and hand it to rcu_retire, which reclaims it once every
+ * reader that could still hold a reference has left. */
+
+void rcu_init();
+void rcu_destroy();
+void rcu_read_lock();
+void rcu_read_unlock();
+void rcu_retire(void* ptr, void (*reclaim)(void* ptr));
+
+#endif /* RCU_H */
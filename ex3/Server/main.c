@@ -12,14 +12,37 @@
 #include <unistd.h>
 #include <sys/un.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include "fs.h"  
-#include "lib/hash.h" 
 #include "lib/inodes.h"
+#include "wal.h"
+#include "dump.h"
+#include "directory.h"
+#include "../Client/tecnicofs-protocol.h"
 
 #define MAX_INPUT_SIZE 100
 #define FILE_TABLE_SIZE 5
-
-struct ucred ucred;
+#define MAX_EVENTS 16 // Ready sockets taken from epoll per wakeup
+#define RECEIVE_SIZE (64 * 1024) // Bytes read from a client per wakeup
+#define ZERO_COPY_SIZE (64 * 1024) // Reads of at least this many bytes skip the response buffer
+
+typedef struct open_table_t {
+    permission file_perm;
+    int file_inumber;
+} open_table;
+
+typedef struct session {
+    int sock;
+    uid_t uid;
+    open_table file_table[FILE_TABLE_SIZE];
+    char* pending; // Start of a request not fully received yet
+    size_t pendingLength, pendingCapacity;
+    char* output; // Responses the socket didn't take yet, sent before any other
+    size_t outputSent, outputLength, outputCapacity;
+    int closing; // Unmounted, closed once its output is sent
+} session;
 
 extern int numberBuckets;
 
@@ -31,16 +54,23 @@ FILE *output;
 pthread_mutex_t condLock; // For the command vector access and iNumber obtainment
 pthread_cond_t cond;
 
+/* Serializes moving directories, so none is moved below itself by two
+ * renames that each checked before the other moved anything */
+static pthread_mutex_t moveLock = PTHREAD_MUTEX_INITIALIZER;
+
 struct timeval start, end; // gettimeofday struct variables
 
 //Command variables
 char socketname[MAX_INPUT_SIZE];
 char outputFile[MAX_INPUT_SIZE];
+char dataDirectory[MAX_INPUT_SIZE]; // Where the file system persists, nothing is kept when empty
 int acceptedClients = 0;
 int activeClients = 0;
+int shuttingDown = 0; // Set under condLock once termination started, no client is accepted after it
 int tecnicofs_fd;
 
-pthread_t tid[5];
+int epoll_fd;
+int numberWorkers;
 sigset_t sig_set;
 
 static void displayUsage (const char* appname){
@@ -49,10 +79,12 @@ static void displayUsage (const char* appname){
 }
 
 static void parseArgs (long argc, char* const argv[]){
-    if (argc == 4) {
+    if (argc == 4 || argc == 5) {
         strncpy(socketname, argv[1], MAX_INPUT_SIZE);
         strncpy(outputFile, argv[2], MAX_INPUT_SIZE);
         numberBuckets = atoi(argv[3]);
+        if (argc == 5)
+            strncpy(dataDirectory, argv[4], MAX_INPUT_SIZE - 1);
     } else {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
@@ -64,283 +96,864 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
-int responseClient(int sock, char* responseMessage, char* responseValue) {
-    int connectionCheck;
-    strncpy(responseMessage, responseValue, MAX_INPUT_SIZE);
-    if ((connectionCheck = send(sock, responseMessage, strlen(responseMessage), 0)) < 0) {
-        fprintf(stderr, "Error: Client connection failure.\n");
+/* Responses are gathered here while a client's requests are applied
+ * and sent in one go once every complete request was handled */
+static __thread char* replyBuffer;
+static __thread size_t replyLength, replyCapacity;
+
+/* Received bytes are read here, only the incomplete request left at
+ * the end of a read is copied into the client session */
+static __thread char receiveBuffer[RECEIVE_SIZE];
+
+static void reserveBuffer(char** buffer, size_t* capacity, size_t length) {
+    if (length <= *capacity)
+        return;
+    size_t newCapacity = *capacity ? *capacity : RECEIVE_SIZE;
+    while (newCapacity < length)
+        newCapacity *= 2;
+    if (!(*buffer = realloc(*buffer, newCapacity))) {
+        perror("Failed to allocate client buffer");
         exit(EXIT_FAILURE);
     }
+    *capacity = newCapacity;
+}
+
+/* Queues the header and status of a response followed by dataLength
+ * bytes of data, which the caller appends or sends itself */
+static void responseHeader(tfs_header* request, int status, size_t dataLength) {
+    tfs_header header;
+    tfs_status response;
+
+    memset(&header, 0, sizeof(header));
+    header.opcode = request->opcode;
+    header.requestId = request->requestId;
+    header.payloadLength = sizeof(response) + dataLength;
+    response.status = status;
+
+    reserveBuffer(&replyBuffer, &replyCapacity, replyLength + sizeof(header) + sizeof(response));
+    memcpy(replyBuffer + replyLength, &header, sizeof(header));
+    memcpy(replyBuffer + replyLength + sizeof(header), &response, sizeof(response));
+    replyLength += sizeof(header) + sizeof(response);
+}
+
+void responseClient(tfs_header* request, int status, const char* data, size_t dataLength) {
+    responseHeader(request, status, dataLength);
+    if (dataLength > 0) {
+        reserveBuffer(&replyBuffer, &replyCapacity, replyLength + dataLength);
+        memcpy(replyBuffer + replyLength, data, dataLength);
+        replyLength += dataLength;
+    }
+}
+
+/* Keeps bytes the client's socket can't take now, after those it is
+ * already waiting to send */
+static void keepOutput(session* client, const char* data, size_t length) {
+    reserveBuffer(&client->output, &client->outputCapacity, client->outputLength + length);
+    memcpy(client->output + client->outputLength, data, length);
+    client->outputLength += length;
+}
+
+/* Sends as much as the socket takes without blocking, keeping the rest
+ * unless it already has output waiting, which must go first.
+ * Returns -1 if the client connection failed. */
+static int sendOutput(session* client, const char* data, size_t length) {
+    size_t sent = 0;
+    if (client->outputLength > 0) {
+        keepOutput(client, data, length);
+        return 0;
+    }
+    while (sent < length) {
+        ssize_t written = send(client->sock, data + sent, length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            keepOutput(client, data + sent, length - sent);
+            break;
+        }
+        sent += written;
+    }
+    return 0;
+}
+
+/* Sends what the client's socket didn't take before, freeing it once
+ * it is all gone so idle clients hold no buffer.
+ * Returns -1 if the client connection failed. */
+static int drainOutput(session* client) {
+    while (client->outputSent < client->outputLength) {
+        ssize_t written = send(client->sock, client->output + client->outputSent,
+                               client->outputLength - client->outputSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        client->outputSent += written;
+    }
+    free(client->output);
+    client->output = NULL;
+    client->outputSent = client->outputLength = client->outputCapacity = 0;
     return 0;
 }
 
-void* applyCommands(void* sockfd){  
+/* Sends every response queued while serving a client, once the
+ * changes they acknowledge are durable. What the socket doesn't take
+ * waits in the client session for it to become writable. */
+static int flushReplies(session* client) {
+    wal_commit();
+    int err = sendOutput(client, replyBuffer, replyLength);
+    replyLength = 0;
+    return err;
+}
 
-    if (pthread_sigmask(SIG_UNBLOCK, &sig_set, NULL) != 0) {
-        fprintf(stderr, "Error: Sigmask failed.\n");
+typedef struct read_response {
+    session* client;
+    tfs_header* request;
+} read_response;
+
+/* Gives inode_send the header of a read to send in front of its data,
+ * or has both wait in the session if the socket is backed up. The
+ * responses before it were flushed already, so the header is alone in
+ * the responses, which are left empty: nothing is queued before
+ * inode_send is done with it. */
+static int startReadResponse(int length, struct iovec* header, void* arg) {
+    read_response* response = arg;
+    responseHeader(response->request, length, length);
+    header->iov_base = replyBuffer;
+    header->iov_len = replyLength;
+    replyLength = 0;
+    return response->client->outputLength > 0;
+}
+
+/* Keeps the data of a read the socket didn't take */
+static void keepReadData(const char* data, size_t length, void* arg) {
+    read_response* response = arg;
+    keepOutput(response->client, data, length);
+}
+
+/* Answers a read of len bytes at offset. Large reads are sent straight
+ * from the file blocks, after the responses before them are committed
+ * and sent, which mustn't happen while the file is locked. Small ones
+ * are read into the responses so they still share a single write
+ * with them.
+ * Returns -1 if the client connection failed. */
+static int readFile(session* client, tfs_header* header, int inumber, int len, long offset) {
+    int readLength;
+
+    if (len >= ZERO_COPY_SIZE) {
+        read_response response = { client, header };
+        if (flushReplies(client) != 0)
+            return -1;
+        if ((readLength = inode_send(inumber, client->sock, len, offset, startReadResponse, keepReadData, &response)) == -1)
+            responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+        return readLength == -2 ? -1 : 0;
+    }
+
+    size_t start = replyLength;
+    reserveBuffer(&replyBuffer, &replyCapacity, start + sizeof(tfs_header) + sizeof(tfs_status) + len);
+    if ((readLength = inode_read(inumber, replyBuffer + start + sizeof(tfs_header) + sizeof(tfs_status), len, offset)) == -1) {
+        responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+        return 0;
+    }
+    responseHeader(header, readLength, readLength); // Written in front of the data already in place
+    replyLength += readLength;
+    return 0;
+}
+
+/* Copies a name out of a request payload and '\0' terminates it */
+static int getName(char* name, const char* payload, size_t length) {
+    if (length == 0 || length > TFS_MAX_NAME_SIZE || memchr(payload, '\0', length))
+        return -1;
+    memcpy(name, payload, length);
+    name[length] = '\0';
+    return 0;
+}
+
+/* Administration commands are only allowed to the server's own user */
+static int isAdmin(session* client) {
+    return client->uid == 0 || client->uid == getuid();
+}
+
+/* Returns the open file behind a descriptor sent by the client,
+ * or NULL if the descriptor is out of range */
+static open_table* getFile(session* client, int32_t fd) {
+    if (fd < 0 || fd >= FILE_TABLE_SIZE)
+        return NULL;
+    return &client->file_table[fd];
+}
+
+/* Returns the open file behind a descriptor if it was opened for
+ * the access wanted (READ or WRITE), otherwise responds with the
+ * error and returns NULL */
+static open_table* getOpenFile(session* client, tfs_header* header, int32_t fd, permission access) {
+    open_table* file = getFile(client, fd);
+
+    if (!file) {
+        responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+        return NULL;
+    }
+    if (file->file_inumber == -1) {
+        responseClient(header, TECNICOFS_ERROR_FILE_NOT_OPEN, NULL, 0);
+        return NULL;
+    }
+    if (access == READ && file->file_perm < READ) {
+        responseClient(header, TECNICOFS_ERROR_INVALID_MODE, NULL, 0);
+        return NULL;
+    }
+    if (access == WRITE && file->file_perm != WRITE && file->file_perm != RW) {
+        responseClient(header, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+        return NULL;
+    }
+    return file;
+}
+
+/* Locks a directory while the client uses its entries, with the access
+ * it needs to the directory. The directory was found through its key without
+ * locks, so it may have been deleted and its inumber reused since: the
+ * key must still lead to it once it is locked, after which it can't
+ * go away. The root has no i-node and takes no lock. */
+static int lockDirectory(session* client, int directory, const char* directoryKey, permission access) {
+    int err;
+
+    if (directory == ROOT_DIRECTORY)
+        return 0;
+    if ((err = inode_lock_directory(directory, 0, client->uid, access)) != 0)
+        return err;
+    if (lookup(fs, (char*) directoryKey) != directory) {
+        inode_unlock_directory(directory);
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
     }
+    return 0;
+}
+
+static void unlockDirectory(int directory) {
+    if (directory != ROOT_DIRECTORY)
+        inode_unlock_directory(directory);
+}
+
+/* Locks both directories of a rename in inumber order */
+static int lockDirectories(session* client, int directory, const char* directoryKey,
+                           int otherDirectory, const char* otherDirectoryKey) {
+    int swap = otherDirectory < directory;
+    int first = swap ? otherDirectory : directory, second = swap ? directory : otherDirectory;
+    int err = lockDirectory(client, first, swap ? otherDirectoryKey : directoryKey, WRITE);
+
+    if (err != 0 || second == first)
+        return err;
+    if ((err = lockDirectory(client, second, swap ? directoryKey : otherDirectoryKey, WRITE)) != 0)
+        unlockDirectory(first);
+    return err;
+}
+
+static void unlockDirectories(int directory, int otherDirectory) {
+    unlockDirectory(directory);
+    if (otherDirectory != directory)
+        unlockDirectory(otherDirectory);
+}
+
+/* The entries of a locked directory change with its names, under the
+ * directory's entries lock. Names at the root have no entries and only
+ * wait for each other in their buckets. */
+static void lockEntries(int directory) {
+    if (directory != ROOT_DIRECTORY)
+        directory_lock(inode_directory_entries(directory));
+}
 
-    typedef struct open_table_t {
-        permission file_perm;
-        int file_inumber;
-    }open_table;
+static void unlockEntries(int directory) {
+    if (directory != ROOT_DIRECTORY)
+        directory_unlock(inode_directory_entries(directory));
+}
+
+/* Takes the entries locks of both directories of a rename, in the order
+ * their i-node locks were taken */
+static void lockEntriesPair(int directory, int otherDirectory) {
+    lockEntries(directory < otherDirectory ? directory : otherDirectory);
+    if (otherDirectory != directory)
+        lockEntries(directory < otherDirectory ? otherDirectory : directory);
+}
+
+static void unlockEntriesPair(int directory, int otherDirectory) {
+    unlockEntries(directory);
+    if (otherDirectory != directory)
+        unlockEntries(otherDirectory);
+}
+
+static void addEntry(int directory, const char* key, int iNumber) {
+    if (directory != ROOT_DIRECTORY)
+        directory_add(inode_directory_entries(directory), strchr(key, '/') + 1, iNumber);
+}
+
+static void removeEntry(int directory, const char* key) {
+    if (directory != ROOT_DIRECTORY)
+        directory_remove(inode_directory_entries(directory), strchr(key, '/') + 1);
+}
 
-    open_table file_table[5];
+static int createFile(session* client, char* path, permission ownerPerms, permission otherPerms, int directory) {
+    char key[TFS_MAX_NAME_SIZE + 1], parentKey[TFS_MAX_NAME_SIZE + 1];
+    int parent, iNumber, err;
+
+    if ((err = resolve_path(fs, path, &parent, key, parentKey)) != 0 ||
+        (err = lockDirectory(client, parent, parentKey, WRITE)) != 0)
+        return err;
+
+    lockEntries(parent);
+    if (lookup(fs, key) != -1)
+        err = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+    else if ((iNumber = directory ? inode_create_directory(client->uid, ownerPerms, otherPerms)
+                                  : inode_create(client->uid, ownerPerms, otherPerms)) == -1)
+        err = TECNICOFS_ERROR_OTHER;
+    else {
+        if (directory)
+            inode_set_directory_entries(iNumber, directory_new());
+        create(fs, key, iNumber);
+        addEntry(parent, key, iNumber);
+    }
+    unlockEntries(parent);
 
-    int sock = *(int*)sockfd;
+    unlockDirectory(parent);
+    return err;
+}
 
+/* Deletes the directory named key in parent if it is empty. It is
+ * locked before the entries of parent, like every i-node lock, and
+ * stays locked from the check until it is free, so nothing is created
+ * in it meanwhile. */
+static int deleteDirectory(int parent, char* key, int iNumber) {
+    int err;
+
+    if ((err = inode_lock_directory(iNumber, 1, 0, NONE)) != 0)
+        return err;
+    lockEntries(parent);
+    if (lookup(fs, key) != iNumber)
+        err = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    else if (directory_count(inode_directory_entries(iNumber)) > 0)
+        err = TECNICOFS_ERROR_DIRECTORY_NOT_EMPTY;
+    else if (delete(fs, key) != 0)
+        err = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    else
+        removeEntry(parent, key);
+    unlockEntries(parent);
+
+    if (err != 0) {
+        inode_unlock_directory(iNumber);
+        return err;
+    }
+    directory_entries* entries = inode_directory_entries(iNumber);
+    inode_set_directory_entries(iNumber, NULL);
+    inode_delete_directory(iNumber);
+    directory_free(entries);
+    return 0;
+}
+
+static int deleteFile(session* client, char* path) {
+    char key[TFS_MAX_NAME_SIZE + 1], parentKey[TFS_MAX_NAME_SIZE + 1];
+    int parent, iNumber, err;
+    uid_t owner;
+
+    if ((err = resolve_path(fs, path, &parent, key, parentKey)) != 0 ||
+        (err = lockDirectory(client, parent, parentKey, WRITE)) != 0)
+        return err;
+
+    if ((iNumber = lookup(fs, key)) == -1)
+        err = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    else if (inode_get(iNumber, &owner, NULL, NULL, NULL, 0) == -1)
+        err = TECNICOFS_ERROR_OTHER;
+    else if (owner != client->uid)
+        err = TECNICOFS_ERROR_PERMISSION_DENIED;
+    else if (inode_is_directory(iNumber))
+        err = deleteDirectory(parent, key, iNumber);
+    else {
+        lockEntries(parent);
+        // The name goes first, so a crash in between leaves no name of a free i-node
+        if (lookup(fs, key) != iNumber || delete(fs, key) != 0)
+            err = TECNICOFS_ERROR_FILE_NOT_FOUND;
+        else
+            removeEntry(parent, key);
+        unlockEntries(parent);
+        if (err == 0 && inode_delete(iNumber) == -1)
+            err = TECNICOFS_ERROR_OTHER;
+    }
+
+    unlockDirectory(parent);
+    return err;
+}
+
+static int renameFile(session* client, char* oldPath, char* newPath) {
+    char oldKey[TFS_MAX_NAME_SIZE + 1], newKey[TFS_MAX_NAME_SIZE + 1];
+    char oldParentKey[TFS_MAX_NAME_SIZE + 1], newParentKey[TFS_MAX_NAME_SIZE + 1];
+    int oldParent, newParent, iNumber, directory, err;
     uid_t owner;
     permission ownerPerms;
     permission otherPerms;
-    char fileContents[MAX_INPUT_SIZE];
-    
-    char token, client_message[MAX_INPUT_SIZE], return_message[MAX_INPUT_SIZE];
-    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
- 
-    int iNumber, fileInTable, readSize;
 
-    for (int i = 0; i < 5; i++) {
-        file_table[i].file_perm = NONE;
-        file_table[i].file_inumber = -1;
+    if ((err = resolve_path(fs, oldPath, &oldParent, oldKey, oldParentKey)) != 0)
+        return err;
+    iNumber = lookup(fs, oldKey);
+    directory = iNumber != -1 && inode_is_directory(iNumber);
+
+    if (directory)
+        pthread_mutex_lock(&moveLock);
+    if ((err = resolve_path(fs, newPath, &newParent, newKey, newParentKey)) == 0 &&
+        (err = lockDirectories(client, oldParent, oldParentKey, newParent, newParentKey)) == 0) {
+        lockEntriesPair(oldParent, newParent);
+        if (directory && path_crosses(fs, newPath, iNumber))
+            err = TECNICOFS_ERROR_OTHER;
+        else if ((err = renameNode(fs, oldKey, newKey)) == 0) {
+            removeEntry(oldParent, oldKey);
+            addEntry(newParent, newKey, lookup(fs, newKey));
+        }
+        unlockEntriesPair(oldParent, newParent);
+        unlockDirectories(oldParent, newParent);
     }
-    while(1){
-        memset(client_message, 0, sizeof(client_message));
-        if ((readSize = recv(sock, client_message, sizeof(client_message)-1, 0)) < 0) { // -1 for \0 in case buffer fills
-            fprintf(stderr, "Error: Client connection failure.\n");
-            exit(EXIT_FAILURE);
-        } else if (strncmp(client_message, "f", 2) == 0) {
-            break;
+    if (directory)
+        pthread_mutex_unlock(&moveLock);
+    if (err != 0)
+        return err;
+
+    inode_get(iNumber, &owner, &ownerPerms, &otherPerms, NULL, 0);
+
+    if (owner != client->uid)
+        return TECNICOFS_ERROR_PERMISSION_DENIED;
+
+    if (directory) // Its entries are keyed by its inumber
+        return 0;
+
+    if (inode_delete(iNumber) == -1)
+        return TECNICOFS_ERROR_OTHER;
+
+    if (inode_create(client->uid, ownerPerms, otherPerms) == -1)
+        return TECNICOFS_ERROR_OTHER;
+
+    return 0;
+}
+
+typedef struct directory_listing {
+    char* names; // Each '\0' terminated
+    size_t length, capacity, maxLength;
+    int count;
+} directory_listing;
+
+static void listEntry(const char* name, int inumber, void* arg) {
+    directory_listing* listing = arg;
+    size_t nameLength = strlen(name) + 1;
+
+    if (listing->length + nameLength > listing->maxLength)
+        return;
+    reserveBuffer(&listing->names, &listing->capacity, listing->length + nameLength);
+    memcpy(listing->names + listing->length, name, nameLength);
+    listing->length += nameLength;
+    listing->count++;
+}
+
+/* Answers with the names in a directory the client may read, as many
+ * whole names as fit in maxLength bytes */
+static void listDirectory(session* client, tfs_header* header, char* path, size_t maxLength) {
+    char key[TFS_MAX_NAME_SIZE + 1];
+    directory_listing listing = { NULL, 0, 0, maxLength, 0 };
+    int parent, directory = ROOT_DIRECTORY, err = 0;
+
+    if (strcmp(path, "/") != 0) {
+        if ((err = resolve_path(fs, path, &parent, key, NULL)) == 0 && (directory = lookup(fs, key)) == -1)
+            err = TECNICOFS_ERROR_FILE_NOT_FOUND;
+        if (err == 0)
+            err = lockDirectory(client, directory, key, READ);
+        if (err != 0) {
+            responseClient(header, err, NULL, 0);
+            return;
         }
-        client_message[readSize] = '\0';
-        sscanf(client_message, "%c %s %s", &token, arg1, arg2); 
-        int bucketIndex = hash(arg1, numberBuckets);
-        int freeIndex = -1;
-        switch (token) {
-            case 'c':
-
-                iNumber = lookup(fs, arg1, bucketIndex);
-                
-                if (iNumber != -1) {
-                    responseClient(sock, return_message, "-4");
-                    break;
-                }
+    }
 
-                if ((iNumber =  inode_create(ucred.uid, arg2[0], arg2[1])) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
-                
-                create(fs, arg1, iNumber, bucketIndex);
-                responseClient(sock, return_message, "0");
-                
-                break;
+    if (directory == ROOT_DIRECTORY)
+        list_root(fs, listEntry, &listing);
+    else
+        directory_list(inode_directory_entries(directory), listEntry, &listing);
+    unlockDirectory(directory);
+    responseClient(header, listing.count, listing.names, listing.length);
+    free(listing.names);
+}
 
-            case 'd': {
-                iNumber = lookup(fs, arg1, bucketIndex);
+/* Applies one request received from a client to the file system
+ * and queues the result to be sent back. Returns -1 if the client
+ * connection failed while answering. */
+int applyCommands(session* client, tfs_header* header, const char* payload){
 
-                if (iNumber == -1) {
-                    responseClient(sock, return_message, "-5");
-                    break;
-                }
+    open_table* file_table = client->file_table;
+    open_table* file;
 
-                if (inode_get(iNumber, &owner, &ownerPerms, &otherPerms, fileContents, strlen(fileContents)) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
+    uid_t owner;
+    permission ownerPerms;
+    permission otherPerms;
 
-                if ((owner != ucred.uid)) {
-                    responseClient(sock, return_message, "-6");
-                    break;
-                }
+    char arg1[TFS_MAX_NAME_SIZE + 1], arg2[TFS_MAX_NAME_SIZE + 1];
+    size_t length = header->payloadLength;
+ 
+    int iNumber, fileInTable;
 
-                if (inode_delete(iNumber) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
+    int freeIndex = -1;
+    switch (header->opcode) {
+        case TFS_OP_CREATE:
+        case TFS_OP_MKDIR: {
+            tfs_create_args args;
+
+            if (length < sizeof(args) || getName(arg1, payload + sizeof(args), length - sizeof(args)) != 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+
+            responseClient(header, createFile(client, arg1, args.ownerPermissions, args.othersPermissions, header->opcode == TFS_OP_MKDIR), NULL, 0);
+            
+            break;
+        }
+        case TFS_OP_CREATE_MANY: {
+            tfs_create_many_args args;
+            int32_t* results;
+            int created = 0;
+            size_t offset = sizeof(args);
+
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            // Every name takes at least its length and one character
+            if (args.count == 0 || args.count > (length - sizeof(args)) / (sizeof(uint16_t) + 1)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            if (!(results = malloc(args.count * sizeof(int32_t)))) {
+                perror("Failed to allocate batch results");
+                exit(EXIT_FAILURE);
+            }
+            for (uint32_t i = 0; i < args.count; i++) {
+                uint16_t nameLength;
+                if (length - offset < sizeof(nameLength)) {
+                    results[i] = TECNICOFS_ERROR_OTHER;
+                    continue;
+                }
+                memcpy(&nameLength, payload + offset, sizeof(nameLength));
+                offset += sizeof(nameLength);
+                if (nameLength > length - offset || getName(arg1, payload + offset, nameLength) != 0) {
+                    results[i] = TECNICOFS_ERROR_OTHER;
+                    offset = length;
+                    continue;
                 }
-                delete(fs, arg1, bucketIndex);
+                offset += nameLength;
+                if ((results[i] = createFile(client, arg1, args.ownerPermissions, args.othersPermissions, 0)) == 0)
+                    created++;
+            }
 
-                responseClient(sock, return_message, "0");
+            responseClient(header, created, (char*) results, args.count * sizeof(int32_t));
+            free(results);
 
+            break;
+        }
+        case TFS_OP_DELETE: {
+            if (getName(arg1, payload, length) != 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
                 break;
             }
-            case 'r': {
 
-                int errorCheck;
-                char errorToString[3];
+            responseClient(header, deleteFile(client, arg1), NULL, 0);
 
-                iNumber = lookup(fs, arg1, bucketIndex);
-                errorCheck = renameNode(fs, arg1, arg2, bucketIndex);
+            break;
+        }
+        case TFS_OP_RENAME: {
+            tfs_rename_args args;
 
-                if (errorCheck != 0) {
-                    snprintf(errorToString, 3, "%d", errorCheck);
-                    responseClient(sock, return_message, errorToString);
-                    break;
-                }   
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (args.oldNameLength > length - sizeof(args) ||
+                getName(arg1, payload + sizeof(args), args.oldNameLength) != 0 ||
+                getName(arg2, payload + sizeof(args) + args.oldNameLength, length - sizeof(args) - args.oldNameLength) != 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
 
-                inode_get(iNumber, &owner, &ownerPerms, &otherPerms, fileContents, strlen(fileContents));
-                
-                if  (owner != ucred.uid) {
-                    responseClient(sock, return_message, "-6");
-                    break;
-                }
+            responseClient(header, renameFile(client, arg1, arg2), NULL, 0);
+            
+            break;
+        }
+        case TFS_OP_OPEN: {
+            tfs_open_args args;
+            char key[TFS_MAX_NAME_SIZE + 1];
+            int parent, err;
 
-                if (inode_delete(iNumber) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
-                
-                if (inode_create(ucred.uid, ownerPerms, otherPerms) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
+            if (length < sizeof(args) || getName(arg1, payload + sizeof(args), length - sizeof(args)) != 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
 
-                responseClient(sock, return_message, "0");
-                
+            if ((err = resolve_path(fs, arg1, &parent, key, NULL)) != 0) {
+                responseClient(header, err, NULL, 0);
                 break;
             }
-            case 'o': {
 
-                iNumber = lookup(fs, arg1, bucketIndex);
+            iNumber = lookup(fs, key);
 
-                if (iNumber == -1) {
-                    responseClient(sock, return_message, "-5");
-                    break;
-                }
+            if (iNumber == -1) {
+                responseClient(header, TECNICOFS_ERROR_FILE_NOT_FOUND, NULL, 0);
+                break;
+            }
 
-                if (inode_get(iNumber, &owner, &ownerPerms, &otherPerms, fileContents, strlen(fileContents)) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
+            if (inode_is_directory(iNumber)) {
+                responseClient(header, TECNICOFS_ERROR_IS_A_DIRECTORY, NULL, 0);
+                break;
+            }
+
+            if (inode_get(iNumber, &owner, &ownerPerms, &otherPerms, NULL, 0) == -1) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
 
-                fileInTable = 0;
+            fileInTable = 0;
 
-                for (int i = 0; i < 5; i++) {
-                    if (file_table[i].file_inumber == iNumber) { 
-                        responseClient(sock, return_message, "-9");
-                        fileInTable = 1;
-                        break; 
-                    }
+            for (int i = 0; i < FILE_TABLE_SIZE; i++) {
+                if (file_table[i].file_inumber == iNumber) { 
+                    responseClient(header, TECNICOFS_ERROR_FILE_IS_OPEN, NULL, 0);
+                    fileInTable = 1;
+                    break; 
                 }
-                if (fileInTable == 1) {
+            }
+            if (fileInTable == 1) {
+                break;
+            }
+            for (int j = 0; j < FILE_TABLE_SIZE; j++) {
+                if (file_table[j].file_inumber == -1) { 
+                    freeIndex = j;
                     break;
                 }
-                for (int j = 0; j < 5; j++) {
-                    if (file_table[j].file_inumber == -1) { 
-                        freeIndex = j;
+            }
+            if (freeIndex == -1) {
+                responseClient(header, TECNICOFS_ERROR_MAXED_OPEN_FILES, NULL, 0);
+                break;
+            }
+            if (owner == client->uid) {
+                if (args.mode > ownerPerms || (args.mode == WRITE && ownerPerms == READ)) {
+                        responseClient(header, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
                         break;
-                    }
-                }
-                if (freeIndex == -1) {
-                    responseClient(sock, return_message, "-7");
-                    break;
-                }
-                if (owner == ucred.uid) {
-                    if (atoi(arg2) > ownerPerms || (atoi(arg2) == WRITE && ownerPerms == READ)) {
-                            responseClient(sock, return_message, "-6");
-                            break;
-                        } 
-                } else if (atoi(arg2) > otherPerms || (atoi(arg2) == WRITE && otherPerms == READ)) {
-                    responseClient(sock, return_message, "-6");
-                    break;
-                }
-                
+                    } 
+            } else if (args.mode > otherPerms || (args.mode == WRITE && otherPerms == READ)) {
+                responseClient(header, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+                break;
+            }
+            
 
-                file_table[freeIndex].file_perm = atoi(arg2);
-                file_table[freeIndex].file_inumber = iNumber;
-                
-                char fdReturn[2];
-                snprintf(fdReturn, 2, "%d", freeIndex);
+            file_table[freeIndex].file_perm = args.mode;
+            file_table[freeIndex].file_inumber = iNumber;
 
-                responseClient(sock, return_message, fdReturn);
+            responseClient(header, freeIndex, NULL, 0);
+
+            break;
+        }
+        case TFS_OP_CLOSE: {
+            tfs_fd_args args;
 
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (!(file = getFile(client, args.fd))) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            if (file->file_inumber == -1) {
+                responseClient(header, TECNICOFS_ERROR_FILE_NOT_OPEN, NULL, 0);
                 break;
             }
-            case 'x': {
 
-                if (file_table[atoi(arg1)].file_inumber == -1) {
-                    responseClient(sock, return_message, "-8");
-                    break;
-                }
-                if (atoi(arg1) > 4) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
+            file->file_inumber = -1;
+            file->file_perm = NONE;
 
-                file_table[atoi(arg1)].file_inumber = -1;
-                file_table[atoi(arg1)].file_perm = NONE;
+            responseClient(header, 0, NULL, 0);
 
-                responseClient(sock, return_message, "0");
+            break;
+        }
+        case TFS_OP_READ: {
+            tfs_io_args args;
 
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
                 break;
             }
-            case 'l': {
-                if (file_table[atoi(arg1)].file_inumber == -1) {
-                    responseClient(sock, return_message, "-8");
-                    break;
-                }
-                if (file_table[atoi(arg1)].file_perm < 2) {
-                    responseClient(sock, return_message, "-10");
-                    break;
-                }
-                if (inode_get(file_table[atoi(arg1)].file_inumber, &owner, &ownerPerms, &otherPerms, fileContents, atoi(arg2)) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
-                
-                responseClient(sock, return_message, fileContents);
+            memcpy(&args, payload, sizeof(args));
+            if (args.len < 0 || args.len > TFS_MAX_PAYLOAD_SIZE - sizeof(tfs_status)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            if (!(file = getOpenFile(client, header, args.fd, READ)))
+                break;
+
+            return readFile(client, header, file->file_inumber, args.len, 0);
+        }
+        case TFS_OP_WRITE: {
+            tfs_fd_args args;
 
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
                 break;
             }
-            case 'w': {
+            memcpy(&args, payload, sizeof(args));
+            if (!(file = getOpenFile(client, header, args.fd, WRITE)))
+                break;
 
-                char buff[MAX_INPUT_SIZE];
-                int nullTerminatorIndex;
+            if (inode_set(file->file_inumber, payload + sizeof(args), length - sizeof(args)) == -1) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
 
-                for (int i = 0, j = 4; i < strlen(client_message) - 4; i++, j++) { // Getting the client message without the "w %d " part
-                    buff[i] = client_message[j];
-                    nullTerminatorIndex = i + 1;
-                }
+            responseClient(header, 0, NULL, 0);
 
-                buff[nullTerminatorIndex] = '\0';
-                fileInTable = 0;
+            break;
+        }
+        case TFS_OP_READ_AT: {
+            tfs_read_at_args args;
 
-                if (file_table[atoi(arg1)].file_inumber != -1) {
-                    fileInTable = 1;
-                }
-                
-                if (fileInTable == 0) {
-                    responseClient(sock, return_message, "-8");
-                    break;
-                }
-                if ((file_table[atoi(arg1)].file_perm != 1) && (file_table[atoi(arg1)].file_perm != 3)) {
-                    responseClient(sock, return_message, "-6");
-                    break;
-                }
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (args.len < 0 || args.len > TFS_MAX_PAYLOAD_SIZE - sizeof(tfs_status) || args.offset < 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            if (!(file = getOpenFile(client, header, args.fd, READ)))
+                break;
 
-                if (inode_set(file_table[atoi(arg1)].file_inumber, buff, strlen(buff)) == -1) {
-                    responseClient(sock, return_message, "-11");
-                    break;
-                }
+            return readFile(client, header, file->file_inumber, args.len, args.offset);
+        }
+        case TFS_OP_WRITE_AT: {
+            tfs_write_at_args args;
+            int written;
 
-                responseClient(sock, return_message, "0");
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (!(file = getOpenFile(client, header, args.fd, WRITE)))
+                break;
 
+            if ((written = inode_write(file->file_inumber, payload + sizeof(args), length - sizeof(args), args.offset)) == -1) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
                 break;
             }
-            default: { 
-                fprintf(stderr, "Error: command to apply\n");
-                exit(EXIT_FAILURE);
+
+            responseClient(header, written, NULL, 0);
+
+            break;
+        }
+        case TFS_OP_APPEND: {
+            tfs_fd_args args;
+            int written;
+
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (!(file = getOpenFile(client, header, args.fd, WRITE)))
+                break;
+
+            if ((written = inode_append(file->file_inumber, payload + sizeof(args), length - sizeof(args))) == -1) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+
+            responseClient(header, written, NULL, 0);
+
+            break;
+        }
+        case TFS_OP_TRUNCATE: {
+            tfs_truncate_args args;
+
+            if (length < sizeof(args)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (!(file = getOpenFile(client, header, args.fd, WRITE)))
+                break;
+
+            if (inode_truncate(file->file_inumber, args.size) == -1) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
             }
+
+            responseClient(header, 0, NULL, 0);
+
+            break;
+        }
+        case TFS_OP_READDIR: {
+            tfs_readdir_args args;
+
+            if (length < sizeof(args) || getName(arg1, payload + sizeof(args), length - sizeof(args)) != 0) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(&args, payload, sizeof(args));
+            if (args.len < 0 || args.len > TFS_MAX_PAYLOAD_SIZE - sizeof(tfs_status)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+
+            listDirectory(client, header, arg1, args.len);
+
+            break;
+        }
+        case TFS_OP_SET_DELAY: {
+            if (!isAdmin(client)) {
+                responseClient(header, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+                break;
+            }
+            if (length > TFS_MAX_NAME_SIZE || memchr(payload, '\0', length)) {
+                responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
+                break;
+            }
+            memcpy(arg1, payload, length);
+            arg1[length] = '\0';
+
+            responseClient(header, delay_configure(arg1) == 0 ? 0 : TECNICOFS_ERROR_OTHER, NULL, 0);
+
+            break;
+        }
+        case TFS_OP_STATS: {
+            if (!isAdmin(client)) {
+                responseClient(header, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+                break;
+            }
+            size_t reportLength;
+            char* report = stats_report(fs, &reportLength);
+
+            responseClient(header, 0, report, reportLength);
+            free(report);
+
+            break;
+        }
+        default: { 
+            responseClient(header, TECNICOFS_ERROR_OTHER, NULL, 0);
         }
-    } 
-    for (int i = 0; i < 5; i++) { // Releasing the client's file table.
-        file_table[i].file_perm = NONE;
-        file_table[i].file_inumber = -1;
     }
+    return 0;
+}
 
-    if (close(*(int*)sockfd) != 0) {
+void closeClient(session* client) {
+    if (close(client->sock) != 0) { // Closing also removes the socket from the epoll set
         fprintf(stderr, "Error: Close failed.\n");
         exit(EXIT_FAILURE);
     }
+    free(client->pending);
+    free(client->output);
+    free(client);
 
     if (pthread_mutex_lock(&condLock) != 0) {
         fprintf(stderr, "Error: mutex\n");
@@ -357,6 +970,200 @@ void* applyCommands(void* sockfd){
         fprintf(stderr, "Error: mutex\n");
         exit(EXIT_FAILURE);
     }
+}
+
+/* Registers (or re-registers) a socket in the epoll set, waiting for
+ * events. Sockets are armed for a single event, so each one is served
+ * by at most one worker at a time and must be re-armed once that
+ * worker is done. */
+void armSocket(int sock, void* data, int op, uint32_t events) {
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = data;
+    if (epoll_ctl(epoll_fd, op, sock, &event) != 0) {
+        fprintf(stderr, "Error: Epoll control failed.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void acceptClients() {
+    int connectSocket_fd;
+    while ((connectSocket_fd = accept4(tecnicofs_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        if (pthread_mutex_lock(&condLock) != 0) {
+            fprintf(stderr, "Error: Mutex lock failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (shuttingDown) { // Left queued when termination stopped accepting
+            if (pthread_mutex_unlock(&condLock) != 0) {
+                fprintf(stderr, "Error: Mutex unlock failed\n");
+                exit(EXIT_FAILURE);
+            }
+            close(connectSocket_fd);
+            return;
+        }
+        acceptedClients++;
+        activeClients++;
+        if (pthread_mutex_unlock(&condLock) != 0) {
+            fprintf(stderr, "Error: Mutex unlock failed\n");
+            exit(EXIT_FAILURE);
+        }
+
+        session* client = malloc(sizeof(session));
+        if (!client) {
+            perror("Failed to allocate client session");
+            exit(EXIT_FAILURE);
+        }
+        struct ucred ucred;
+        socklen_t len = sizeof(struct ucred);
+        if (getsockopt(connectSocket_fd,  SOL_SOCKET, SO_PEERCRED, &ucred, &len) == -1) {
+            fprintf(stderr, "Error: Sockopt failed.");
+            exit(EXIT_FAILURE);
+        }
+        client->sock = connectSocket_fd;
+        client->uid = ucred.uid;
+        for (int i = 0; i < FILE_TABLE_SIZE; i++) {
+            client->file_table[i].file_perm = NONE;
+            client->file_table[i].file_inumber = -1;
+        }
+        client->pending = NULL;
+        client->pendingLength = client->pendingCapacity = 0;
+        client->output = NULL;
+        client->outputSent = client->outputLength = client->outputCapacity = 0;
+        client->closing = 0;
+        armSocket(connectSocket_fd, client, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fprintf(stderr, "Error: Connection failure.\n");
+        exit(EXIT_FAILURE);
+    }
+    // Not re-armed once termination took the listening socket out of the epoll set
+    if (pthread_mutex_lock(&condLock) != 0) {
+        fprintf(stderr, "Error: Mutex lock failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!shuttingDown)
+        armSocket(tecnicofs_fd, NULL, EPOLL_CTL_MOD, EPOLLIN);
+    if (pthread_mutex_unlock(&condLock) != 0) {
+        fprintf(stderr, "Error: Mutex unlock failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Waits for the client to send more, or to take its output first: no
+ * request of a client is read while its responses are backed up */
+static void armClient(session* client) {
+    armSocket(client->sock, client, EPOLL_CTL_MOD, client->outputLength > 0 ? EPOLLOUT : EPOLLIN);
+}
+
+/* Sends what a client's socket didn't take before, then reads what
+ * the client has sent and applies every complete request in it, in
+ * order, stopping while the responses are backed up. The client is
+ * closed when it unmounts, drops the connection or sends a frame
+ * that breaks the protocol. */
+void serveClient(session* client) {
+    ssize_t readSize;
+    char* data;
+    size_t length, consumed = 0;
+    int finished = 0;
+
+    if (client->outputLength > 0) {
+        if (drainOutput(client) != 0 || (client->closing && client->outputLength == 0)) {
+            closeClient(client);
+            return;
+        }
+        if (client->outputLength > 0) {
+            armClient(client);
+            return;
+        }
+    }
+
+    if ((readSize = recv(client->sock, receiveBuffer, RECEIVE_SIZE, MSG_DONTWAIT)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            closeClient(client);
+            return;
+        }
+        if (client->pendingLength == 0) {
+            armClient(client);
+            return;
+        }
+        readSize = 0; // Requests left while the responses were backed up
+    } else if (readSize == 0) {
+        closeClient(client);
+        return;
+    }
+
+    if (client->pendingLength > 0) {
+        reserveBuffer(&client->pending, &client->pendingCapacity, client->pendingLength + readSize);
+        memcpy(client->pending + client->pendingLength, receiveBuffer, readSize);
+        client->pendingLength += readSize;
+        data = client->pending;
+        length = client->pendingLength;
+    } else {
+        data = receiveBuffer;
+        length = readSize;
+    }
+
+    while (length - consumed >= sizeof(tfs_header) && client->outputLength == 0) {
+        tfs_header header;
+        memcpy(&header, data + consumed, sizeof(header));
+        if (header.payloadLength > TFS_MAX_PAYLOAD_SIZE) {
+            finished = 1;
+            break;
+        }
+        if (length - consumed < sizeof(header) + header.payloadLength)
+            break;
+        if (header.opcode == TFS_OP_UNMOUNT) {
+            client->closing = 1;
+            break;
+        }
+        uint64_t start = stats_now();
+        if (applyCommands(client, &header, data + consumed + sizeof(header)) != 0) {
+            finished = 1;
+            break;
+        }
+        stats_command(header.opcode, stats_now() - start); // Without the wait for the log, shared by the whole batch
+        consumed += sizeof(header) + header.payloadLength;
+    }
+
+    if (flushReplies(client) != 0 || finished || (client->closing && client->outputLength == 0)) {
+        closeClient(client);
+        return;
+    }
+
+    // Keep the unfinished request, idle clients hold no buffer
+    length -= consumed;
+    if (length == 0) {
+        free(client->pending);
+        client->pending = NULL;
+        client->pendingCapacity = 0;
+    } else {
+        reserveBuffer(&client->pending, &client->pendingCapacity, length);
+        memmove(client->pending, data + consumed, length);
+    }
+    client->pendingLength = length;
+    armClient(client);
+}
+
+/* Worker threads all wait on the same epoll set, which hands each
+ * ready socket to exactly one of them. The listening socket is
+ * served like any client, by whichever worker picks it up. */
+void* workerLoop(void* arg) {
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Epoll wait failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == NULL)
+                acceptClients();
+            else
+                serveClient(events[i].data.ptr);
+        }
+    }
     return NULL;
 }
 
@@ -375,6 +1182,13 @@ void termination(int term) {
         exit(EXIT_FAILURE);
     }
 
+    // Workers accept clients, so they are stopped before waiting for the last one to leave
+    shuttingDown = 1;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tecnicofs_fd, NULL) != 0) {
+        fprintf(stderr, "Error: Epoll control failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
     while (activeClients != 0) {
         if (pthread_cond_wait(&cond, &condLock) != 0) {
             fprintf(stderr, "Error: Cond wait faileed.\n");
@@ -386,12 +1200,16 @@ void termination(int term) {
         exit(EXIT_FAILURE);
     }
 
-    if (close(tecnicofs_fd) != 0) {
-        fprintf(stderr, "Error: Close failed.\n");
+    /* The listening socket and the epoll set stay open until the server
+     * exits: a worker may still be in accept, and workers go back to
+     * waiting on the set once their last client is closed */
+
+    if (fflush(output) != 0) {
+        fprintf(stderr, "Error: Flush failed.\n");
         exit(EXIT_FAILURE);
     }
-
-    print_tecnicofs_tree(output, fs);
+    const char* sortedDump = getenv(SORTED_DUMP_ENV);
+    dump_tecnicofs(fs, fileno(output), sortedDump && strcmp(sortedDump, "1") == 0);
 
     if (pthread_mutex_destroy(&condLock) != 0) {
         fprintf(stderr, "Error: Mutex destroy failed.\n");
@@ -415,6 +1233,8 @@ void termination(int term) {
         exit(EXIT_FAILURE);
     }
 
+    wal_close();
+
     inode_table_destroy();
 
     free_tecnicofs(fs);
@@ -425,15 +1245,22 @@ void termination(int term) {
 int main(int argc, char* argv[]) {
 
     int err;
-    srand(time(NULL)); // Seeding the random number generator used by the function rand
     
     parseArgs(argc, argv); 
     if (numberBuckets <= 0) {
         fprintf(stderr, "Error: Please use atleast one bucket.\n");
         exit(EXIT_FAILURE);
     }
+    if (delay_configure(getenv(DELAY_ENV)) != 0) {
+        fprintf(stderr, "Error: Invalid %s, expected e.g. search=5000,insert,remove.\n", DELAY_ENV);
+        exit(EXIT_FAILURE);
+    }
     fs = new_tecnicofs();
     inode_table_init();
+    if (dataDirectory[0] != '\0') {
+        wal_open(dataDirectory, fs);
+        directory_rebuild(fs);
+    }
 
     // File opening 
     output = fopen(outputFile,"w");
@@ -470,8 +1297,7 @@ int main(int argc, char* argv[]) {
     struct sockaddr_un server_sockaddr;
     memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
 
-    int connectSocket_fd; 
-    if ((tecnicofs_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == 0) {
+    if ((tecnicofs_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) == 0) {
         fprintf(stderr, "Error: Socket failure.\n");
         exit(EXIT_FAILURE);
     }
@@ -485,41 +1311,45 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(tecnicofs_fd, 5) < 0) {
+    if (listen(tecnicofs_fd, SOMAXCONN) < 0) {
             fprintf(stderr, "Error: Listen failure.\n");
             exit(EXIT_FAILURE);
         }
+
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Error: Epoll creation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    armSocket(tecnicofs_fd, NULL, EPOLL_CTL_ADD, EPOLLIN);
     
     if ((err = gettimeofday(&start, NULL) != 0)) { 
         fprintf(stderr, "Error: Couldn't gettimeofday\n"); 
         exit(EXIT_FAILURE);
     } 
 
-    while (1) {
-        socklen_t addr_size = sizeof(server_sockaddr);
-        if ((connectSocket_fd = accept(tecnicofs_fd, (struct sockaddr*)&server_sockaddr, &addr_size)) < 0) {
-            fprintf(stderr, "Error: Connection failure.\n");
+    // Worker handling, one per core. SIGINT stays blocked in the workers so termination runs on the main thread
+
+    if ((numberWorkers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+        numberWorkers = 1;
+    }
+    pthread_t tid[numberWorkers];
+
+    if (pthread_sigmask(SIG_BLOCK, &sig_set, NULL) != 0) {
+        fprintf(stderr, "Error: Sigmask failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numberWorkers; i++) {
+        if (pthread_create(&tid[i], NULL, workerLoop, NULL) != 0) {
+            fprintf(stderr, "Error: Couldn't create worker thread.");
             exit(EXIT_FAILURE);
-        } else {
-            acceptedClients++;
-            if (pthread_mutex_lock(&condLock) != 0) {
-                fprintf(stderr, "Error: Mutex lock failed.\n");
-                exit(EXIT_FAILURE);
-            }
-            activeClients++;
-            if (pthread_mutex_unlock(&condLock) != 0) {
-                fprintf(stderr, "Error: Mutex unlock failed\n");
-                exit(EXIT_FAILURE);
-            }
-            socklen_t len = sizeof(struct ucred);
-            if (getsockopt(connectSocket_fd,  SOL_SOCKET, SO_PEERCRED, &ucred, &len) == -1) {
-                fprintf(stderr, "Error: Sockopt failed.");
-                exit(EXIT_FAILURE);
-            }
-            if (pthread_create(&tid[acceptedClients], NULL, applyCommands, (void*)&connectSocket_fd) != 0) {
-                fprintf(stderr, "Error: Couldn't create thread for client.");
-                exit(EXIT_FAILURE);
-            } 
-        }
+        } 
+    }
+    if (pthread_sigmask(SIG_UNBLOCK, &sig_set, NULL) != 0) {
+        fprintf(stderr, "Error: Sigmask failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        pause(); // Until termination exits the server
     }
 }
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "fs.h"
+#include "lib/inodes.h"
+
+#define WRITE_BUFFER_SIZE (1 << 20) // Block bytes gathered before each write
+
+static const char zeros[BLOCK_SIZE];
+
+typedef struct section {
+	char* data;
+	size_t length;
+	size_t capacity;
+} section;
+
+/* The file blocks are written as the i-nodes are visited, while the
+ * tables describing them are gathered in memory with offsets relative
+ * to their own section, and written after the blocks once every
+ * section's place in the file is known. */
+typedef struct snapshot_writer {
+	int fd;
+	uint64_t position; // Bytes of the file so far, written or buffered
+	section pending; // Blocks not written yet
+	section inodes;
+	section blockOffsets;
+	section buckets;
+	section entries;
+	section names;
+} snapshot_writer;
+
+static void* reserve_section(section* s, size_t length) {
+	if (s->length + length > s->capacity) {
+		size_t capacity = s->capacity ? s->capacity : 4096;
+		while (capacity < s->length + length)
+			capacity *= 2;
+		if (!(s->data = realloc(s->data, capacity))) {
+			perror("Failed to allocate snapshot");
+			exit(EXIT_FAILURE);
+		}
+		s->capacity = capacity;
+	}
+	void* end = s->data + s->length;
+	s->length += length;
+	return end;
+}
+
+static void write_all(int fd, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write the snapshot");
+			exit(EXIT_FAILURE);
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+static void flush_pending(snapshot_writer* writer) {
+	write_all(writer->fd, writer->pending.data, writer->pending.length);
+	writer->pending.length = 0;
+}
+
+/* Appends bytes to the file, returning their offset */
+static uint64_t put_bytes(snapshot_writer* writer, const void* data, size_t length) {
+	uint64_t offset = writer->position;
+	writer->position += length;
+	if (length >= WRITE_BUFFER_SIZE) {
+		flush_pending(writer);
+		write_all(writer->fd, data, length);
+		return offset;
+	}
+	memcpy(reserve_section(&writer->pending, length), data, length);
+	if (writer->pending.length >= WRITE_BUFFER_SIZE)
+		flush_pending(writer);
+	return offset;
+}
+
+static void put_padding(snapshot_writer* writer, size_t alignment) {
+	if (writer->position % alignment)
+		put_bytes(writer, zeros, alignment - writer->position % alignment);
+}
+
+static void snapshot_inode_visit(int inumber, const inode_t* inode, void* arg) {
+	snapshot_writer* writer = arg;
+	const inode_contents* contents = &inode->contents;
+
+	while (writer->inodes.length / sizeof(snapshot_inode) < (size_t) inumber) { // Free i-nodes in between
+		snapshot_inode* unused = reserve_section(&writer->inodes, sizeof(snapshot_inode));
+		memset(unused, 0, sizeof(snapshot_inode));
+		unused->owner = FREE_INODE;
+	}
+	snapshot_inode* record = reserve_section(&writer->inodes, sizeof(snapshot_inode));
+	memset(record, 0, sizeof(snapshot_inode));
+	record->owner = inode->owner;
+	record->ownerPermissions = inode->ownerPermissions;
+	record->othersPermissions = inode->othersPermissions;
+	record->directory = inode->directory;
+	record->size = contents->size;
+	record->blockCount = (contents->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (record->blockCount > contents->blockSlots)
+		record->blockCount = contents->blockSlots;
+	record->blocksOffset = writer->blockOffsets.length;
+
+	// Blocks hold zeros past the file size, so they are written whole
+	for (size_t i = 0; i < record->blockCount; i++) {
+		uint64_t* offset = reserve_section(&writer->blockOffsets, sizeof(uint64_t));
+		*offset = contents->blocks[i] ? put_bytes(writer, contents->blocks[i], BLOCK_SIZE) : 0;
+	}
+}
+
+/* Adds empty buckets until there are count of them */
+static void add_buckets(snapshot_writer* writer, size_t count) {
+	while (writer->buckets.length / sizeof(snapshot_bucket) < count) {
+		snapshot_bucket* empty = reserve_section(&writer->buckets, sizeof(snapshot_bucket));
+		empty->entriesOffset = writer->entries.length;
+		empty->count = 0;
+	}
+}
+
+static void snapshot_name_visit(unsigned long bucket, const char* key, int inumber, void* arg) {
+	snapshot_writer* writer = arg;
+
+	add_buckets(writer, bucket + 1);
+	((snapshot_bucket*) writer->buckets.data)[bucket].count++;
+
+	snapshot_entry* entry = reserve_section(&writer->entries, sizeof(snapshot_entry));
+	entry->keyOffset = writer->names.length;
+	entry->inumber = inumber;
+	entry->reserved = 0;
+	size_t length = strlen(key) + 1;
+	memcpy(reserve_section(&writer->names, length), key, length);
+}
+
+static uint32_t header_checksum(snapshot_header header) {
+	uint32_t h = 2166136261U; // FNV-1a
+	header.checksum = 0;
+	for (const unsigned char* c = (const unsigned char*) &header; c < (const unsigned char*) (&header + 1); c++) {
+		h ^= *c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Writes the file system to a new snapshot file at path, synced before
+ * it returns. Clients may keep changing it meanwhile, each i-node and
+ * bucket is saved as it was at some point of the writing.
+ * Input:
+ *  - sequence: first log segment whose changes the snapshot may miss
+ */
+void snapshot_write(const char* path, tecnicofs* fs, uint64_t sequence) {
+	snapshot_writer writer;
+	snapshot_header header;
+
+	memset(&writer, 0, sizeof(writer));
+	memset(&header, 0, sizeof(header));
+	if ((writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	put_bytes(&writer, zeros, BLOCK_SIZE); // Room for the header, keeping the blocks aligned
+
+	inode_traverse(snapshot_inode_visit, &writer);
+	unsigned long state = traverse_tecnicofs(fs, snapshot_name_visit, &writer);
+	header.tableState = state;
+	header.bucketCount = ((unsigned long) numberBuckets << (state >> 32)) + (state & 0xffffffffUL); // Level and split pointer, see fs.c
+	add_buckets(&writer, header.bucketCount);
+
+	uint64_t namesOffset = put_bytes(&writer, writer.names.data, writer.names.length);
+	put_padding(&writer, sizeof(uint64_t));
+	snapshot_entry* entries = (snapshot_entry*) writer.entries.data;
+	for (size_t i = 0; i < writer.entries.length / sizeof(snapshot_entry); i++)
+		entries[i].keyOffset += namesOffset;
+	uint64_t entriesOffset = put_bytes(&writer, writer.entries.data, writer.entries.length);
+	snapshot_bucket* buckets = (snapshot_bucket*) writer.buckets.data;
+	for (size_t i = 0; i < header.bucketCount; i++)
+		buckets[i].entriesOffset += entriesOffset;
+	header.bucketsOffset = put_bytes(&writer, writer.buckets.data, writer.buckets.length);
+	uint64_t blockOffsetsOffset = put_bytes(&writer, writer.blockOffsets.data, writer.blockOffsets.length);
+	snapshot_inode* inodes = (snapshot_inode*) writer.inodes.data;
+	header.inodeCount = writer.inodes.length / sizeof(snapshot_inode);
+	for (size_t i = 0; i < header.inodeCount; i++)
+		inodes[i].blocksOffset += blockOffsetsOffset;
+	header.inodesOffset = put_bytes(&writer, writer.inodes.data, writer.inodes.length);
+	flush_pending(&writer);
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.sequence = sequence;
+	header.size = writer.position;
+	header.numberBuckets = numberBuckets;
+	header.checksum = header_checksum(header);
+	if (pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header) || fsync(writer.fd) != 0 || close(writer.fd) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	free(writer.pending.data);
+	free(writer.inodes.data);
+	free(writer.blockOffsets.data);
+	free(writer.buckets.data);
+	free(writer.entries.data);
+	free(writer.names.data);
+}
+
+static int section_fits(const snapshot_header* header, uint64_t offset, uint64_t count, size_t size) {
+	return offset <= header->size && count <= (header->size - offset) / size;
+}
+
+/*
+ * Maps the snapshot file at path and makes it the file system's state,
+ * which must be empty. The mapping is used in place and stays until the
+ * server exits: only the i-node table is rebuilt, pointing at the file
+ * blocks where they lie, and buckets are searched in the file until
+ * first changed. A snapshot taken with another number of buckets is
+ * inserted name by name instead.
+ * Returns:
+ *    the first log segment to replay over the snapshot
+ *   -1: if there is no snapshot
+ */
+long snapshot_load(const char* path, tecnicofs* fs) {
+	struct stat status;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return -1;
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &status) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	// Private and writable, so that writing a block only copies that page
+	char* snapshot = status.st_size >= (off_t) sizeof(snapshot_header) ?
+	                 mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	const snapshot_header* header = (const snapshot_header*) snapshot;
+	if (snapshot == MAP_FAILED || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->checksum != header_checksum(*header) || header->size != (uint64_t) status.st_size ||
+	    !section_fits(header, header->bucketsOffset, header->bucketCount, sizeof(snapshot_bucket)) ||
+	    !section_fits(header, header->inodesOffset, header->inodeCount, sizeof(snapshot_inode))) {
+		fprintf(stderr, "Error: Snapshot %s is corrupt.\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	const snapshot_inode* inodes = (const snapshot_inode*) (snapshot + header->inodesOffset);
+	for (uint64_t i = 0; i < header->inodeCount; i++) {
+		if (inodes[i].owner == FREE_INODE)
+			continue;
+		const uint64_t* offsets = (const uint64_t*) (snapshot + inodes[i].blocksOffset);
+		char** blocks = malloc(inodes[i].blockCount * sizeof(char*));
+		if (inodes[i].blockCount > 0 && !blocks) {
+			perror("Failed to allocate file blocks");
+			exit(EXIT_FAILURE);
+		}
+		for (uint64_t j = 0; j < inodes[i].blockCount; j++)
+			blocks[j] = offsets[j] ? snapshot + offsets[j] : NULL;
+		inode_load(i, inodes[i].owner, inodes[i].ownerPermissions, inodes[i].othersPermissions, inodes[i].directory != 0,
+		           blocks, inodes[i].blockCount, inodes[i].size);
+	}
+
+	if (load_tecnicofs(fs, snapshot) != 0) {
+		const snapshot_bucket* buckets = (const snapshot_bucket*) (snapshot + header->bucketsOffset);
+		for (uint64_t i = 0; i < header->bucketCount; i++) {
+			const snapshot_entry* entries = (const snapshot_entry*) (snapshot + buckets[i].entriesOffset);
+			for (uint64_t j = 0; j < buckets[i].count; j++)
+				create(fs, snapshot + entries[j].keyOffset, entries[j].inumber);
+		}
+	}
+	return header->sequence;
+}
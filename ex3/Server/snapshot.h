@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+
+/* Layout of the snapshot file checkpoints are written to. It holds no
+ * pointers, only offsets from the start of the file, so the server maps
+ * it and uses it in place: buckets are searched in their sorted entry
+ * arrays until first changed, and file blocks are used where they lie,
+ * the kernel copying a block the first time it is written. */
+
+#define SNAPSHOT_MAGIC "TFSSNAP1"
+
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t sequence; // First log segment not covered by the snapshot
+    uint64_t size; // Of the whole file
+    uint32_t numberBuckets; // Buckets of level 0, bucketsOffset only fits a table of that many
+    uint32_t checksum; // Of the header up to here, with this field zeroed
+    uint64_t tableState;
+    uint64_t bucketCount;
+    uint64_t bucketsOffset; // snapshot_bucket[bucketCount]
+    uint64_t inodeCount;
+    uint64_t inodesOffset; // snapshot_inode[inodeCount], indexed by inumber
+} snapshot_header;
+
+typedef struct snapshot_entry {
+    uint64_t keyOffset; // '\0' terminated name
+    int32_t inumber;
+    uint32_t reserved;
+} snapshot_entry;
+
+typedef struct snapshot_bucket {
+    uint64_t entriesOffset; // snapshot_entry[count], sorted by name
+    uint64_t count;
+} snapshot_bucket;
+
+typedef struct snapshot_inode {
+    int32_t owner; // FREE_INODE for i-nodes not in use
+    int32_t ownerPermissions;
+    int32_t othersPermissions;
+    uint32_t directory; // 0 for files, and in snapshots taken before there were directories
+    uint64_t size;
+    uint64_t blockCount;
+    uint64_t blocksOffset; // uint64_t[blockCount] offsets of BLOCK_SIZE aligned blocks, 0 for holes
+} snapshot_inode;
+
+struct tecnicofs;
+
+void snapshot_write(const char* path, struct tecnicofs* fs, uint64_t sequence);
+long snapshot_load(const char* path, struct tecnicofs* fs);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "fs.h"
+
+#define NUMBER_COMMANDS (sizeof(STATS_COMMANDS)) // One per opcode of STATS_COMMANDS and one for the others
+#define CACHE_LINE_SIZE 64
+
+typedef struct stats_shard {
+	uint64_t histograms[NUMBER_COMMANDS][STATS_HISTOGRAM_SIZE]; // Nanoseconds
+	lock_stats locks[STATS_LOCKS]; // Totals of every lock of each kind
+	struct stats_shard* next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_shard;
+
+static stats_shard* shards = NULL; // Only ever grows, the shards of finished threads keep their counts
+static pthread_mutex_t shardsLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_shard* self = NULL;
+static const char* lockNames[STATS_LOCKS] = { "tree", "inode_table", "inode" };
+/* I-node locks are mostly shared by readers, which don't time how long they hold them */
+static const int lockHoldTimed[STATS_LOCKS] = { 1, 1, 0 };
+
+static stats_shard* own_shard() {
+	if (self)
+		return self;
+	if (posix_memalign((void**) &self, CACHE_LINE_SIZE, sizeof(stats_shard)) != 0) {
+		perror("Failed to allocate statistics");
+		exit(EXIT_FAILURE);
+	}
+	memset(self, 0, sizeof(stats_shard));
+	if (pthread_mutex_lock(&shardsLock) != 0) {
+		perror("Failed to acquire the statistics lock.");
+		exit(EXIT_FAILURE);
+	}
+	self->next = shards;
+	__atomic_store_n(&shards, self, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&shardsLock);
+	return self;
+}
+
+/* Counters have a single writer at a time, the thread owning the shard
+ * or the holder of the lock, so they are only stored atomically for
+ * the sake of reports reading them meanwhile */
+static void add(uint64_t* counter, uint64_t value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static void raise_max(uint64_t* max, uint64_t value) {
+	if (value > *max)
+		__atomic_store_n(max, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int histogram_index(uint64_t ns) {
+	if (ns < 2 * STATS_SUB_BUCKETS)
+		return ns;
+	int exponent = 63 - __builtin_clzll(ns); // At least 5
+	return 2 * STATS_SUB_BUCKETS + (exponent - 5) * STATS_SUB_BUCKETS + (int) ((ns >> (exponent - 4)) - STATS_SUB_BUCKETS);
+}
+
+/* Highest latency counted in a bucket */
+static uint64_t histogram_value(int index) {
+	if (index < 2 * STATS_SUB_BUCKETS)
+		return index;
+	int exponent = 5 + (index - 2 * STATS_SUB_BUCKETS) / STATS_SUB_BUCKETS;
+	uint64_t mantissa = STATS_SUB_BUCKETS + (index - 2 * STATS_SUB_BUCKETS) % STATS_SUB_BUCKETS;
+	return ((mantissa + 1) << (exponent - 4)) - 1;
+}
+
+void stats_command(uint8_t opcode, uint64_t ns) {
+	const char* slot = opcode ? strchr(STATS_COMMANDS, opcode) : NULL;
+	size_t command = slot ? (size_t) (slot - STATS_COMMANDS) : NUMBER_COMMANDS - 1;
+	uint64_t* bucket = &own_shard()->histograms[command][histogram_index(ns)];
+	add(bucket, 1);
+}
+
+/* Counts an acquisition of a lock of the given kind, and of lock itself
+ * when it keeps statistics of its own. Must be called holding it. */
+void stats_lock_acquired(lock_stats* lock, stats_lock kind, int contended, uint64_t waitNs) {
+	lock_stats* targets[2] = { &own_shard()->locks[kind], lock };
+	for (int i = 0; i < 2 && targets[i]; i++) {
+		add(&targets[i]->acquisitions, 1);
+		if (contended) {
+			add(&targets[i]->contended, 1);
+			add(&targets[i]->waitNs, waitNs);
+			raise_max(&targets[i]->maxWaitNs, waitNs);
+		}
+	}
+}
+
+/* Counts how long a lock was held, called before releasing it */
+void stats_lock_released(lock_stats* lock, stats_lock kind, uint64_t holdNs) {
+	lock_stats* targets[2] = { &own_shard()->locks[kind], lock };
+	for (int i = 0; i < 2 && targets[i]; i++) {
+		add(&targets[i]->holdNs, holdNs);
+		raise_max(&targets[i]->maxHoldNs, holdNs);
+	}
+}
+
+static void sum_lock(lock_stats* total, const lock_stats* lock) {
+	total->acquisitions += load(&lock->acquisitions);
+	total->contended += load(&lock->contended);
+	total->waitNs += load(&lock->waitNs);
+	total->holdNs += load(&lock->holdNs);
+	uint64_t maxWait = load(&lock->maxWaitNs), maxHold = load(&lock->maxHoldNs);
+	if (maxWait > total->maxWaitNs)
+		total->maxWaitNs = maxWait;
+	if (maxHold > total->maxHoldNs)
+		total->maxHoldNs = maxHold;
+}
+
+typedef struct report {
+	char* text;
+	size_t length;
+	size_t capacity;
+} report;
+
+static void report_printf(report* r, const char* format, ...) {
+	va_list args;
+	while (1) {
+		va_start(args, format);
+		int written = vsnprintf(r->text + r->length, r->capacity - r->length, format, args);
+		va_end(args);
+		if (written < 0) {
+			perror("Failed to format statistics");
+			exit(EXIT_FAILURE);
+		}
+		if ((size_t) written < r->capacity - r->length) {
+			r->length += written;
+			return;
+		}
+		r->capacity = 2 * r->capacity + written + 1; // With the '\0'
+		if (!(r->text = realloc(r->text, r->capacity))) {
+			perror("Failed to allocate statistics");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void report_command(report* r, const char* name, const uint64_t* histogram) {
+	uint64_t count = 0, seen = 0;
+	const double fractions[4] = { 0.5, 0.99, 0.999, 1 };
+	double values[4];
+	int next = 0;
+
+	for (int i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+		count += histogram[i];
+	if (count == 0)
+		return;
+	for (int i = 0; i < STATS_HISTOGRAM_SIZE && next < 4; i++) {
+		seen += histogram[i];
+		while (next < 4 && seen > 0 && seen >= fractions[next] * count)
+			values[next++] = histogram_value(i) / 1e3;
+	}
+	report_printf(r, "command=%s count=%lu p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+	              name, (unsigned long) count, values[0], values[1], values[2], values[3]);
+}
+
+static void report_lock(report* r, const char* key, const char* name, const lock_stats* lock, int holdTimed) {
+	report_printf(r, "%s=%s acquisitions=%lu contended=%lu wait_us=%.1f max_wait_us=%.1f",
+	              key, name, (unsigned long) lock->acquisitions, (unsigned long) lock->contended,
+	              lock->waitNs / 1e3, lock->maxWaitNs / 1e3);
+	if (holdTimed)
+		report_printf(r, " hold_us=%.1f max_hold_us=%.1f", lock->holdNs / 1e3, lock->maxHoldNs / 1e3);
+	report_printf(r, "\n");
+}
+
+typedef struct top_buckets {
+	unsigned long index[STATS_TOP_BUCKETS];
+	lock_stats stats[STATS_TOP_BUCKETS];
+	int count;
+} top_buckets;
+
+/* Keeps the buckets waited for the longest, longest first */
+static void top_bucket_visit(unsigned long bucket, const lock_stats* lock, void* arg) {
+	top_buckets* top = arg;
+	lock_stats copy;
+
+	memset(&copy, 0, sizeof(copy));
+	sum_lock(&copy, lock);
+	if (copy.waitNs == 0)
+		return;
+	int i = top->count < STATS_TOP_BUCKETS ? top->count++ : STATS_TOP_BUCKETS;
+	for (; i > 0 && top->stats[i - 1].waitNs < copy.waitNs; i--) {
+		if (i < STATS_TOP_BUCKETS) {
+			top->index[i] = top->index[i - 1];
+			top->stats[i] = top->stats[i - 1];
+		}
+	}
+	if (i < STATS_TOP_BUCKETS) {
+		top->index[i] = bucket;
+		top->stats[i] = copy;
+	}
+}
+
+/*
+ * Writes the statistics gathered so far as text, one key=value line
+ * per command, kind of lock and most contended bucket, while the
+ * server keeps running.
+ * Returns the text, which the caller frees, and its length in length.
+ */
+char* stats_report(tecnicofs* fs, size_t* length) {
+	report r = { NULL, 0, 0 };
+	lock_stats locks[STATS_LOCKS];
+	top_buckets top;
+	uint64_t (*histograms)[STATS_HISTOGRAM_SIZE] = calloc(NUMBER_COMMANDS, sizeof(*histograms));
+	char name[2] = { 0, 0 };
+
+	if (!histograms) {
+		perror("Failed to allocate statistics");
+		exit(EXIT_FAILURE);
+	}
+	memset(locks, 0, sizeof(locks));
+	for (stats_shard* s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+		for (size_t c = 0; c < NUMBER_COMMANDS; c++) {
+			for (int i = 0; i < STATS_HISTOGRAM_SIZE; i++)
+				histograms[c][i] += load(&s->histograms[c][i]);
+		}
+		for (int l = 0; l < STATS_LOCKS; l++)
+			sum_lock(&locks[l], &s->locks[l]);
+	}
+
+	report_printf(&r, "%s", ""); // Allocates the text, whatever follows
+	for (size_t c = 0; c < NUMBER_COMMANDS; c++) {
+		name[0] = STATS_COMMANDS[c];
+		report_command(&r, c < NUMBER_COMMANDS - 1 ? name : "other", histograms[c]);
+	}
+	for (int l = 0; l < STATS_LOCKS; l++)
+		report_lock(&r, "lock", lockNames[l], &locks[l], lockHoldTimed[l]);
+	top.count = 0;
+	traverse_bucket_locks(fs, top_bucket_visit, &top);
+	for (int i = 0; i < top.count; i++) {
+		char index[24];
+		snprintf(index, sizeof(index), "%lu", top.index[i]);
+		report_lock(&r, "bucket", index, &top.stats[i], 1);
+	}
+	free(histograms);
+	*length = r.length;
+	return r.text;
+}
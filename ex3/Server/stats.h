@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+#include <stddef.h>
+
+/* Live metrics of the server: a latency histogram for every command
+ * and the wait and hold times of the locks. Each thread counts into a
+ * shard of its own that only it writes, and reports add the shards up,
+ * so measuring never makes threads contend. */
+
+#define STATS_SUB_BUCKETS 16 // Histogram buckets per power of two, so latencies are within 1/16
+#define STATS_HISTOGRAM_SIZE (2 * STATS_SUB_BUCKETS + (64 - 5) * STATS_SUB_BUCKETS)
+#define STATS_COMMANDS "cdroxlwCRWatDSme" // Opcodes counted on their own, the others together
+#define STATS_TOP_BUCKETS 8 // Buckets whose locks were waited for the longest, in a report
+
+typedef enum stats_lock { STATS_TREE_LOCKS, STATS_INODE_TABLE_LOCK, STATS_INODE_LOCKS, STATS_LOCKS } stats_lock;
+
+/* Acquisitions of a lock and the time spent waiting for and holding it */
+typedef struct lock_stats {
+    uint64_t acquisitions;
+    uint64_t contended; // Acquisitions that had to wait
+    uint64_t waitNs;
+    uint64_t maxWaitNs;
+    uint64_t holdNs;
+    uint64_t maxHoldNs;
+} lock_stats;
+
+struct tecnicofs;
+
+uint64_t stats_now();
+void stats_command(uint8_t opcode, uint64_t ns);
+void stats_lock_acquired(lock_stats* lock, stats_lock kind, int contended, uint64_t waitNs);
+void stats_lock_released(lock_stats* lock, stats_lock kind, uint64_t holdNs);
+char* stats_report(struct tecnicofs* fs, size_t* length);
+
+#endif /* STATS_H */
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "fs.h"
+#include "lib/inodes.h"
+#include "snapshot.h"
+#include "../Client/tecnicofs-protocol.h"
+
+#define FNV32_OFFSET_BASIS 2166136261U
+#define FNV32_PRIME 16777619U
+#define INITIAL_BUFFER_SIZE (1 << 20) // Of the buffers records are gathered in
+#define MAX_DIRECTORY_SIZE (PATH_MAX - 32) // Leaves room for the file names in it
+
+typedef struct wal_buffer {
+	char* data;
+	size_t length;
+	size_t capacity;
+} wal_buffer;
+
+static tecnicofs* walFs;
+static char walDirectory[MAX_DIRECTORY_SIZE];
+static int walEnabled = 0; // Only set once the log was replayed, so replaying logs nothing
+
+/* The log is a sequence of segments log.<sequence>. Checkpoints write a
+ * snapshot of the state from which the segments since its sequence are
+ * replayed, older segments are deleted once it is written. */
+static unsigned long firstSequence, walSequence;
+static int walFd = -1;
+
+/* Records are appended to a buffer under walLock. The thread that
+ * syncs takes the whole buffer, leaving the spare one for appends,
+ * and writes and syncs it without the lock. Positions in the log
+ * count every byte appended since the server started. */
+static pthread_mutex_t walLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walSynced = PTHREAD_COND_INITIALIZER;
+static wal_buffer appending, spare;
+static uint64_t appendedPosition, durablePosition;
+static int syncing;
+static size_t segmentBytes; // Appended since the last checkpoint started
+static __thread uint64_t threadPosition; // End of the last record the thread appended
+
+static pthread_t checkpointThread;
+static pthread_cond_t checkpointCond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+
+static void lock_wal() {
+	if (pthread_mutex_lock(&walLock) != 0) {
+		fprintf(stderr, "Error: Couldn't lock mutex\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_wal() {
+	if (pthread_mutex_unlock(&walLock) != 0) {
+		fprintf(stderr, "Error: Couldn't unlock mutex\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static uint32_t checksum(uint32_t h, const void* data, size_t length) {
+	for (const unsigned char* c = data; length > 0; c++, length--) {
+		h ^= *c;
+		h *= FNV32_PRIME;
+	}
+	return h;
+}
+
+static void reserve_buffer(wal_buffer* buffer, size_t length) {
+	if (length <= buffer->capacity)
+		return;
+	size_t capacity = buffer->capacity ? buffer->capacity : INITIAL_BUFFER_SIZE;
+	while (capacity < length)
+		capacity *= 2;
+	if (!(buffer->data = realloc(buffer->data, capacity))) {
+		perror("Failed to allocate log buffer");
+		exit(EXIT_FAILURE);
+	}
+	buffer->capacity = capacity;
+}
+
+/* Appends a record made of args and up to two strings or data parts,
+ * returns its size */
+static size_t put_record(wal_buffer* buffer, uint8_t type, const void* args, size_t argsLength,
+                         const void* first, size_t firstLength, const void* second, size_t secondLength) {
+	wal_header header;
+	memset(&header, 0, sizeof(header));
+	header.length = argsLength + firstLength + secondLength;
+	header.type = type;
+	header.checksum = checksum(checksum(checksum(checksum(FNV32_OFFSET_BASIS, &header.type, 1),
+	                           args, argsLength), first, firstLength), second, secondLength);
+
+	size_t size = sizeof(header) + header.length;
+	reserve_buffer(buffer, buffer->length + size);
+	char* end = buffer->data + buffer->length;
+	memcpy(end, &header, sizeof(header));
+	memcpy(end + sizeof(header), args, argsLength);
+	if (firstLength > 0)
+		memcpy(end + sizeof(header) + argsLength, first, firstLength);
+	if (secondLength > 0)
+		memcpy(end + sizeof(header) + argsLength + firstLength, second, secondLength);
+	buffer->length += size;
+	return size;
+}
+
+static void log_record(uint8_t type, const void* args, size_t argsLength,
+                       const void* first, size_t firstLength, const void* second, size_t secondLength) {
+	if (!walEnabled)
+		return;
+	lock_wal();
+	size_t size = put_record(&appending, type, args, argsLength, first, firstLength, second, secondLength);
+	appendedPosition += size;
+	threadPosition = appendedPosition;
+	if (segmentBytes < WAL_CHECKPOINT_SIZE && segmentBytes + size >= WAL_CHECKPOINT_SIZE)
+		pthread_cond_signal(&checkpointCond);
+	segmentBytes += size;
+	unlock_wal();
+}
+
+static void write_all(int fd, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to write the log");
+			exit(EXIT_FAILURE);
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+static void sync_file(int fd) {
+	if (fdatasync(fd) != 0) {
+		perror("Failed to sync the log");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sync_directory() {
+	int fd = open(walDirectory, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || fsync(fd) != 0) {
+		perror(walDirectory);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+static void segment_path(char* path, unsigned long sequence) {
+	snprintf(path, PATH_MAX, "%s/log.%08lu", walDirectory, sequence);
+}
+
+static int open_segment(unsigned long sequence) {
+	char path[PATH_MAX];
+	segment_path(path, sequence);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* Hands the appended records to the caller, who becomes the only
+ * thread syncing. Called with walLock held. */
+static wal_buffer start_sync(uint64_t* position) {
+	wal_buffer batch = appending;
+	appending = spare;
+	*position = appendedPosition;
+	syncing = 1;
+	return batch;
+}
+
+static void finish_sync(wal_buffer batch, uint64_t position) {
+	batch.length = 0;
+	spare = batch;
+	__atomic_store_n(&durablePosition, position, __ATOMIC_RELEASE);
+	syncing = 0;
+	pthread_cond_broadcast(&walSynced);
+}
+
+/* Group commit: whoever finds no sync running writes and syncs every
+ * record appended so far, everyone else waits for the syncs running
+ * to cover their records. Called with walLock held. */
+static void sync_until(uint64_t position) {
+	while (__atomic_load_n(&durablePosition, __ATOMIC_ACQUIRE) < position) {
+		if (syncing) {
+			pthread_cond_wait(&walSynced, &walLock);
+			continue;
+		}
+		uint64_t batchPosition;
+		wal_buffer batch = start_sync(&batchPosition);
+		int fd = walFd;
+		unlock_wal();
+		write_all(fd, batch.data, batch.length);
+		sync_file(fd);
+		lock_wal();
+		finish_sync(batch, batchPosition);
+	}
+}
+
+/* Returns once every change the calling thread logged is durable.
+ * Meant to be called before answering the requests that made them. */
+void wal_commit() {
+	if (!walEnabled || __atomic_load_n(&durablePosition, __ATOMIC_ACQUIRE) >= threadPosition)
+		return;
+	lock_wal();
+	sync_until(threadPosition);
+	unlock_wal();
+}
+
+/* Moves appends to a new segment and makes the old one durable.
+ * Returns the sequence of the new segment. */
+static unsigned long rotate_segment() {
+	lock_wal();
+	while (syncing)
+		pthread_cond_wait(&walSynced, &walLock);
+	uint64_t batchPosition;
+	wal_buffer batch = start_sync(&batchPosition);
+	int oldFd = walFd;
+	walFd = open_segment(++walSequence);
+	unsigned long sequence = walSequence;
+	segmentBytes = 0;
+	unlock_wal();
+
+	write_all(oldFd, batch.data, batch.length);
+	sync_file(oldFd);
+	close(oldFd);
+	sync_directory();
+
+	lock_wal();
+	finish_sync(batch, batchPosition);
+	unlock_wal();
+	return sequence;
+}
+
+/* Writes the state to a new snapshot while clients keep changing it.
+ * Every change made after the log rotation is in the new segments, and
+ * replaying them over any state seen since the rotation gives the same
+ * result, so the snapshot needs no consistent view of the state. */
+static void write_checkpoint() {
+	char path[PATH_MAX], tmpPath[PATH_MAX];
+	unsigned long sequence = rotate_segment();
+
+	snprintf(path, PATH_MAX, "%s/snapshot", walDirectory);
+	snprintf(tmpPath, PATH_MAX, "%s/snapshot.tmp", walDirectory);
+	snapshot_write(tmpPath, walFs, sequence);
+	if (rename(tmpPath, path) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	sync_directory();
+
+	for (; firstSequence < sequence; firstSequence++) {
+		segment_path(path, firstSequence);
+		unlink(path);
+	}
+}
+
+static void* checkpointLoop(void* arg) {
+	lock_wal();
+	while (!stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += WAL_CHECKPOINT_INTERVAL;
+		while (!stopping && segmentBytes < WAL_CHECKPOINT_SIZE) {
+			if (pthread_cond_timedwait(&checkpointCond, &walLock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		if (stopping || segmentBytes == 0) // Nothing changed since the last checkpoint
+			continue;
+		unlock_wal();
+		write_checkpoint();
+		lock_wal();
+	}
+	unlock_wal();
+	return NULL;
+}
+
+/* A crash between the records of one request, such as those of the
+ * i-node and the name of a create, leaves an i-node no name refers to
+ * or a name of a free i-node, neither ever acknowledged. Only i-nodes
+ * and names of the replayed records can be left so, and they are
+ * gathered while replaying, so checking them doesn't take longer as
+ * the file system grows. */
+typedef struct replay_check {
+	wal_buffer inumbers; // Of created i-nodes and deleted names
+	wal_buffer names; // Created or renamed to, '\0' terminated one after the other
+} replay_check;
+
+static replay_check replayCheck;
+
+static void check_inumber(int inumber) {
+	reserve_buffer(&replayCheck.inumbers, replayCheck.inumbers.length + sizeof(int));
+	memcpy(replayCheck.inumbers.data + replayCheck.inumbers.length, &inumber, sizeof(int));
+	replayCheck.inumbers.length += sizeof(int);
+}
+
+static void check_name(const char* name) {
+	size_t length = strlen(name) + 1;
+	reserve_buffer(&replayCheck.names, replayCheck.names.length + length);
+	memcpy(replayCheck.names.data + replayCheck.names.length, name, length);
+	replayCheck.names.length += length;
+}
+
+static int compare_inumbers(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+static void drop_incomplete_requests() {
+	wal_buffer named = { NULL, 0, 0 }; // Inumbers the checked names refer to
+	for (size_t i = 0; i < replayCheck.names.length; i += strlen(replayCheck.names.data + i) + 1) {
+		char* name = replayCheck.names.data + i;
+		int inumber = lookup(walFs, name);
+		if (inumber == -1)
+			continue;
+		if (!inode_in_use(inumber)) {
+			delete(walFs, name);
+			continue;
+		}
+		reserve_buffer(&named, named.length + sizeof(int));
+		memcpy(named.data + named.length, &inumber, sizeof(int));
+		named.length += sizeof(int);
+	}
+	if (named.length > 0)
+		qsort(named.data, named.length / sizeof(int), sizeof(int), compare_inumbers);
+	for (size_t i = 0; i < replayCheck.inumbers.length; i += sizeof(int)) {
+		int inumber;
+		memcpy(&inumber, replayCheck.inumbers.data + i, sizeof(int));
+		if (inode_in_use(inumber) &&
+		    (named.length == 0 || !bsearch(&inumber, named.data, named.length / sizeof(int), sizeof(int), compare_inumbers)))
+			inode_delete(inumber);
+	}
+	free(named.data);
+	free(replayCheck.inumbers.data);
+	free(replayCheck.names.data);
+}
+
+static void replay_name(const char* name, int inumber) {
+	int current = lookup(walFs, (char*) name);
+	if (current == inumber)
+		return;
+	if (current != -1)
+		delete(walFs, (char*) name);
+	create(walFs, (char*) name, inumber);
+}
+
+static int get_name(char* name, const char* data, size_t length) {
+	if (length == 0 || length > TFS_MAX_NAME_SIZE || memchr(data, '\0', length))
+		return -1;
+	memcpy(name, data, length);
+	name[length] = '\0';
+	return 0;
+}
+
+/* Applies a record to the state. Each one sets what it changed rather
+ * than repeating the change, so applying a record the state already
+ * reflects leaves it as it was. Returns -1 if the record is malformed. */
+static int replay_record(uint8_t type, const char* payload, size_t length) {
+	char name[TFS_MAX_NAME_SIZE + 1], newName[TFS_MAX_NAME_SIZE + 1];
+
+	switch (type) {
+		case WAL_INODE_CREATE:
+		case WAL_DIRECTORY_CREATE: {
+			wal_inode_args args;
+			if (length != sizeof(args))
+				return -1;
+			memcpy(&args, payload, sizeof(args));
+			inode_restore(args.inumber, args.owner, args.ownerPermissions, args.othersPermissions,
+			              type == WAL_DIRECTORY_CREATE);
+			check_inumber(args.inumber);
+			return 0;
+		}
+		case WAL_INODE_DELETE:
+		case WAL_INODE_SET: {
+			int32_t inumber;
+			if (length < sizeof(inumber) || (type == WAL_INODE_DELETE && length != sizeof(inumber)))
+				return -1;
+			memcpy(&inumber, payload, sizeof(inumber));
+			if (type == WAL_INODE_DELETE)
+				inode_restore(inumber, FREE_INODE, 0, 0, 0);
+			else if (inode_in_use(inumber)) // Deleted later on, before the snapshot saw it
+				inode_set(inumber, payload + sizeof(inumber), length - sizeof(inumber));
+			return 0;
+		}
+		case WAL_WRITE_AT:
+		case WAL_TRUNCATE: {
+			wal_offset_args args;
+			if (length < sizeof(args) || (type == WAL_TRUNCATE && length != sizeof(args)))
+				return -1;
+			memcpy(&args, payload, sizeof(args));
+			if (!inode_in_use(args.inumber))
+				return 0;
+			if (type == WAL_WRITE_AT)
+				inode_write(args.inumber, payload + sizeof(args), length - sizeof(args), args.offset);
+			else
+				inode_truncate(args.inumber, args.offset);
+			return 0;
+		}
+		case WAL_NAME_CREATE:
+		case WAL_NAME_DELETE:
+		case WAL_NAME_RENAME: {
+			wal_name_args args;
+			if (length < sizeof(args))
+				return -1;
+			memcpy(&args, payload, sizeof(args));
+			payload += sizeof(args);
+			length -= sizeof(args);
+			if (args.nameLength > length || get_name(name, payload, args.nameLength) != 0)
+				return -1;
+			if (type == WAL_NAME_CREATE) {
+				if (length != args.nameLength)
+					return -1;
+				replay_name(name, args.inumber);
+				check_name(name);
+			} else if (type == WAL_NAME_DELETE) {
+				if (length != args.nameLength)
+					return -1;
+				delete(walFs, name);
+				check_inumber(args.inumber);
+			} else {
+				if (get_name(newName, payload + args.nameLength, length - args.nameLength) != 0)
+					return -1;
+				replay_name(newName, args.inumber);
+				check_name(newName);
+				if (lookup(walFs, name) == args.inumber) // The old name may have been reused since
+					delete(walFs, name);
+			}
+			return 0;
+		}
+		default:
+			return -1;
+	}
+}
+
+/* Replays the records of a log segment up to the first one that is
+ * torn or corrupt. Returns the length of what was replayed, or -1 if
+ * the segment doesn't exist. */
+static long replay_segment(const char* path) {
+	struct stat status;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return -1;
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &status) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	size_t size = status.st_size, offset = 0;
+	char* data = NULL;
+	if (size > 0 && (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	while (size - offset >= sizeof(wal_header)) {
+		wal_header header;
+		memcpy(&header, data + offset, sizeof(header));
+		const char* payload = data + offset + sizeof(header);
+		if (header.length > size - offset - sizeof(header) ||
+		    checksum(checksum(FNV32_OFFSET_BASIS, &header.type, 1), payload, header.length) != header.checksum ||
+		    replay_record(header.type, payload, header.length) != 0)
+			break;
+		offset += sizeof(header) + header.length;
+	}
+	if (data)
+		munmap(data, size);
+	return offset;
+}
+
+/* Rebuilds the state from the snapshot and the log in directory,
+ * creating it if needed, and starts logging every change to it. Must
+ * be called before any change is made. */
+void wal_open(const char* directory, tecnicofs* fs) {
+	char path[PATH_MAX];
+
+	walFs = fs;
+	strncpy(walDirectory, directory, MAX_DIRECTORY_SIZE - 1);
+	if (mkdir(walDirectory, 0777) != 0 && errno != EEXIST) {
+		perror(walDirectory);
+		exit(EXIT_FAILURE);
+	}
+
+	snprintf(path, PATH_MAX, "%s/snapshot", walDirectory);
+	long sequence = snapshot_load(path, fs);
+	firstSequence = sequence == -1 ? 0 : sequence;
+	snprintf(path, PATH_MAX, "%s/snapshot.tmp", walDirectory);
+	unlink(path); // Left by a checkpoint that didn't finish
+	for (unsigned long older = firstSequence; older-- > 0;) { // Left by one that didn't delete them
+		segment_path(path, older);
+		if (unlink(path) != 0)
+			break;
+	}
+
+	/* Records after a torn one were never acknowledged, since each sync
+	 * covers everything appended before it, so the log ends there */
+	for (walSequence = firstSequence;; walSequence++) {
+		segment_path(path, walSequence);
+		long replayed = replay_segment(path);
+		if (replayed == -1)
+			break;
+		struct stat status;
+		if (stat(path, &status) == 0 && status.st_size != replayed) {
+			if (truncate(path, replayed) != 0) {
+				perror(path);
+				exit(EXIT_FAILURE);
+			}
+			for (unsigned long later = walSequence + 1;; later++) {
+				segment_path(path, later);
+				if (unlink(path) != 0)
+					break;
+			}
+		}
+	}
+	drop_incomplete_requests();
+	inode_rebuild_free_list();
+
+	walFd = open_segment(walSequence);
+	sync_directory();
+	walEnabled = 1;
+	if (pthread_create(&checkpointThread, NULL, checkpointLoop, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't create checkpoint thread.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Writes a last checkpoint, so the next start replays no log, and
+ * stops logging. Must be called once no more changes are made. */
+void wal_close() {
+	if (!walEnabled)
+		return;
+	lock_wal();
+	stopping = 1;
+	pthread_cond_signal(&checkpointCond);
+	unlock_wal();
+	if (pthread_join(checkpointThread, NULL) != 0) {
+		fprintf(stderr, "Error: Couldn't join checkpoint thread.\n");
+		exit(EXIT_FAILURE);
+	}
+	write_checkpoint();
+	walEnabled = 0;
+	close(walFd);
+	free(appending.data);
+	free(spare.data);
+}
+
+void wal_log_inode_create(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory) {
+	wal_inode_args args = { inumber, owner, ownerPerm, othersPerm };
+	log_record(directory ? WAL_DIRECTORY_CREATE : WAL_INODE_CREATE, &args, sizeof(args), NULL, 0, NULL, 0);
+}
+
+void wal_log_inode_delete(int inumber) {
+	int32_t args = inumber;
+	log_record(WAL_INODE_DELETE, &args, sizeof(args), NULL, 0, NULL, 0);
+}
+
+void wal_log_inode_set(int inumber, const char* contents, int len) {
+	int32_t args = inumber;
+	log_record(WAL_INODE_SET, &args, sizeof(args), contents, len, NULL, 0);
+}
+
+void wal_log_write(int inumber, const char* buffer, int len, long offset) {
+	wal_offset_args args = { inumber, offset };
+	log_record(WAL_WRITE_AT, &args, sizeof(args), buffer, len, NULL, 0);
+}
+
+void wal_log_truncate(int inumber, long size) {
+	wal_offset_args args = { inumber, size };
+	log_record(WAL_TRUNCATE, &args, sizeof(args), NULL, 0, NULL, 0);
+}
+
+void wal_log_name_create(const char* name, int inumber) {
+	wal_name_args args = { inumber, strlen(name) };
+	log_record(WAL_NAME_CREATE, &args, sizeof(args), name, args.nameLength, NULL, 0);
+}
+
+void wal_log_name_delete(const char* name, int inumber) {
+	wal_name_args args = { inumber, strlen(name) };
+	log_record(WAL_NAME_DELETE, &args, sizeof(args), name, args.nameLength, NULL, 0);
+}
+
+void wal_log_name_rename(const char* name, const char* rename, int inumber) {
+	wal_name_args args = { inumber, strlen(name) };
+	log_record(WAL_NAME_RENAME, &args, sizeof(args), name, args.nameLength, rename, strlen(rename));
+}
@@ -0,0 +1,69 @@
+#ifndef WAL_H
+#define WAL_H
+#include <stdint.h>
+#include <sys/types.h>
+#include "../Client/tecnicofs-api-constants.h"
+
+struct tecnicofs;
+
+#define WAL_CHECKPOINT_SIZE (64L << 20) // Log bytes after which a snapshot is written
+#define WAL_CHECKPOINT_INTERVAL 60 // Seconds between checkpoints of a log that grows slowly
+
+/* Every change to the namespace or the i-nodes is appended to the log
+ * while the changed object is still locked, so the log holds the
+ * changes of each object in the order they were made. The log is
+ * only written and synced once per group of changes: a thread that
+ * needs its changes durable either syncs everything appended so far
+ * or waits for the sync already running to cover them. */
+
+typedef enum wal_type {
+	WAL_INODE_CREATE = 1,
+	WAL_INODE_DELETE,
+	WAL_INODE_SET,
+	WAL_WRITE_AT,
+	WAL_TRUNCATE,
+	WAL_NAME_CREATE,
+	WAL_NAME_DELETE,
+	WAL_NAME_RENAME,
+	WAL_DIRECTORY_CREATE
+} wal_type;
+
+/* Every record starts with this header, length being the number of
+ * bytes that follow it and checksum covering the type and those bytes */
+typedef struct __attribute__((packed)) wal_header {
+	uint32_t length;
+	uint32_t checksum;
+	uint8_t type;
+	uint8_t reserved[3];
+} wal_header;
+
+typedef struct __attribute__((packed)) wal_inode_args {
+	int32_t inumber;
+	int32_t owner;
+	int32_t ownerPermissions;
+	int32_t othersPermissions;
+} wal_inode_args; // WAL_INODE_CREATE and WAL_DIRECTORY_CREATE, only inumber for WAL_INODE_DELETE and WAL_INODE_SET (followed by the contents)
+
+typedef struct __attribute__((packed)) wal_offset_args {
+	int32_t inumber;
+	int64_t offset;
+} wal_offset_args; // WAL_WRITE_AT followed by the data, WAL_TRUNCATE with the new size as offset
+
+typedef struct __attribute__((packed)) wal_name_args {
+	int32_t inumber;
+	uint16_t nameLength;
+} wal_name_args; // Followed by the name, and for WAL_NAME_RENAME by the new name
+
+void wal_open(const char* directory, struct tecnicofs* fs);
+void wal_close();
+void wal_commit();
+void wal_log_inode_create(int inumber, uid_t owner, permission ownerPerm, permission othersPerm, int directory);
+void wal_log_inode_delete(int inumber);
+void wal_log_inode_set(int inumber, const char* contents, int len);
+void wal_log_write(int inumber, const char* buffer, int len, long offset);
+void wal_log_truncate(int inumber, long size);
+void wal_log_name_create(const char* name, int inumber);
+void wal_log_name_delete(const char* name, int inumber);
+void wal_log_name_rename(const char* name, const char* rename, int inumber);
+
+#endif /* WAL_H */